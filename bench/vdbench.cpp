@@ -0,0 +1,300 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <benchmark/benchmark.h>
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+#include "ncIVDParserEx.h"
+#include "areamap.h"
+#include "vdwriter.h"
+#include "vdstats.h"
+
+using namespace std;
+
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
+#define GiB            (MiB * 1024ULL)
+
+/* Command line knobs, given before the Google Benchmark flags:
+*  --vd_dir=PATH         where the synthetic images go (default: temp dir)
+*  --vd_size=GiB         virtual size of every image
+*  --vd_block=MiB        block size of every image
+*  --vd_fill=R           fraction of allocated blocks in the base image
+*  --vd_delta_fill=R     fraction of allocated blocks in each chain delta
+*  --vd_frag=R           chance an allocated block starts a new run
+*  --vd_partial=R        fraction of delta blocks with only some sectors
+*  --vd_depth=N          deepest chain measured by the merge benchmarks
+*  --vd_keep             leave the images behind */
+struct BenchConfig {
+    std::string dir;
+    uint64_t size;
+    uint32_t blockSize;
+    double fill;
+    double deltaFill;
+    double fragmentation;
+    double partial;
+    unsigned depth;
+    bool keep;
+};
+
+struct BenchImage {
+    std::string name;
+    std::string path;
+    uint64_t blocks;
+};
+
+static BenchConfig g_config = { "", 1024 * GiB, 2 * MiB, 0.5, 0.05, 0.1, 0, 16, false };
+static std::vector<std::string> g_created;
+
+static bool parseFlag(const char *arg, const char *name, const char **value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0) {
+        return false;
+    }
+    if (arg[len] == '=') {
+        *value = arg + len + 1;
+        return true;
+    }
+    if (arg[len] == '\0') {
+        *value = "";
+        return true;
+    }
+    return false;
+}
+
+/* Strip the --vd_ flags from argv, leaving the rest to benchmark::Initialize. */
+static void parseConfig(int & argc, char **argv)
+{
+    int out = 1;
+    for (int i = 1; i < argc; ++i) {
+        const char *value;
+        if (parseFlag(argv[i], "--vd_dir", &value)) {
+            g_config.dir = value;
+        }
+        else if (parseFlag(argv[i], "--vd_size", &value)) {
+            g_config.size = strtoull(value, NULL, 10) * GiB;
+        }
+        else if (parseFlag(argv[i], "--vd_block", &value)) {
+            g_config.blockSize = (uint32_t)strtoul(value, NULL, 10) * MiB;
+        }
+        else if (parseFlag(argv[i], "--vd_fill", &value)) {
+            g_config.fill = atof(value);
+        }
+        else if (parseFlag(argv[i], "--vd_delta_fill", &value)) {
+            g_config.deltaFill = atof(value);
+        }
+        else if (parseFlag(argv[i], "--vd_frag", &value)) {
+            g_config.fragmentation = atof(value);
+        }
+        else if (parseFlag(argv[i], "--vd_partial", &value)) {
+            g_config.partial = atof(value);
+        }
+        else if (parseFlag(argv[i], "--vd_depth", &value)) {
+            g_config.depth = (unsigned)strtoul(value, NULL, 10);
+        }
+        else if (parseFlag(argv[i], "--vd_keep", &value)) {
+            g_config.keep = true;
+        }
+        else {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    if (g_config.dir.empty()) {
+        const char *tmp = getenv("TMPDIR");
+        g_config.dir = tmp && *tmp ? tmp : "/tmp";
+    }
+    if (g_config.depth == 0) {
+        g_config.depth = 1;
+    }
+}
+
+static size_t peakRss()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss;
+#else
+    return (size_t)usage.ru_maxrss * KiB;
+#endif
+#endif
+}
+
+static void setRssCounter(benchmark::State & state)
+{
+    state.counters["peak_rss_MiB"] = benchmark::Counter((double)peakRss() / MiB);
+}
+
+/* Write one image of the chain, a dynamic base when parent is NULL and a
+* differencing delta on top of parent otherwise. */
+static BenchImage makeImage(bool vhdx, const std::string & name, const BenchImage *parent, uint64_t seed)
+{
+    VDImageSpec spec;
+    if (vhdx) {
+        spec.type = parent ? VD_IMAGE_VHDX_DIFFERENCING : VD_IMAGE_VHDX_DYNAMIC;
+    }
+    else {
+        spec.type = parent ? VD_IMAGE_VHD_DIFFERENCING : VD_IMAGE_VHD_DYNAMIC;
+    }
+    spec.virtualSize = g_config.size;
+    spec.blockSize = g_config.blockSize;
+    spec.fillRatio = parent ? g_config.deltaFill : g_config.fill;
+    spec.fragmentation = g_config.fragmentation;
+    spec.partialRatio = parent ? g_config.partial : 0;
+    spec.seed = seed;
+
+    BenchImage image;
+    image.name = name + (vhdx ? ".vhdx" : ".vhd");
+    image.path = g_config.dir + "/" + image.name;
+    if (parent) {
+        spec.parentPath = parent->name;
+    }
+    VDImageWrite(image.path, spec);
+    g_created.push_back(image.path);
+    image.blocks = VDImageLayout(spec).AllocatedCount();
+    return image;
+}
+
+static void BM_Open(benchmark::State & state, BenchImage image)
+{
+    ncIVDParserEx *parser = CreateVDParser(image.path);
+    for (auto _ : state) {
+        parser->Open(image.path);
+        parser->Close();
+    }
+    delete parser;
+    setRssCounter(state);
+}
+
+/* Open, decode the whole BAT and close again, the unit of work of a backup
+* scan. Items are allocated blocks, so items_per_second is blocks/s. */
+static void BM_DataAreaList(benchmark::State & state, BenchImage image)
+{
+    ncIVDParserEx *parser = CreateVDParser(image.path);
+    for (auto _ : state) {
+        DataAreaMap areamap;
+        parser->Open(image.path);
+        parser->GetDataAreaList(areamap);
+        parser->Close();
+        benchmark::DoNotOptimize(areamap.Size());
+    }
+    delete parser;
+    state.SetItemsProcessed(state.iterations() * image.blocks);
+    setRssCounter(state);
+}
+
+/* Merge the first range(0) images of the chain, base first. */
+static void BM_ChainMerge(benchmark::State & state, std::vector<BenchImage> chain)
+{
+    std::list<std::string> paths;
+    uint64_t blocks = 0;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        paths.push_back(chain[i].path);
+        blocks += chain[i].blocks;
+    }
+    ncIVDParserEx *parser = CreateVDParser(chain[0].path);
+    for (auto _ : state) {
+        DataAreaMap areamap;
+        GetBackupDisksBlocks(parser, paths, areamap);
+        benchmark::DoNotOptimize(areamap.Size());
+    }
+    delete parser;
+    state.SetComplexityN(state.range(0));
+    state.SetItemsProcessed(state.iterations() * blocks);
+    setRssCounter(state);
+}
+
+static void BM_ChainMergeParallel(benchmark::State & state, std::vector<BenchImage> chain)
+{
+    std::list<std::string> paths;
+    uint64_t blocks = 0;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        paths.push_back(chain[i].path);
+        blocks += chain[i].blocks;
+    }
+    for (auto _ : state) {
+        DataAreaMap areamap;
+        GetBackupDisksBlocksParallel(paths, areamap);
+        benchmark::DoNotOptimize(areamap.Size());
+    }
+    state.SetComplexityN(state.range(0));
+    state.SetItemsProcessed(state.iterations() * blocks);
+    setRssCounter(state);
+}
+
+static void registerFormat(bool vhdx, const char *tag)
+{
+    std::string prefix = std::string("vdbench_") + tag;
+    std::vector<BenchImage> chain;
+    chain.push_back(makeImage(vhdx, prefix + "_base", NULL, 1));
+    for (unsigned i = 1; i < g_config.depth; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s_delta%u", prefix.c_str(), i);
+        chain.push_back(makeImage(vhdx, name, &chain.back(), 1 + i));
+    }
+    const BenchImage & base = chain[0];
+
+    benchmark::RegisterBenchmark((std::string("Open/") + tag).c_str(), BM_Open, base)
+        ->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark((std::string("DataAreaList/") + tag).c_str(), BM_DataAreaList, base)
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark((std::string("ChainMerge/") + tag).c_str(), BM_ChainMerge, chain)
+        ->RangeMultiplier(2)->Range(1, g_config.depth)->Complexity(benchmark::oN)
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark((std::string("ChainMergeParallel/") + tag).c_str(), BM_ChainMergeParallel, chain)
+        ->RangeMultiplier(2)->Range(1, g_config.depth)->Complexity(benchmark::oN)
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+int main(int argc, char **argv)
+{
+    parseConfig(argc, argv);
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+
+    int ret = 0;
+    try {
+        /* VHD tops out at 2 TiB, larger runs only measure VHDX */
+        if (g_config.size <= 2048 * GiB) {
+            registerFormat(false, "vhd");
+        }
+        registerFormat(true, "vhdx");
+        benchmark::RunSpecifiedBenchmarks();
+        if (VDStatsEnabled()) {
+            /* where the time of every run went, setup included */
+            VDStats stats;
+            VDStatsGet(stats);
+            fprintf(stderr, "vdbench stats: %s\n", VDStatsToJson(stats).c_str());
+        }
+    }
+    catch (...) {
+        fprintf(stderr, "vdbench: benchmark setup or run failed\n");
+        ret = 1;
+    }
+
+    if (!g_config.keep) {
+        for (size_t i = 0; i < g_created.size(); ++i) {
+            remove(g_created[i].c_str());
+        }
+    }
+    return ret;
+}
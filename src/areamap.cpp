@@ -0,0 +1,225 @@
+#include <abprec.h>
+#include <queue>
+#include <algorithm>
+#include "ncIVDParserEx.h"
+#include "areamap.h"
+#include "vdio.h"
+#include "vdstats.h"
+
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
+
+DataAreaMap::DataAreaMap()
+{
+}
+
+void DataAreaMap::Append(uint32_t offset, uint32_t length)
+{
+    if (length == 0) {
+        return;
+    }
+    if (!_offsets.empty()) {
+        size_t last = _offsets.size() - 1;
+        uint64_t lastEnd = (uint64_t)_offsets[last] + _lengths[last];
+        if (offset < _offsets[last]) {
+            throw exception("data area out of order");
+        }
+        if (offset <= lastEnd) {
+            uint64_t end = (uint64_t)offset + length;
+            if (end > lastEnd) {
+                _lengths[last] = (uint32_t)(end - _offsets[last]);
+            }
+            return;
+        }
+    }
+    _offsets.push_back(offset);
+    _lengths.push_back(length);
+}
+
+void DataAreaMap::Union(const DataAreaMap & other)
+{
+    if (other.Empty()) {
+        return;
+    }
+    if (Empty()) {
+        _offsets = other._offsets;
+        _lengths = other._lengths;
+        return;
+    }
+
+    DataAreaMap result;
+    result.Reserve(Size() + other.Size());
+    size_t i = 0, j = 0;
+    while (i < Size() && j < other.Size()) {
+        if (_offsets[i] <= other._offsets[j]) {
+            result.Append(_offsets[i], _lengths[i]);
+            ++i;
+        }
+        else {
+            result.Append(other._offsets[j], other._lengths[j]);
+            ++j;
+        }
+    }
+    for (; i < Size(); ++i) {
+        result.Append(_offsets[i], _lengths[i]);
+    }
+    for (; j < other.Size(); ++j) {
+        result.Append(other._offsets[j], other._lengths[j]);
+    }
+    result.ShrinkToFit();
+    VD_STAT_MERGE(Size() + other.Size(), result.Size());
+    Swap(result);
+}
+
+void DataAreaMap::Clear()
+{
+    _offsets.clear();
+    _lengths.clear();
+}
+
+void DataAreaMap::Reserve(size_t runs)
+{
+    _offsets.reserve(runs);
+    _lengths.reserve(runs);
+}
+
+void DataAreaMap::ShrinkToFit()
+{
+    std::vector<uint32_t>(_offsets).swap(_offsets);
+    std::vector<uint32_t>(_lengths).swap(_lengths);
+}
+
+void DataAreaMap::Swap(DataAreaMap & other)
+{
+    _offsets.swap(other._offsets);
+    _lengths.swap(other._lengths);
+}
+
+uint64_t DataAreaMap::End() const
+{
+    if (_offsets.empty()) {
+        return 0;
+    }
+    return (uint64_t)_offsets.back() + _lengths.back();
+}
+
+uint64_t DataAreaMap::TotalLength() const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < _lengths.size(); ++i) {
+        total += _lengths[i];
+    }
+    return total;
+}
+
+void DataAreaMap::ToList(std::list<DataArea> & arealist) const
+{
+    for (size_t i = 0; i < _offsets.size(); ++i) {
+        DataArea area;
+        area.offset = _offsets[i];
+        area.length = _lengths[i];
+        arealist.push_back(area);
+    }
+}
+
+struct DataAreaMapCursor
+{
+    uint32_t offset;
+    size_t map;
+    size_t run;
+};
+
+struct DataAreaMapCursorGreater
+{
+    bool operator()(const DataAreaMapCursor & a, const DataAreaMapCursor & b) const
+    {
+        return a.offset > b.offset;
+    }
+};
+
+void DataAreaMapMerge(const std::vector<const DataAreaMap *> & maps, DataAreaMap & result)
+{
+    std::priority_queue<DataAreaMapCursor, std::vector<DataAreaMapCursor>, DataAreaMapCursorGreater> heap;
+    size_t runs = 0;
+    for (size_t i = 0; i < maps.size(); ++i) {
+        if (maps[i] && !maps[i]->Empty()) {
+            DataAreaMapCursor cursor;
+            cursor.offset = maps[i]->Offset(0);
+            cursor.map = i;
+            cursor.run = 0;
+            heap.push(cursor);
+            runs += maps[i]->Size();
+        }
+    }
+
+    DataAreaMap merged;
+    merged.Reserve(runs);
+    while (!heap.empty()) {
+        DataAreaMapCursor cursor = heap.top();
+        heap.pop();
+        const DataAreaMap *map = maps[cursor.map];
+        merged.Append(cursor.offset, map->Length(cursor.run));
+        if (++cursor.run < map->Size()) {
+            cursor.offset = map->Offset(cursor.run);
+            heap.push(cursor);
+        }
+    }
+    merged.ShrinkToFit();
+    VD_STAT_MERGE(runs, merged.Size());
+    result.Swap(merged);
+}
+
+void AppendDataExtent(std::vector<DataExtent> & extents, uint64_t offset, uint64_t length, uint64_t fileOffset)
+{
+    if (length == 0) {
+        return;
+    }
+    if (!extents.empty()) {
+        DataExtent & last = extents.back();
+        if (last.offset + last.length == offset) {
+            if (last.fileOffset == VD_NO_FILE_OFFSET && fileOffset == VD_NO_FILE_OFFSET) {
+                last.length += length;
+                return;
+            }
+            if (last.fileOffset != VD_NO_FILE_OFFSET && last.fileOffset + last.length == fileOffset) {
+                last.length += length;
+                return;
+            }
+        }
+    }
+    DataExtent extent;
+    extent.offset = offset;
+    extent.length = length;
+    extent.fileOffset = fileOffset;
+    extents.push_back(extent);
+}
+
+static bool rangeEndsBefore(const VDFileRange & range, uint64_t offset)
+{
+    return range.offset + range.length <= offset;
+}
+
+void AppendAllocatedExtent(std::vector<DataExtent> & extents, uint64_t offset, uint64_t length, uint64_t fileOffset,
+    const std::vector<VDFileRange> & hostRanges)
+{
+    uint64_t fileEnd = fileOffset + length;
+    std::vector<VDFileRange>::const_iterator it =
+        std::lower_bound(hostRanges.begin(), hostRanges.end(), fileOffset, rangeEndsBefore);
+    for (; it != hostRanges.end() && it->offset < fileEnd; ++it) {
+        uint64_t start = std::max(it->offset, fileOffset);
+        uint64_t end = std::min(it->offset + it->length, fileEnd);
+        AppendDataExtent(extents, offset + (start - fileOffset), end - start, start);
+    }
+}
+
+void AppendExtentAreas(DataAreaMap & areamap, const std::vector<DataExtent> & extents)
+{
+    for (size_t i = 0; i < extents.size(); ++i) {
+        if (extents[i].fileOffset == VD_NO_FILE_OFFSET || extents[i].length == 0) {
+            continue;
+        }
+        uint64_t start = extents[i].offset / MiB;
+        uint64_t end = (extents[i].offset + extents[i].length + MiB - 1) / MiB;
+        areamap.Append((uint32_t)start, (uint32_t)(end - start));
+    }
+}
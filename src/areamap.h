@@ -0,0 +1,69 @@
+#pragma once
+#ifndef _AREAMAP_H_
+#define _AREAMAP_H_
+
+#include <stdint.h>
+#include <list>
+#include <vector>
+
+struct DataArea;
+struct DataExtent;
+struct VDFileRange;
+
+/* Sorted, run-length coalesced list of data areas.
+*  Offsets and lengths use the same MiB units as DataArea, but are kept in
+*  two contiguous arrays (one entry per run, not per block), so a fully
+*  allocated 64TB disk costs a single 8 byte run instead of millions of
+*  list nodes. */
+class DataAreaMap
+{
+public:
+    DataAreaMap();
+
+    /* Areas must be appended in ascending offset order. An area that touches
+    * or overlaps the last run is folded into it. */
+    void Append(uint32_t offset, uint32_t length);
+
+    /* Merge another map into this one (set union). */
+    void Union(const DataAreaMap & other);
+
+    void Clear();
+    void Reserve(size_t runs);
+    void ShrinkToFit();
+    void Swap(DataAreaMap & other);
+
+    size_t Size() const { return _offsets.size(); }
+    bool Empty() const { return _offsets.empty(); }
+    uint32_t Offset(size_t i) const { return _offsets[i]; }
+    uint32_t Length(size_t i) const { return _lengths[i]; }
+    /* end (exclusive) of the last run, 0 if empty */
+    uint64_t End() const;
+    /* sum of all run lengths */
+    uint64_t TotalLength() const;
+
+    void ToList(std::list<DataArea> & arealist) const;
+
+private:
+    std::vector<uint32_t> _offsets;
+    std::vector<uint32_t> _lengths;
+};
+
+/* Union of any number of maps in one pass: a min-heap keyed on the next run
+*  offset of every map feeds runs to result in ascending order, so a chain
+*  of N maps with M runs in total costs O(M log N). */
+void DataAreaMapMerge(const std::vector<const DataAreaMap *> & maps, DataAreaMap & result);
+
+/* Append an extent to a list sorted by offset, folding it into the last
+*  extent when both the virtual and the file ranges are contiguous. */
+void AppendDataExtent(std::vector<DataExtent> & extents, uint64_t offset, uint64_t length, uint64_t fileOffset);
+
+/* Append the parts of an extent whose file bytes lie in hostRanges, the
+*  sorted ranges the host file system has allocated. The rest are holes of
+*  the image file and read as zero. */
+void AppendAllocatedExtent(std::vector<DataExtent> & extents, uint64_t offset, uint64_t length, uint64_t fileOffset,
+    const std::vector<VDFileRange> & hostRanges);
+
+/* Append the MiB areas covering the extents stored in the file to areamap. */
+void AppendExtentAreas(DataAreaMap & areamap, const std::vector<DataExtent> & extents);
+
+#endif // !_AREAMAP_H_
@@ -0,0 +1,450 @@
+#include <abprec.h>
+#include "ncIVDParserEx.h"
+#include "bitmap.h"
+
+#include "vd.h"
+
+#ifdef VD_X86_KERNELS
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
+
+static __inline uint64_t popcount64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    return __popcnt64(x);
+#else
+    return __builtin_popcountll(x);
+#endif
+}
+
+static __inline uint32_t ctz64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long r = 0;
+    _BitScanForward64(&r, x);
+    return r;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+/* ---- word kernels ---- */
+
+static void bitmapOrGeneric(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] |= src[i];
+    }
+}
+
+static void bitmapAndGeneric(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_and_si128(a, b));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] &= src[i];
+    }
+}
+
+/* dst &= ~src */
+static void bitmapAndNotGeneric(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_andnot_si128(b, a));
+    }
+#endif
+    for (; i < n; ++i) {
+        dst[i] &= ~src[i];
+    }
+}
+
+static uint64_t bitmapPopcountGeneric(const uint64_t *src, size_t n)
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        count += popcount64(src[i]);
+    }
+    return count;
+}
+
+/* 0 if the 32 bytes are all clear, 1 if all set, -1 otherwise */
+static int bytesUniformGeneric(const uint8_t *p)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i b = _mm_loadu_si128((const __m128i *)(p + 16));
+    int zero = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a, b), _mm_setzero_si128()));
+    if (zero == 0xffff) {
+        return 0;
+    }
+    int ones = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(a, b), _mm_set1_epi8(-1)));
+    if (ones == 0xffff) {
+        return 1;
+    }
+    return -1;
+#else
+    uint64_t w[4];
+    memcpy(w, p, sizeof(w));
+    if (!(w[0] | w[1] | w[2] | w[3])) {
+        return 0;
+    }
+    if ((w[0] & w[1] & w[2] & w[3]) == ~0ULL) {
+        return 1;
+    }
+    return -1;
+#endif
+}
+
+#ifdef VD_X86_KERNELS
+
+VD_TARGET("avx2") static void bitmapOrAvx2(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+    }
+    bitmapOrGeneric(dst + i, src + i, n - i);
+}
+
+VD_TARGET("avx2") static void bitmapAndAvx2(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_and_si256(a, b));
+    }
+    bitmapAndGeneric(dst + i, src + i, n - i);
+}
+
+VD_TARGET("avx2") static void bitmapAndNotAvx2(uint64_t *dst, const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_andnot_si256(b, a));
+    }
+    bitmapAndNotGeneric(dst + i, src + i, n - i);
+}
+
+VD_TARGET("avx2") static uint64_t bitmapPopcountAvx2(const uint64_t *src, size_t n)
+{
+    size_t i = 0;
+    /* nibble lookup (pshufb) popcount, summed per 64-bit lane with psadbw */
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                      _mm256_shuffle_epi8(lookup, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    uint64_t count = (uint64_t)_mm256_extract_epi64(acc, 0) + (uint64_t)_mm256_extract_epi64(acc, 1)
+                   + (uint64_t)_mm256_extract_epi64(acc, 2) + (uint64_t)_mm256_extract_epi64(acc, 3);
+    return count + bitmapPopcountGeneric(src + i, n - i);
+}
+
+VD_TARGET("avx2") static int bytesUniformAvx2(const uint8_t *p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    if (_mm256_testz_si256(v, v)) {
+        return 0;
+    }
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(-1))) == -1) {
+        return 1;
+    }
+    return -1;
+}
+
+#endif /* VD_X86_KERNELS */
+
+struct VDBitmapKernels
+{
+    void (*unite)(uint64_t *, const uint64_t *, size_t);
+    void (*intersect)(uint64_t *, const uint64_t *, size_t);
+    void (*difference)(uint64_t *, const uint64_t *, size_t);
+    uint64_t (*popcount)(const uint64_t *, size_t);
+    int (*uniform)(const uint8_t *);
+};
+
+static VDBitmapKernels selectBitmapKernels()
+{
+    VDBitmapKernels k = { bitmapOrGeneric, bitmapAndGeneric, bitmapAndNotGeneric, bitmapPopcountGeneric, bytesUniformGeneric };
+#ifdef VD_X86_KERNELS
+    if (VDCpuFeatures() & VD_CPU_AVX2) {
+        VDBitmapKernels avx2 = { bitmapOrAvx2, bitmapAndAvx2, bitmapAndNotAvx2, bitmapPopcountAvx2, bytesUniformAvx2 };
+        k = avx2;
+    }
+#endif
+    return k;
+}
+
+static const VDBitmapKernels & bitmapKernels()
+{
+    static const VDBitmapKernels kernels = selectBitmapKernels();
+    return kernels;
+}
+
+/* ---- AllocationBitmap ---- */
+
+AllocationBitmap::AllocationBitmap()
+    : _bits(0)
+{
+}
+
+void AllocationBitmap::Resize(uint64_t bits)
+{
+    _words.resize((size_t)((bits + 63) / 64), 0);
+    _bits = bits;
+    if (bits % 64) {
+        _words.back() &= (1ULL << (bits % 64)) - 1;
+    }
+}
+
+void AllocationBitmap::Clear()
+{
+    _words.clear();
+    _bits = 0;
+}
+
+void AllocationBitmap::SetRange(uint64_t start, uint64_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    uint64_t end = start + count;
+    if (end > _bits) {
+        Resize(end);
+    }
+    size_t first = (size_t)(start / 64);
+    size_t last = (size_t)((end - 1) / 64);
+    uint64_t headMask = ~0ULL << (start % 64);
+    uint64_t tailMask = ~0ULL >> (63 - ((end - 1) % 64));
+    if (first == last) {
+        _words[first] |= headMask & tailMask;
+        return;
+    }
+    _words[first] |= headMask;
+    for (size_t i = first + 1; i < last; ++i) {
+        _words[i] = ~0ULL;
+    }
+    _words[last] |= tailMask;
+}
+
+bool AllocationBitmap::Test(uint64_t bit) const
+{
+    if (bit >= _bits) {
+        return false;
+    }
+    return (_words[(size_t)(bit / 64)] >> (bit % 64)) & 1;
+}
+
+void AllocationBitmap::Union(const AllocationBitmap & other)
+{
+    if (other._bits > _bits) {
+        Resize(other._bits);
+    }
+    if (!other._words.empty()) {
+        bitmapKernels().unite(&_words[0], &other._words[0], other._words.size());
+    }
+}
+
+void AllocationBitmap::Intersect(const AllocationBitmap & other)
+{
+    size_t n = std::min(_words.size(), other._words.size());
+    if (n) {
+        bitmapKernels().intersect(&_words[0], &other._words[0], n);
+    }
+    for (size_t i = n; i < _words.size(); ++i) {
+        _words[i] = 0;
+    }
+}
+
+void AllocationBitmap::Difference(const AllocationBitmap & other)
+{
+    size_t n = std::min(_words.size(), other._words.size());
+    if (n) {
+        bitmapKernels().difference(&_words[0], &other._words[0], n);
+    }
+}
+
+uint64_t AllocationBitmap::Count() const
+{
+    if (_words.empty()) {
+        return 0;
+    }
+    return bitmapKernels().popcount(&_words[0], _words.size());
+}
+
+uint64_t AllocationBitmap::AllocatedBytes() const
+{
+    return Count() * MiB;
+}
+
+/* index of the first bit >= from that equals value, or _bits */
+static uint64_t bitmapFind(const std::vector<uint64_t> & words, uint64_t bits, uint64_t from, bool value)
+{
+    if (from >= bits) {
+        return bits;
+    }
+    size_t w = (size_t)(from / 64);
+    uint64_t word = value ? words[w] : ~words[w];
+    word &= ~0ULL << (from % 64);
+    while (!word) {
+        if (++w == words.size()) {
+            return bits;
+        }
+        word = value ? words[w] : ~words[w];
+    }
+    uint64_t bit = (uint64_t)w * 64 + ctz64(word);
+    return bit < bits ? bit : bits;
+}
+
+void AllocationBitmap::ToMap(DataAreaMap & areamap) const
+{
+    uint64_t bit = bitmapFind(_words, _bits, 0, true);
+    while (bit < _bits) {
+        uint64_t end = bitmapFind(_words, _bits, bit, false);
+        areamap.Append((uint32_t)bit, (uint32_t)(end - bit));
+        bit = bitmapFind(_words, _bits, end, true);
+    }
+}
+
+void AllocationBitmap::ToList(std::list<DataArea> & arealist) const
+{
+    DataAreaMap areamap;
+    ToMap(areamap);
+    areamap.ToList(arealist);
+}
+
+/* ---- on-disk sector bitmaps ---- */
+
+static __inline uint32_t clz64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long r = 0;
+    _BitScanReverse64(&r, x);
+    return 63 - r;
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+static __inline uint64_t bswap64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(x);
+#else
+    return __builtin_bswap64(x);
+#endif
+}
+
+/* Sector position (>= from) of the first set bit of a bitmap word, or 64.
+* msbFirst words are loaded big endian so sector k is bit 63 - k. */
+static __inline uint32_t wordFind(uint64_t word, uint32_t from, bool msbFirst)
+{
+    if (from >= 64) {
+        return 64;
+    }
+    if (msbFirst) {
+        word <<= from;
+        return word ? from + clz64(word) : 64;
+    }
+    word >>= from;
+    return word ? from + ctz64(word) : 64;
+}
+
+void BitmapRuns(const uint8_t *bits, uint64_t nbits, bool msbFirst, std::vector<BitmapRun> & runs)
+{
+    int (*uniform)(const uint8_t *) = bitmapKernels().uniform;
+    bool inRun = false;
+    uint64_t runStart = 0;
+    uint64_t pos = 0;
+
+    while (pos < nbits) {
+        /* 256 bit stretches that do not change the run state */
+        if (nbits - pos >= 256) {
+            int state = uniform(bits + pos / 8);
+            if ((state == 0 && !inRun) || (state == 1 && inRun)) {
+                pos += 256;
+                continue;
+            }
+        }
+
+        uint64_t word = 0;
+        uint32_t valid = (uint32_t)std::min<uint64_t>(64, nbits - pos);
+        memcpy(&word, bits + pos / 8, (valid + 7) / 8);
+        if (msbFirst) {
+            word = bswap64(word);
+            if (valid < 64) {
+                word &= ~0ULL << (64 - valid);
+            }
+        }
+        else if (valid < 64) {
+            word &= (1ULL << valid) - 1;
+        }
+
+        uint32_t bit = 0;
+        while (bit < valid) {
+            if (inRun) {
+                uint32_t clear = wordFind(~word, bit, msbFirst);
+                if (clear >= valid) {
+                    break;
+                }
+                BitmapRun run;
+                run.start = runStart;
+                run.count = pos + clear - runStart;
+                runs.push_back(run);
+                inRun = false;
+                bit = clear;
+            }
+            else {
+                uint32_t set = wordFind(word, bit, msbFirst);
+                if (set >= valid) {
+                    break;
+                }
+                runStart = pos + set;
+                inRun = true;
+                bit = set;
+            }
+        }
+        pos += valid;
+    }
+    if (inRun) {
+        BitmapRun run;
+        run.start = runStart;
+        run.count = nbits - runStart;
+        runs.push_back(run);
+    }
+}
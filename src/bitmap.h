@@ -0,0 +1,63 @@
+#pragma once
+#ifndef _BITMAP_H_
+#define _BITMAP_H_
+
+#include <stdint.h>
+#include <list>
+#include <vector>
+
+struct DataArea;
+class DataAreaMap;
+
+/* Dense allocation bitmap, one bit per MiB of virtual disk (the unit of
+*  DataArea). Bit i is set when MiB i holds data. Set operations work on
+*  whole words and are vectorized with AVX2/SSE2 when available. */
+class AllocationBitmap
+{
+public:
+    AllocationBitmap();
+
+    /* Grow or shrink to bits entries; new bits are clear. */
+    void Resize(uint64_t bits);
+    uint64_t Bits() const { return _bits; }
+    void Clear();
+
+    void SetRange(uint64_t start, uint64_t count);
+    bool Test(uint64_t bit) const;
+
+    /* The operand may have a different size. Union grows this bitmap,
+    * intersection and difference keep its size. */
+    void Union(const AllocationBitmap & other);
+    void Intersect(const AllocationBitmap & other);
+    void Difference(const AllocationBitmap & other);
+
+    /* number of set bits, i.e. allocated MiB */
+    uint64_t Count() const;
+    uint64_t AllocatedBytes() const;
+
+    /* Convert to coalesced runs. */
+    void ToMap(DataAreaMap & areamap) const;
+    void ToList(std::list<DataArea> & arealist) const;
+
+    const uint64_t *Words() const { return _words.empty() ? NULL : &_words[0]; }
+    size_t WordCount() const { return _words.size(); }
+
+private:
+    std::vector<uint64_t> _words;
+    uint64_t _bits;
+};
+
+/* A run of set bits in an on-disk sector bitmap. */
+struct BitmapRun
+{
+    uint64_t start;
+    uint64_t count;
+};
+
+/* Collect the runs of set bits among the first nbits bits of an on-disk
+*  sector bitmap. VHD bitmaps number sectors from the most significant bit
+*  of each byte (msbFirst), VHDX bitmaps from the least significant one.
+*  Fully clear and fully set stretches are skipped a vector at a time. */
+void BitmapRuns(const uint8_t *bits, uint64_t nbits, bool msbFirst, std::vector<BitmapRun> & runs);
+
+#endif // !_BITMAP_H_
@@ -1,131 +1,219 @@
 #include <abprec.h>
-#include "ncIVDParser.h"
+#include <string.h>
+#include "ncIVDParserEx.h"
+#include "vhd.h"
+#include "vhdx.h"
+#include "vd.h"
+#include "vdpool.h"
+#include "vdcache.h"
+#include "vdstats.h"
 
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
 
-static void  alignDataArea(std::list<DataArea> &arealist, size_t len)
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
+ncIVDParserEx *CreateVDParser(const std::string & filePath)
 {
-    if (len < 1 || len > 256) {
-        throw exception("unsupported len");
+    std::ifstream infile(filePath.c_str(), ios::in | ios::binary);
+    if (infile.fail()) {
+        throw exception("open file failed");
+    }
+    char signature[8] = { 0 };
+    Read(infile, 0, signature, sizeof(signature));
+    if (memcmp(signature, "vhdxfile", sizeof(signature)) == 0) {
+        return new VHDXParser();
     }
+    return new VHDParser();
+}
 
-    std::list<DataArea>::iterator iter1 = arealist.begin();
-    if ((iter1->length) % len == 0) {
-        for (; iter1 != arealist.end();) {
-            //if (iter1->length > len) {
-                uint32_t start = iter1->offset + len;
-                uint32_t end = iter1->offset + iter1->length;
-                std::list<DataArea> tmp;
-                for (uint32_t i = start; i < end; i += len) {
-                    DataArea area;
-                    area.offset = i;
-                    area.length =len;
-                    tmp.push_back(area);
-                }
-                iter1->length = len;
-                iter1 ++;
-                arealist.insert(iter1, tmp.begin(), tmp.end());
-        }
+
+/* Scan every disk of the chain into its own compact map. The maps are all
+* in MiB units, which is the common granularity of every supported block
+* size, so no per-disk splitting is needed before the merge. */
+static void ScanBackupDisks(ncIVDParserEx *parser, std::list<string> & backupDisksPath, std::vector<DataAreaMap> & diskMaps)
+{
+    VD_STAT_PHASE(VD_STAT_CHAIN_SCAN);
+    diskMaps.resize(backupDisksPath.size());
+    size_t i = 0;
+    for(auto & diskPath : backupDisksPath) {
+        parser->Open(diskPath);
+        parser->GetDataAreaList(diskMaps[i++]);
+        parser->Close();
     }
 }
 
+static void MergeBackupDisks(std::vector<DataAreaMap> & diskMaps, DataAreaMap & backupBlocks)
+{
+    VD_STAT_PHASE(VD_STAT_CHAIN_MERGE);
+    std::vector<const DataAreaMap *> maps;
+    for (size_t i = 0; i < diskMaps.size(); ++i) {
+        maps.push_back(&diskMaps[i]);
+    }
+    DataAreaMapMerge(maps, backupBlocks);
+}
 
-static void  internalMerge(std::list<DataArea> &arealist)
+/* Declared in the generated ncIVDParser.h, so only the ncIVDParser methods
+* are used and any implementation of that interface can be passed. */
+void GetBackupDisksBlocks(ncIVDParser *parser,std::list<string> & backupDisksPath,std::list<DataArea> & backupBlocks)
 {
-    std::list<DataArea>::iterator first = arealist.begin();
-    std::list<DataArea>::iterator second = first;
-    first++;
-    for (; first != arealist.end();) {
-        if ((second->offset + second->length) == first->offset) {
-            second->length += first->length;
-            first = arealist.erase(first);
-        }
-        else {
-            first++;
-            second++;
+    std::vector<DataAreaMap> diskMaps(backupDisksPath.size());
+    size_t i = 0;
+    {
+        VD_STAT_PHASE(VD_STAT_CHAIN_SCAN);
+        for(auto & diskPath : backupDisksPath) {
+            std::list<DataArea> arealist;
+            parser->Open(diskPath);
+            parser->GetDataAreaList(arealist);
+            parser->Close();
+            for (auto & area : arealist) {
+                diskMaps[i].Append(area.offset, area.length);
+            }
+            ++i;
         }
     }
+    DataAreaMap areamap;
+    MergeBackupDisks(diskMaps, areamap);
+    std::list<DataArea> arealist;
+    areamap.ToList(arealist);
+    backupBlocks.swap(arealist);
 }
 
-//
-static void  externalMarge(std::list<DataArea> &arealist1, std::list<DataArea> &arealist2, std::list<DataArea> &result)
+void GetBackupDisksBlocks(ncIVDParserEx *parser,std::list<string> & backupDisksPath,DataAreaMap & backupBlocks)
 {
-    std::list<DataArea>::iterator iter1,iter2;
-    iter1 = arealist1.begin();
-    iter2 = arealist2.begin();
-    for (; iter1 != arealist1.end()&& iter2 != arealist2.end();) {
-        if (iter2->offset > iter1->offset) {
-            DataArea area;
-            area.offset = iter1->offset;
-            area.length = iter1->length;
-            result.push_back(area);
-            iter1++;
+    std::vector<DataAreaMap> diskMaps;
+    ScanBackupDisks(parser, backupDisksPath, diskMaps);
+    MergeBackupDisks(diskMaps, backupBlocks);
+}
 
+void GetBackupDisksBlocks(ncIVDParserEx *parser,std::list<string> & backupDisksPath,DataAreaMap & backupBlocks,VDAllocationCache & cache)
+{
+    std::vector<DataAreaMap> diskMaps(backupDisksPath.size());
+    size_t i = 0;
+    {
+        VD_STAT_PHASE(VD_STAT_CHAIN_SCAN);
+        for(auto & diskPath : backupDisksPath) {
+            parser->Open(diskPath);
+            cache.GetDataAreaList(parser, diskPath, diskMaps[i++]);
+            parser->Close();
         }
-        else if(iter2->offset < iter1->offset){
-            DataArea area;
-            area.offset = iter2->offset;
-            area.length = iter2->length;
-            result.push_back(area);
-            iter2++;
+    }
+    MergeBackupDisks(diskMaps, backupBlocks);
+}
+
+void GetBackupDisksBlocks(ncIVDParserEx *parser,std::list<string> & backupDisksPath,AllocationBitmap & backupBlocks)
+{
+    AllocationBitmap bitmap;
+    for(auto & diskPath : backupDisksPath) {
+        AllocationBitmap bitmapTmp;
+        {
+            VD_STAT_PHASE(VD_STAT_CHAIN_SCAN);
+            parser->Open(diskPath);
+            parser->GetDataAreaList(bitmapTmp);
         }
-        else if(iter2->offset == iter1->offset)
         {
-            DataArea area;
-            area.offset = iter2->offset;
-            area.length = iter2->length;
-            result.push_back(area);
-            iter2++;
-            iter1++;
+            VD_STAT_PHASE(VD_STAT_CHAIN_MERGE);
+            bitmap.Union(bitmapTmp);
         }
+        parser->Close();
     }
-    for (; iter1 != arealist1.end(); ++iter1) {
-        result.push_back(*iter1);
+    backupBlocks = bitmap;
+}
+
+static void ScanDisk(ncIVDParserEx *parser, const string & diskPath, DataAreaMap & areamap, VDAllocationCache *cache)
+{
+    if (cache) {
+        cache->GetDataAreaList(parser, diskPath, areamap);
     }
-    for (; iter2 != arealist2.end(); ++iter2) {
-        result.push_back(*iter2);
+    else {
+        parser->GetDataAreaList(areamap);
     }
 }
 
+static void ScanDisk(ncIVDParserEx *parser, const string & diskPath, AllocationBitmap & bitmap, VDAllocationCache *cache)
+{
+    if (cache) {
+        DataAreaMap areamap;
+        cache->GetDataAreaList(parser, diskPath, areamap);
+        bitmap.Resize(DIV_ROUND_UP(parser->GetVirtualSize(), MiB));
+        for (size_t i = 0; i < areamap.Size(); ++i) {
+            bitmap.SetRange(areamap.Offset(i), areamap.Length(i));
+        }
+    }
+    else {
+        parser->GetDataAreaList(bitmap);
+    }
+}
 
-void GetBackupDisksBlocks(ncIVDParser *parser,std::list<string> & backupDisksPath,std::list<DataArea> & backupBlocks)
+/* Scan every disk on the pool, each task with a parser of its own. */
+template <class T>
+static void ScanBackupDisksParallel(VDThreadPool & pool, std::list<string> & backupDisksPath, std::vector<T> & results, VDAllocationCache *cache)
 {
-    std::list<DataArea> arealist;
-    size_t len = 0;
-    for(auto & diskPath : backupDisksPath) {
-        parser->Open(diskPath);
-        std::list<DataArea> arealistTmp;
-        parser->GetDataAreaList(arealistTmp);
-        //internalMerge(arealistTmp);
-        //arealist.insert(arealist.end(),arealistTmp.begin(),arealistTmp.end());
-        if(arealistTmp.size()) {
-            if(len) {
-                if(arealistTmp.front().length > len) {
-                    alignDataArea(arealistTmp,len);
-                    std::list<DataArea> result;
-                    externalMarge(arealistTmp,arealist,result);
-                    arealist.swap(result);
-                }
-                else if(arealistTmp.front().length < len) {
-                    len = arealistTmp.front().length;
-                    alignDataArea(arealist,len);
-                    std::list<DataArea> result;
-                    externalMarge(arealistTmp,arealist,result);
-                    arealist.swap(result);
-                }
-                else if(arealistTmp.front().length == len) {
-                    std::list<DataArea> result;
-                    externalMarge(arealistTmp,arealist,result);
-                    arealist.swap(result);
-                }
-            }
-            else {
-                len = arealistTmp.front().length;
-                arealist.swap(arealistTmp);
-            }
-            arealistTmp.clear();
+    std::vector<const string *> paths;
+    for (auto & diskPath : backupDisksPath) {
+        paths.push_back(&diskPath);
+    }
+    results.resize(paths.size());
+    VD_STAT_PHASE(VD_STAT_CHAIN_SCAN);
+    pool.ParallelFor(paths.size(), [&](size_t i) {
+        ncIVDParserEx *parser = CreateVDParser(*paths[i]);
+        try {
+            parser->Open(*paths[i]);
+            ScanDisk(parser, *paths[i], results[i], cache);
+            parser->Close();
         }
-        parser->Close();
+        catch (...) {
+            delete parser;
+            throw;
+        }
+        delete parser;
+    });
+}
+
+/* Union the results pairwise, log2(n) rounds of independent merges, leaving
+* the total in results[0]. */
+template <class T>
+static void ReduceBackupDisks(VDThreadPool & pool, std::vector<T> & results)
+{
+    VD_STAT_PHASE(VD_STAT_CHAIN_MERGE);
+    for (size_t stride = 1; stride < results.size(); stride *= 2) {
+        size_t pairs = (results.size() - stride + 2 * stride - 1) / (2 * stride);
+        pool.ParallelFor(pairs, [&](size_t k) {
+            size_t i = k * 2 * stride;
+            results[i].Union(results[i + stride]);
+            results[i + stride] = T();
+        });
     }
-    internalMerge(arealist);
+}
+
+void GetBackupDisksBlocksParallel(std::list<string> & backupDisksPath,std::list<DataArea> & backupBlocks,unsigned threads,VDAllocationCache *cache)
+{
+    DataAreaMap areamap;
+    GetBackupDisksBlocksParallel(backupDisksPath, areamap, threads, cache);
+    std::list<DataArea> arealist;
+    areamap.ToList(arealist);
     backupBlocks.swap(arealist);
-}
\ No newline at end of file
+}
+
+void GetBackupDisksBlocksParallel(std::list<string> & backupDisksPath,DataAreaMap & backupBlocks,unsigned threads,VDAllocationCache *cache)
+{
+    VDThreadPool pool(threads);
+    std::vector<DataAreaMap> diskMaps;
+    ScanBackupDisksParallel(pool, backupDisksPath, diskMaps, cache);
+    ReduceBackupDisks(pool, diskMaps);
+    backupBlocks.Clear();
+    if (!diskMaps.empty()) {
+        backupBlocks.Swap(diskMaps[0]);
+    }
+}
+
+void GetBackupDisksBlocksParallel(std::list<string> & backupDisksPath,AllocationBitmap & backupBlocks,unsigned threads,VDAllocationCache *cache)
+{
+    VDThreadPool pool(threads);
+    std::vector<AllocationBitmap> diskBitmaps;
+    ScanBackupDisksParallel(pool, backupDisksPath, diskBitmaps, cache);
+    ReduceBackupDisks(pool, diskBitmaps);
+    backupBlocks = diskBitmaps.empty() ? AllocationBitmap() : diskBitmaps[0];
+}
@@ -0,0 +1,122 @@
+#pragma once
+#ifndef _NCIVDPARSEREX_H_
+#define _NCIVDPARSEREX_H_
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <vector>
+#include "ncIVDParser.h"
+#include "areamap.h"
+#include "bitmap.h"
+
+class VDAllocationCache;
+
+#define VD_NO_FILE_OFFSET UINT64_C(0xffffffffffffffff)
+
+/* Byte addressed data extent of a virtual disk. */
+struct DataExtent
+{
+    uint64_t offset;        /* offset in the virtual disk */
+    uint64_t length;
+    uint64_t fileOffset;    /* offset of the data in the image file, or
+                            VD_NO_FILE_OFFSET if it is not stored there */
+};
+
+/* State of an image file as far as its data areas are concerned; equal
+*  stamps of the same file mean equal scan results. */
+struct VDImageStamp
+{
+    uint64_t fileSize;
+    uint64_t sequence;      /* VHDX header sequence number, VHD footer
+                            timestamp and checksum */
+    uint64_t batHash;       /* VDHash64 of the block allocation table */
+};
+
+/* Identity that links a differencing disk to its parent: the VHD footer
+*  UniqueId or the VHDX DataWriteGuid, as the 16 bytes stored in the file. */
+struct VDImageId
+{
+    uint8_t bytes[16];
+};
+
+/*
+* Methods every parser of this library implements on top of ncIVDParser.
+* ncIVDParser.h is generated from ncIVDParser.idl and stays as generated;
+* this interface derives from it, so the ncIVDParser part of the vtable and
+* NCIVDPARSE_IID are unchanged for clients built against the IDL, and it has
+* an IID of its own for QueryInterface.
+*/
+#define NCIVDPARSEEX_IID_STR "c1afc776-f158-46ee-b9f0-1ffb677d551e"
+
+#define NCIVDPARSEEX_IID \
+  {0xc1afc776, 0xf158, 0x46ee, \
+    { 0xb9, 0xf0, 0x1f, 0xfb, 0x67, 0x7d, 0x55, 0x1e }}
+
+class NS_NO_VTABLE ncIVDParserEx : public ncIVDParser {
+ public:
+
+  NS_DECLARE_STATIC_IID_ACCESSOR(NCIVDPARSEEX_IID)
+
+  using ncIVDParser::GetDataAreaList;
+
+  NS_IMETHOD_(void) GetDataAreaList(DataAreaMap & areamap) = 0;
+
+  NS_IMETHOD_(void) GetDataAreaList(AllocationBitmap & bitmap) = 0;
+
+  NS_IMETHOD_(void) GetDataExtentList(std::vector<DataExtent> & extents) = 0;
+
+  NS_IMETHOD_(uint64_t) GetVirtualSize(void) = 0;
+
+  NS_IMETHOD_(void) ReadData(uint64_t offset, char * buffer, uint64_t size) = 0;
+
+  NS_IMETHOD_(bool) GetParentPaths(std::list<std::string> & parentPaths) = 0;
+
+  NS_IMETHOD_(uint32_t) GetBlockSize(void) = 0;
+
+  NS_IMETHOD_(void) GetImageStamp(VDImageStamp & stamp) = 0;
+
+  NS_IMETHOD_(void) GetImageId(VDImageId & id) = 0;
+
+  NS_IMETHOD_(bool) GetParentId(VDImageId & id) = 0;
+
+};
+
+  NS_DEFINE_STATIC_IID_ACCESSOR(ncIVDParserEx, NCIVDPARSEEX_IID)
+
+/* Use this macro, next to NS_DECL_NCIVDPARSE, when declaring classes that
+*  implement this interface. */
+#define NS_DECL_NCIVDPARSEEX \
+  NS_IMETHOD_(void) GetDataAreaList(DataAreaMap & areamap); \
+  NS_IMETHOD_(void) GetDataAreaList(AllocationBitmap & bitmap); \
+  NS_IMETHOD_(void) GetDataExtentList(std::vector<DataExtent> & extents); \
+  NS_IMETHOD_(uint64_t) GetVirtualSize(void); \
+  NS_IMETHOD_(void) ReadData(uint64_t offset, char * buffer, uint64_t size); \
+  NS_IMETHOD_(bool) GetParentPaths(std::list<std::string> & parentPaths); \
+  NS_IMETHOD_(uint32_t) GetBlockSize(void); \
+  NS_IMETHOD_(void) GetImageStamp(VDImageStamp & stamp); \
+  NS_IMETHOD_(void) GetImageId(VDImageId & id); \
+  NS_IMETHOD_(bool) GetParentId(VDImageId & id);
+
+/* Create a VHD or VHDX parser for filePath, chosen by the file signature.
+*  The parser is not opened yet; delete it when done. */
+ncIVDParserEx *CreateVDParser(const std::string & filePath);
+
+void GetBackupDisksBlocks(ncIVDParserEx *parser,std::list<string> & backupDisksPath,DataAreaMap & areamap);
+
+void GetBackupDisksBlocks(ncIVDParserEx *parser,std::list<string> & backupDisksPath,AllocationBitmap & bitmap);
+
+/* Same, taking each disk's areas from cache when its entry is current. */
+void GetBackupDisksBlocks(ncIVDParserEx *parser,std::list<string> & backupDisksPath,DataAreaMap & areamap,VDAllocationCache & cache);
+
+/* Parallel variants: the disks are scanned concurrently, each with its own
+*  parser from CreateVDParser, and the per-disk results are merged pairwise
+*  in a tree. threads counts the calling thread, 0 uses every core. With a
+*  cache, disks whose entry is current are not scanned. */
+void GetBackupDisksBlocksParallel(std::list<string> & backupDisksPath,std::list<DataArea> & arealist,unsigned threads = 0,VDAllocationCache *cache = NULL);
+
+void GetBackupDisksBlocksParallel(std::list<string> & backupDisksPath,DataAreaMap & areamap,unsigned threads = 0,VDAllocationCache *cache = NULL);
+
+void GetBackupDisksBlocksParallel(std::list<string> & backupDisksPath,AllocationBitmap & bitmap,unsigned threads = 0,VDAllocationCache *cache = NULL);
+
+#endif // !_NCIVDPARSEREX_H_
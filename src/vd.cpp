@@ -1,4 +1,15 @@
 #include "vd.h"
+#include "vdstats.h"
+#include <stdint.h>
+#include <string.h>
+#ifdef VD_X86_KERNELS
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 using namespace std;
 
 uint16_t swab16(const uint16_t & v)
@@ -38,9 +49,11 @@ bool GetEndianness()
 
 void Read(std::ifstream & infile, uint64_t offset, char * buffer, uint64_t size)
 {
+    uint64_t start = VD_STAT_NOW();
     infile.clear();
     infile.seekg(offset, ios::beg);
     infile.read(buffer, size);
+    VD_STAT_READ(1, size, start);
 }
 
 void Write(std::ofstream & outfile, uint64_t offset, char * buffer, uint64_t size)
@@ -58,3 +71,521 @@ uint64_t GetFileSize(std::ifstream & infile)
     return fileSize;
 }
 
+
+std::string Utf16ToUtf8(const uint16_t *str, size_t count, bool bigEndian)
+{
+    std::string out;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t c = bigEndian ? swab16(str[i]) : str[i];
+        if (c == 0) {
+            break;
+        }
+        if (c >= 0xd800 && c < 0xdc00 && i + 1 < count) {
+            uint32_t low = bigEndian ? swab16(str[i + 1]) : str[i + 1];
+            if (low >= 0xdc00 && low < 0xe000) {
+                c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+                ++i;
+            }
+        }
+        if (c < 0x80) {
+            out += (char)c;
+        }
+        else if (c < 0x800) {
+            out += (char)(0xc0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3f));
+        }
+        else if (c < 0x10000) {
+            out += (char)(0xe0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3f));
+            out += (char)(0x80 | (c & 0x3f));
+        }
+        else {
+            out += (char)(0xf0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3f));
+            out += (char)(0x80 | ((c >> 6) & 0x3f));
+            out += (char)(0x80 | (c & 0x3f));
+        }
+    }
+    return out;
+}
+
+std::vector<uint16_t> Utf8ToUtf16(const std::string & str, bool bigEndian)
+{
+    std::vector<uint16_t> out;
+    for (size_t i = 0; i < str.size(); ) {
+        uint32_t c = (uint8_t)str[i];
+        size_t extra = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+        if (extra) {
+            c &= 0x3f >> extra;
+        }
+        ++i;
+        for (size_t k = 0; k < extra && i < str.size(); ++k, ++i) {
+            c = (c << 6) | ((uint8_t)str[i] & 0x3f);
+        }
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            out.push_back((uint16_t)(0xd800 + (c >> 10)));
+            c = 0xdc00 + (c & 0x3ff);
+        }
+        out.push_back((uint16_t)c);
+    }
+    if (bigEndian) {
+        for (size_t i = 0; i < out.size(); ++i) {
+            out[i] = swab16(out[i]);
+        }
+    }
+    return out;
+}
+
+/* ---- bulk byte swap kernels ---- */
+
+static __inline uint32_t lowestBit(uint32_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long r = 0;
+    _BitScanForward(&r, x);
+    return r;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+
+static void swab16Scalar(uint16_t *dst, const uint16_t *src, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = swab16(src[i]);
+    }
+}
+
+static void swap32Scalar(uint32_t *dst, const uint32_t *src, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = swap32(src[i]);
+    }
+}
+
+static void swap64Scalar(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        dst[i] = swap64(src[i]);
+    }
+}
+
+static size_t swap32FindScalar(uint32_t *dst, const uint32_t *src, size_t count, uint32_t base, uint32_t *indexes)
+{
+    size_t found = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t v = src[i];
+        dst[i] = swap32(v);
+        if (v != ~0U) {
+            indexes[found++] = base + (uint32_t)i;
+        }
+    }
+    return found;
+}
+
+#ifdef VD_X86_KERNELS
+
+VD_TARGET("ssse3") static void swab16Ssse3(uint16_t *dst, const uint16_t *src, size_t count)
+{
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+    }
+    swab16Scalar(dst + i, src + i, count - i);
+}
+
+VD_TARGET("ssse3") static void swap32Ssse3(uint32_t *dst, const uint32_t *src, size_t count)
+{
+    const __m128i shuffle = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+    }
+    swap32Scalar(dst + i, src + i, count - i);
+}
+
+VD_TARGET("ssse3") static void swap64Ssse3(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    const __m128i shuffle = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+    }
+    swap64Scalar(dst + i, src + i, count - i);
+}
+
+VD_TARGET("ssse3") static size_t swap32FindSsse3(uint32_t *dst, const uint32_t *src, size_t count, uint32_t base, uint32_t *indexes)
+{
+    const __m128i shuffle = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i unused = _mm_set1_epi32(-1);
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        /* 0xffffffff reads the same in either byte order */
+        uint32_t used = ~(uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, unused))) & 0xf;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, shuffle));
+        while (used) {
+            indexes[found++] = base + (uint32_t)i + lowestBit(used);
+            used &= used - 1;
+        }
+    }
+    return found + swap32FindScalar(dst + i, src + i, count - i, base + (uint32_t)i, indexes + found);
+}
+
+VD_TARGET("avx2") static void swab16Avx2(uint16_t *dst, const uint16_t *src, size_t count)
+{
+    const __m256i shuffle = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                             1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+    swab16Scalar(dst + i, src + i, count - i);
+}
+
+VD_TARGET("avx2") static void swap32Avx2(uint32_t *dst, const uint32_t *src, size_t count)
+{
+    const __m256i shuffle = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                             3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+    swap32Scalar(dst + i, src + i, count - i);
+}
+
+VD_TARGET("avx2") static void swap64Avx2(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    const __m256i shuffle = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+    }
+    swap64Scalar(dst + i, src + i, count - i);
+}
+
+VD_TARGET("avx2") static size_t swap32FindAvx2(uint32_t *dst, const uint32_t *src, size_t count, uint32_t base, uint32_t *indexes)
+{
+    const __m256i shuffle = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                             3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i unused = _mm256_set1_epi32(-1);
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        uint32_t used = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, unused))) & 0xff;
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, shuffle));
+        while (used) {
+            indexes[found++] = base + (uint32_t)i + lowestBit(used);
+            used &= used - 1;
+        }
+    }
+    return found + swap32FindScalar(dst + i, src + i, count - i, base + (uint32_t)i, indexes + found);
+}
+
+static unsigned cpuFeatures()
+{
+    unsigned features = 0;
+    uint32_t ecx1 = 0;
+    uint32_t ebx7 = 0;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    ecx1 = (uint32_t)info[2];
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        ebx7 = (uint32_t)info[1];
+    }
+#else
+    unsigned int a, b, c, d;
+    unsigned int maxLeaf = __get_cpuid_max(0, NULL);
+    if (__get_cpuid(1, &a, &b, &c, &d)) {
+        ecx1 = c;
+    }
+    if (maxLeaf >= 7) {
+        __cpuid_count(7, 0, a, b, c, d);
+        ebx7 = b;
+    }
+#endif
+    if (ecx1 & (1U << 9)) {
+        features |= VD_CPU_SSSE3;
+    }
+    if (ecx1 & (1U << 20)) {
+        features |= VD_CPU_SSE42;
+    }
+    /* AVX2 and AVX-512 also need the OS to save the YMM, and for AVX-512
+    * the opmask and ZMM, state (OSXSAVE + XCR0) */
+    if ((ecx1 & (1U << 27)) && (ecx1 & (1U << 28))) {
+#if defined(_MSC_VER)
+        uint64_t xcr0 = _xgetbv(0);
+#else
+        uint32_t lo, hi;
+        __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+        uint64_t xcr0 = ((uint64_t)hi << 32) | lo;
+#endif
+        if ((ebx7 & (1U << 5)) && (xcr0 & 0x6) == 0x6) {
+            features |= VD_CPU_AVX2;
+        }
+        if ((ebx7 & (1U << 16)) && (xcr0 & 0xe6) == 0xe6) {
+            features |= VD_CPU_AVX512F;
+        }
+    }
+    return features;
+}
+
+#endif /* VD_X86_KERNELS */
+
+unsigned VDCpuFeatures()
+{
+#ifdef VD_X86_KERNELS
+    static const unsigned features = cpuFeatures();
+    return features;
+#else
+    return 0;
+#endif
+}
+
+struct VDSwapKernels
+{
+    void (*swab16)(uint16_t *, const uint16_t *, size_t);
+    void (*swap32)(uint32_t *, const uint32_t *, size_t);
+    void (*swap64)(uint64_t *, const uint64_t *, size_t);
+    size_t (*swap32Find)(uint32_t *, const uint32_t *, size_t, uint32_t, uint32_t *);
+};
+
+static VDSwapKernels selectSwapKernels()
+{
+    VDSwapKernels k = { swab16Scalar, swap32Scalar, swap64Scalar, swap32FindScalar };
+#ifdef VD_X86_KERNELS
+    unsigned features = VDCpuFeatures();
+    if (features & VD_CPU_AVX2) {
+        VDSwapKernels avx2 = { swab16Avx2, swap32Avx2, swap64Avx2, swap32FindAvx2 };
+        k = avx2;
+    }
+    else if (features & VD_CPU_SSSE3) {
+        VDSwapKernels ssse3 = { swab16Ssse3, swap32Ssse3, swap64Ssse3, swap32FindSsse3 };
+        k = ssse3;
+    }
+#endif
+    return k;
+}
+
+static const VDSwapKernels & swapKernels()
+{
+    static const VDSwapKernels kernels = selectSwapKernels();
+    return kernels;
+}
+
+void swab16Bulk(uint16_t *dst, const uint16_t *src, size_t count)
+{
+    swapKernels().swab16(dst, src, count);
+}
+
+void swap32Bulk(uint32_t *dst, const uint32_t *src, size_t count)
+{
+    swapKernels().swap32(dst, src, count);
+}
+
+void swap64Bulk(uint64_t *dst, const uint64_t *src, size_t count)
+{
+    swapKernels().swap64(dst, src, count);
+}
+
+size_t swap32FindAllocated(uint32_t *dst, const uint32_t *src, size_t count, uint32_t base, uint32_t *indexes)
+{
+    return swapKernels().swap32Find(dst, src, count, base, indexes);
+}
+
+/* ---- hashing ---- */
+
+#define VD_HASH_PRIME1 UINT64_C(11400714785074694791)
+#define VD_HASH_PRIME2 UINT64_C(14029467366897019727)
+#define VD_HASH_PRIME3 UINT64_C(1609587929392839161)
+#define VD_HASH_PRIME4 UINT64_C(9650029242287828579)
+#define VD_HASH_PRIME5 UINT64_C(2870177450012600261)
+
+static __inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static __inline uint64_t hashRound(uint64_t acc, uint64_t input)
+{
+    acc += input * VD_HASH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * VD_HASH_PRIME1;
+}
+
+static __inline uint64_t hashMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= hashRound(0, value);
+    return acc * VD_HASH_PRIME1 + VD_HASH_PRIME4;
+}
+
+uint64_t VDHash64(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    const uint8_t *end = p + size;
+    uint64_t h;
+    uint64_t word;
+
+    if (size >= 32) {
+        uint64_t v1 = seed + VD_HASH_PRIME1 + VD_HASH_PRIME2;
+        uint64_t v2 = seed + VD_HASH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - VD_HASH_PRIME1;
+        const uint8_t *limit = end - 32;
+        do {
+            memcpy(&word, p, 8);
+            v1 = hashRound(v1, word);
+            memcpy(&word, p + 8, 8);
+            v2 = hashRound(v2, word);
+            memcpy(&word, p + 16, 8);
+            v3 = hashRound(v3, word);
+            memcpy(&word, p + 24, 8);
+            v4 = hashRound(v4, word);
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hashMerge(h, v1);
+        h = hashMerge(h, v2);
+        h = hashMerge(h, v3);
+        h = hashMerge(h, v4);
+    }
+    else {
+        h = seed + VD_HASH_PRIME5;
+    }
+    h += (uint64_t)size;
+
+    while (p + 8 <= end) {
+        memcpy(&word, p, 8);
+        h ^= hashRound(0, word);
+        h = rotl64(h, 27) * VD_HASH_PRIME1 + VD_HASH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        uint32_t half;
+        memcpy(&half, p, 4);
+        h ^= (uint64_t)half * VD_HASH_PRIME1;
+        h = rotl64(h, 23) * VD_HASH_PRIME2 + VD_HASH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * VD_HASH_PRIME5;
+        h = rotl64(h, 11) * VD_HASH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= VD_HASH_PRIME2;
+    h ^= h >> 29;
+    h *= VD_HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* ---- CRC-32C ---- */
+
+#define VD_CRC32C_POLY 0x82f63b78   /* Castagnoli, reflected */
+
+struct VDCrc32cTable
+{
+    uint32_t t[8][256];
+};
+
+/* slicing by 8: t[k][b] is the crc of byte b followed by k zero bytes */
+static VDCrc32cTable makeCrc32cTable()
+{
+    VDCrc32cTable table;
+    for (uint32_t b = 0; b < 256; ++b) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc >> 1) ^ (VD_CRC32C_POLY & (0 - (crc & 1)));
+        }
+        table.t[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; ++b) {
+        for (int k = 1; k < 8; ++k) {
+            table.t[k][b] = (table.t[k - 1][b] >> 8) ^ table.t[0][table.t[k - 1][b] & 0xff];
+        }
+    }
+    return table;
+}
+
+static uint32_t crc32cScalar(uint32_t crc, const uint8_t *p, size_t size)
+{
+    static const VDCrc32cTable table = makeCrc32cTable();
+    const uint32_t (*t)[256] = table.t;
+    bool bigEndian = GetEndianness();
+    for (; size >= 8; size -= 8, p += 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        if (bigEndian) {
+            lo = swap32(lo);
+            hi = swap32(hi);
+        }
+        lo ^= crc;
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+            t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    while (size--) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef VD_X86_KERNELS
+
+VD_TARGET("sse4.2") static uint32_t crc32cSse42(uint32_t crc, const uint8_t *p, size_t size)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for (; size >= 4; size -= 4, p += 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (size--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+
+#endif /* VD_X86_KERNELS */
+
+typedef uint32_t (*VDCrc32cKernel)(uint32_t, const uint8_t *, size_t);
+
+static VDCrc32cKernel selectCrc32cKernel()
+{
+#ifdef VD_X86_KERNELS
+    if (VDCpuFeatures() & VD_CPU_SSE42) {
+        return crc32cSse42;
+    }
+#endif
+    return crc32cScalar;
+}
+
+uint32_t VDCrc32c(const void *data, size_t size, uint32_t crc)
+{
+    static const VDCrc32cKernel kernel = selectCrc32cKernel();
+    return ~kernel(~crc, (const uint8_t *)data, size);
+}
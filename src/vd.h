@@ -3,6 +3,24 @@
 #include <string>
 #include <list>
 #include <fstream>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define VD_X86_KERNELS
+#endif
+
+/* Compile one function for an instruction set the build does not enable,
+* to be called only when VDCpuFeatures reports it. */
+#if defined(VD_X86_KERNELS) && !defined(_MSC_VER)
+#define VD_TARGET(x) __attribute__((target(x)))
+#else
+#define VD_TARGET(x)
+#endif
+
+#define VD_CPU_SSSE3 0x1
+#define VD_CPU_AVX2  0x2
+#define VD_CPU_SSE42 0x4
+#define VD_CPU_AVX512F 0x8
 
 
 uint16_t swab16(const uint16_t & v);
@@ -18,3 +36,33 @@ void Read(std::ifstream & infile, uint64_t offset, char * buffer, uint64_t size)
 void Write(std::ofstream & outfile, uint64_t offset, char * buffer, uint64_t size);
 
 uint64_t GetFileSize(std::ifstream & infile);
+
+/* Convert count UTF-16 code units, little or big endian, to UTF-8. Stops at
+* the first NUL. */
+std::string Utf16ToUtf8(const uint16_t *str, size_t count, bool bigEndian);
+
+/* Convert UTF-8 to UTF-16 code units, little or big endian, without a NUL. */
+std::vector<uint16_t> Utf8ToUtf16(const std::string & str, bool bigEndian);
+
+/* VD_CPU_* flags of the running CPU, read from CPUID once; 0 off x86. */
+unsigned VDCpuFeatures();
+
+/* Bulk byte swap of count entries, dst may equal src for an in place swap.
+* The SSSE3 or AVX2 kernel is picked at run time from CPUID. */
+void swab16Bulk(uint16_t *dst, const uint16_t *src, size_t count);
+
+void swap32Bulk(uint32_t *dst, const uint32_t *src, size_t count);
+
+void swap64Bulk(uint64_t *dst, const uint64_t *src, size_t count);
+
+/* Byte swap count big endian BAT entries into dst (which may equal src) and
+* store base + i for every entry i that is not 0xffffffff into indexes, which
+* must hold count entries. Returns the number of indexes stored. */
+size_t swap32FindAllocated(uint32_t *dst, const uint32_t *src, size_t count, uint32_t base, uint32_t *indexes);
+
+/* 64 bit non-cryptographic hash of size bytes (xxHash64 mixing). */
+uint64_t VDHash64(const void *data, size_t size, uint64_t seed);
+
+/* CRC-32C (Castagnoli) of size bytes, continuing from crc, 0 to start. Uses
+* the SSE4.2 crc32 instruction when the CPU has it. */
+uint32_t VDCrc32c(const void *data, size_t size, uint32_t crc);
@@ -0,0 +1,306 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifdef VD_HAVE_LIBURING
+#include <fcntl.h>
+#include <unistd.h>
+#include <liburing.h>
+#endif
+#include "vdaio.h"
+#include "vdstats.h"
+
+using namespace std;
+
+/* largest single read handed to the kernel */
+#define VDAIO_MAX_READ (1U << 30)
+#define VDAIO_MAX_THREADS 16
+
+VDAsyncReader::VDAsyncReader()
+    : _queueDepth(0), _ring(NULL), _fd(-1), _stop(false)
+{
+}
+
+VDAsyncReader::~VDAsyncReader()
+{
+    Close();
+}
+
+void VDAsyncReader::Open(const std::string & filePath, unsigned queueDepth)
+{
+    _queueDepth = queueDepth ? queueDepth : 1;
+#ifdef VD_HAVE_LIBURING
+    _fd = open(filePath.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        throw exception("open file failed");
+    }
+    _ring = new struct io_uring();
+    if (io_uring_queue_init(_queueDepth, _ring, 0) < 0) {
+        /* kernel without io_uring, use the thread pool */
+        delete _ring;
+        _ring = NULL;
+    }
+    if (_ring) {
+        return;
+    }
+    close(_fd);
+    _fd = -1;
+#endif
+    _io.Open(filePath);
+    _stop = false;
+    unsigned threads = std::min<unsigned>(_queueDepth, VDAIO_MAX_THREADS);
+    for (unsigned i = 0; i < threads; ++i) {
+        _workers.push_back(std::thread(&VDAsyncReader::worker, this));
+    }
+}
+
+void VDAsyncReader::Close()
+{
+#ifdef VD_HAVE_LIBURING
+    if (_ring) {
+        io_uring_queue_exit(_ring);
+        delete _ring;
+        _ring = NULL;
+    }
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+#endif
+    if (!_workers.empty()) {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stop = true;
+        }
+        _todoCond.notify_all();
+        for (size_t i = 0; i < _workers.size(); ++i) {
+            _workers[i].join();
+        }
+        _workers.clear();
+    }
+    _io.Close();
+}
+
+bool VDAsyncReader::IsOpen() const
+{
+    return _ring != NULL || _io.IsOpen();
+}
+
+void VDAsyncReader::ReadBatch(VDAioRequest *reqs, size_t count, VDAioCallback callback, void *ctx)
+{
+    for (size_t i = 0; i < count; ++i) {
+        reqs[i].result = 0;
+        reqs[i].transferred = 0;
+    }
+    /* counted here on the calling thread, whichever backend reads, so a
+    * VDStatScope around the caller sees the batch */
+    uint64_t start = VD_STAT_NOW();
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bytes += reqs[i].length;
+    }
+    if (_ring) {
+        uringBatch(reqs, count, callback, ctx);
+    }
+    else {
+        poolBatch(reqs, count, callback, ctx);
+    }
+    VD_STAT_READ(count, bytes, start);
+    for (size_t i = 0; i < count; ++i) {
+        if (reqs[i].result < 0) {
+            throw exception("read file failed");
+        }
+    }
+}
+
+void VDAsyncReader::uringBatch(VDAioRequest *reqs, size_t count, VDAioCallback callback, void *ctx)
+{
+#ifdef VD_HAVE_LIBURING
+    size_t next = 0;
+    size_t completed = 0;
+    unsigned inflight = 0;
+    std::vector<VDAioRequest *> resubmit;
+
+    while (completed < count) {
+        while (inflight < _queueDepth && (next < count || !resubmit.empty())) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(_ring);
+            if (!sqe) {
+                break;
+            }
+            VDAioRequest *req;
+            if (!resubmit.empty()) {
+                req = resubmit.back();
+                resubmit.pop_back();
+            }
+            else {
+                req = &reqs[next++];
+            }
+            unsigned len = (unsigned)std::min<uint64_t>(req->length - req->transferred, VDAIO_MAX_READ);
+            io_uring_prep_read(sqe, _fd, req->buffer + req->transferred, len, req->offset + req->transferred);
+            io_uring_sqe_set_data(sqe, req);
+            ++inflight;
+        }
+        io_uring_submit(_ring);
+
+        struct io_uring_cqe *cqe;
+        int ret;
+        do {
+            ret = io_uring_wait_cqe(_ring, &cqe);
+        } while (ret == -EINTR || ret == -EAGAIN);
+        if (ret < 0) {
+            uringDrain(inflight);
+            throw exception("io_uring wait failed");
+        }
+        do {
+            VDAioRequest *req = (VDAioRequest *)io_uring_cqe_get_data(cqe);
+            int res = cqe->res;
+            io_uring_cqe_seen(_ring, cqe);
+            --inflight;
+            if (res == -EINTR || res == -EAGAIN) {
+                resubmit.push_back(req);
+                continue;
+            }
+            if (res < 0) {
+                req->result = res;
+            }
+            else if (res == 0) {
+                /* end of file */
+                memset(req->buffer + req->transferred, 0, (size_t)(req->length - req->transferred));
+                req->transferred = req->length;
+            }
+            else {
+                req->transferred += res;
+                if (req->transferred < req->length) {
+                    resubmit.push_back(req);
+                    continue;
+                }
+            }
+            ++completed;
+            if (callback) {
+                try {
+                    callback(ctx, req);
+                }
+                catch (...) {
+                    /* nothing more is submitted, reap what is in flight */
+                    uringDrain(inflight);
+                    throw;
+                }
+            }
+        } while (io_uring_peek_cqe(_ring, &cqe) == 0);
+    }
+#else
+    poolBatch(reqs, count, callback, ctx);
+#endif
+}
+
+#ifdef VD_HAVE_LIBURING
+/*
+* Reap the reads still in flight before a failed batch or a throwing
+* callback unwinds, so none of them completes into buffers the caller frees.
+*/
+void VDAsyncReader::uringDrain(unsigned inflight)
+{
+    while (inflight) {
+        struct io_uring_cqe *cqe;
+        int ret = io_uring_wait_cqe(_ring, &cqe);
+        if (ret == -EINTR || ret == -EAGAIN) {
+            continue;
+        }
+        if (ret < 0) {
+            /* the ring itself is broken, nothing more completes */
+            break;
+        }
+        io_uring_cqe_seen(_ring, cqe);
+        --inflight;
+    }
+}
+#endif
+
+void VDAsyncReader::poolBatch(VDAioRequest *reqs, size_t count, VDAioCallback callback, void *ctx)
+{
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        for (size_t i = 0; i < count; ++i) {
+            _todo.push_back(&reqs[i]);
+        }
+    }
+    _todoCond.notify_all();
+
+    for (size_t completed = 0; completed < count; ++completed) {
+        VDAioRequest *req;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            while (_done.empty()) {
+                _doneCond.wait(guard);
+            }
+            req = _done.front();
+            _done.pop_front();
+        }
+        if (callback) {
+            try {
+                callback(ctx, req);
+            }
+            catch (...) {
+                poolCancel(reqs, count, count - completed - 1);
+                throw;
+            }
+        }
+    }
+}
+
+/*
+* Take the requests of a batch that no worker has started off the queue and
+* wait for the pending ones being read, so that none completes into the
+* caller's buffers, or is left in _done for the next batch, after a callback
+* throws.
+*/
+void VDAsyncReader::poolCancel(VDAioRequest *reqs, size_t count, size_t pending)
+{
+    std::unique_lock<std::mutex> guard(_lock);
+    for (std::deque<VDAioRequest *>::iterator it = _todo.begin(); it != _todo.end();) {
+        if (*it >= reqs && *it < reqs + count) {
+            it = _todo.erase(it);
+            --pending;
+        }
+        else {
+            ++it;
+        }
+    }
+    while (pending) {
+        while (_done.empty()) {
+            _doneCond.wait(guard);
+        }
+        _done.pop_front();
+        --pending;
+    }
+}
+
+void VDAsyncReader::worker()
+{
+    for (;;) {
+        VDAioRequest *req;
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            while (_todo.empty() && !_stop) {
+                _todoCond.wait(guard);
+            }
+            if (_stop) {
+                return;
+            }
+            req = _todo.front();
+            _todo.pop_front();
+        }
+        try {
+            _io.ReadUncounted(req->offset, req->buffer, req->length);
+            req->transferred = req->length;
+        }
+        catch (...) {
+            req->result = -EIO;
+        }
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _done.push_back(req);
+        }
+        _doneCond.notify_one();
+    }
+}
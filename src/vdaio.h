@@ -0,0 +1,77 @@
+#pragma once
+#ifndef _VDAIO_H_
+#define _VDAIO_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "vdio.h"
+
+/* One read of an asynchronous batch. */
+struct VDAioRequest
+{
+    uint64_t offset;
+    uint64_t length;
+    char *buffer;
+    void *user;             /* caller cookie, untouched */
+    int result;             /* 0 on success, negative errno on failure */
+    uint64_t transferred;   /* bytes read so far */
+};
+
+typedef void (*VDAioCallback)(void *ctx, VDAioRequest *req);
+
+struct io_uring;
+
+/*
+* Batched reader that keeps up to queueDepth reads in flight. Uses io_uring
+* when built with VD_HAVE_LIBURING and the kernel supports it, otherwise a
+* small pool of threads issuing positional reads.
+*/
+class VDAsyncReader
+{
+public:
+    VDAsyncReader();
+    ~VDAsyncReader();
+
+    void Open(const std::string & filePath, unsigned queueDepth);
+    void Close();
+    bool IsOpen() const;
+    bool UsingUring() const { return _ring != NULL; }
+
+    /* Read every request of the batch. The callback, if any, runs on the
+    * calling thread as each request completes, in completion order. Reads
+    * past the end of the file are zero filled. Throws once the whole batch
+    * is done if any read failed. If the callback throws, the reads not yet
+    * started are dropped and the rest waited for before the exception
+    * propagates. */
+    void ReadBatch(VDAioRequest *reqs, size_t count, VDAioCallback callback = NULL, void *ctx = NULL);
+
+private:
+    void uringBatch(VDAioRequest *reqs, size_t count, VDAioCallback callback, void *ctx);
+#ifdef VD_HAVE_LIBURING
+    void uringDrain(unsigned inflight);
+#endif
+    void poolBatch(VDAioRequest *reqs, size_t count, VDAioCallback callback, void *ctx);
+    void poolCancel(VDAioRequest *reqs, size_t count, size_t pending);
+    void worker();
+
+private:
+    VDPreadIo _io;
+    unsigned _queueDepth;
+    struct io_uring *_ring;
+    int _fd;
+
+    std::vector<std::thread> _workers;
+    std::mutex _lock;
+    std::condition_variable _todoCond;
+    std::condition_variable _doneCond;
+    std::deque<VDAioRequest *> _todo;
+    std::deque<VDAioRequest *> _done;
+    bool _stop;
+};
+
+#endif // !_VDAIO_H_
@@ -0,0 +1,66 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include "vdarena.h"
+
+using namespace std;
+
+VDArena::VDArena(size_t blockSize, size_t retain)
+    : _blockSize(blockSize), _retain(retain), _capacity(0)
+{
+}
+
+VDArena::~VDArena()
+{
+    for (size_t i = 0; i < _blocks.size(); ++i) {
+        free(_blocks[i].data);
+    }
+}
+
+void *VDArena::Alloc(size_t size, size_t align)
+{
+    /* first fit over the blocks, smallest first after a Reset, so that small
+    * allocations do not eat into the block that held the last BAT */
+    for (size_t i = 0; i < _blocks.size(); ++i) {
+        Block & block = _blocks[i];
+        size_t start = ((uintptr_t)block.data + block.used + align - 1) & ~(uintptr_t)(align - 1);
+        start -= (uintptr_t)block.data;
+        if (start + size <= block.size) {
+            block.used = start + size;
+            return block.data + start;
+        }
+    }
+
+    Block block;
+    block.size = std::max(_blockSize, size + align);
+    block.data = (uint8_t *)malloc(block.size);
+    if (block.data == NULL) {
+        throw exception("malloc memory failed");
+    }
+    size_t start = (((uintptr_t)block.data + align - 1) & ~(uintptr_t)(align - 1)) - (uintptr_t)block.data;
+    block.used = start + size;
+    _blocks.push_back(block);
+    _capacity += block.size;
+    return block.data + start;
+}
+
+void VDArena::Reset()
+{
+    /* keep the largest blocks, they serve the BAT of the next image */
+    std::sort(_blocks.begin(), _blocks.end(), [](const Block & a, const Block & b) {
+        return a.size > b.size;
+    });
+    size_t kept = 0;
+    size_t i = 0;
+    for (; i < _blocks.size() && kept + _blocks[i].size <= _retain; ++i) {
+        kept += _blocks[i].size;
+        _blocks[i].used = 0;
+    }
+    for (size_t j = i; j < _blocks.size(); ++j) {
+        free(_blocks[j].data);
+    }
+    _blocks.resize(i);
+    std::reverse(_blocks.begin(), _blocks.end());
+    _capacity = kept;
+}
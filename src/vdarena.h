@@ -0,0 +1,54 @@
+#pragma once
+#ifndef _VDARENA_H_
+#define _VDARENA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+* Bump allocator for the state of one open image. Everything allocated
+* between two Resets is released at once by the next Reset, which keeps the
+* blocks (up to the retain limit) for the next image, so a parser that opens
+* thousands of disks stops going to the heap after the first few.
+*/
+class VDArena
+{
+public:
+    explicit VDArena(size_t blockSize = 64 * 1024, size_t retain = 64 * 1024 * 1024);
+    ~VDArena();
+
+    /* size bytes aligned to align, a power of 2. Throws when the heap is
+    * exhausted, never returns NULL. The memory is not cleared. */
+    void *Alloc(size_t size, size_t align = 16);
+
+    template <class T>
+    T *Alloc(size_t count = 1)
+    {
+        return (T *)Alloc(sizeof(T) * count, alignof(T) < 16 ? 16 : alignof(T));
+    }
+
+    /* Release every allocation, keeping the blocks for reuse. */
+    void Reset();
+
+    /* bytes held in blocks, in use or not */
+    size_t Capacity() const { return _capacity; }
+
+private:
+    VDArena(const VDArena &);
+    VDArena & operator=(const VDArena &);
+
+    struct Block
+    {
+        uint8_t *data;
+        size_t size;
+        size_t used;
+    };
+private:
+    size_t _blockSize;
+    size_t _retain;
+    size_t _capacity;
+    std::vector<Block> _blocks;
+};
+
+#endif // !_VDARENA_H_
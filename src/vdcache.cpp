@@ -0,0 +1,238 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "vdcache.h"
+#include "vdchain.h"
+#include "vd.h"
+
+using namespace std;
+
+#define VD_CACHE_MAGIC "vdmapc01"
+#define VD_CACHE_VERSION 1
+
+/* entry file layout, all little endian, followed by the path, the runs as
+* (offset, length) pairs and a VDHash64 of everything before it */
+typedef struct VDCacheEntryHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t pathLength;
+    uint64_t fileSize;
+    uint64_t mtime;
+    uint64_t sequence;
+    uint64_t batHash;
+    uint64_t runCount;
+} VDCacheEntryHeader;
+
+static bool fileTimes(const std::string & path, uint64_t & size, uint64_t & mtime)
+{
+#ifdef _WIN32
+    struct _stat64 st;
+    if (_stat64(path.c_str(), &st) != 0) {
+        return false;
+    }
+    mtime = (uint64_t)st.st_mtime * 1000000000;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+#if defined(__linux__)
+    mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#else
+    mtime = (uint64_t)st.st_mtime * 1000000000;
+#endif
+#endif
+    size = (uint64_t)st.st_size;
+    return true;
+}
+
+VDAllocationCache::VDAllocationCache(const std::string & directory)
+    : _directory(directory), _hits(0), _misses(0)
+{
+    if (!_directory.empty() && _directory[_directory.size() - 1] != '/' && _directory[_directory.size() - 1] != '\\') {
+        _directory += '/';
+    }
+}
+
+std::string VDAllocationCache::entryPath(const std::string & filePath) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.vdmap", (unsigned long long)VDHash64(filePath.data(), filePath.size(), 0));
+    return _directory + name;
+}
+
+bool VDAllocationCache::MakeKey(ncIVDParserEx *parser, const std::string & filePath, VDCacheKey & key)
+{
+    VDImageStamp stamp;
+    uint64_t size;
+    if (!fileTimes(filePath, size, key.mtime)) {
+        return false;
+    }
+    parser->GetImageStamp(stamp);
+    key.fileSize = stamp.fileSize;
+    key.sequence = stamp.sequence;
+    key.batHash = stamp.batHash;
+    return size == stamp.fileSize;
+}
+
+/* Every layer folded in: its file size and time, its stamp and its path. */
+bool VDAllocationCache::MakeKey(VDChain *chain, VDCacheKey & key)
+{
+    key.fileSize = 0;
+    key.mtime = 0;
+    key.sequence = 0;
+    key.batHash = 0;
+    for (size_t i = 0; i < chain->GetDepth(); ++i) {
+        const std::string & path = chain->GetLayerPath(i);
+        VDImageStamp stamp;
+        uint64_t size;
+        uint64_t mtime;
+        if (!fileTimes(path, size, mtime)) {
+            return false;
+        }
+        chain->GetLayer(i)->GetImageStamp(stamp);
+        if (size != stamp.fileSize) {
+            return false;
+        }
+        key.fileSize += size;
+        key.mtime = VDHash64(&mtime, sizeof(mtime), key.mtime);
+        key.sequence = VDHash64(&stamp.sequence, sizeof(stamp.sequence), key.sequence);
+        key.batHash = VDHash64(path.data(), path.size(), key.batHash);
+        key.batHash = VDHash64(&stamp.batHash, sizeof(stamp.batHash), key.batHash);
+    }
+    return true;
+}
+
+bool VDAllocationCache::Load(const std::string & filePath, const VDCacheKey & key, DataAreaMap & areamap)
+{
+    std::ifstream infile(entryPath(filePath).c_str(), ios::in | ios::binary);
+    if (infile.fail()) {
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(infile)), std::istreambuf_iterator<char>());
+
+    VDCacheEntryHeader header;
+    if (data.size() < sizeof(header) + sizeof(uint64_t)) {
+        return false;
+    }
+    memcpy(&header, &data[0], sizeof(header));
+    if (memcmp(header.magic, VD_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != VD_CACHE_VERSION) {
+        return false;
+    }
+    uint64_t expected = sizeof(header) + (uint64_t)header.pathLength + header.runCount * 8 + sizeof(uint64_t);
+    if (header.runCount > data.size() || expected != data.size()) {
+        return false;
+    }
+    uint64_t checksum;
+    memcpy(&checksum, &data[data.size() - sizeof(checksum)], sizeof(checksum));
+    if (checksum != VDHash64(&data[0], data.size() - sizeof(checksum), 0)) {
+        return false;
+    }
+    /* different paths may share an entry name */
+    if (header.pathLength != filePath.size() || memcmp(&data[sizeof(header)], filePath.data(), filePath.size()) != 0) {
+        return false;
+    }
+    if (header.fileSize != key.fileSize || header.mtime != key.mtime ||
+        header.sequence != key.sequence || header.batHash != key.batHash) {
+        return false;
+    }
+
+    DataAreaMap cached;
+    cached.Reserve((size_t)header.runCount);
+    const char *runs = &data[sizeof(header) + header.pathLength];
+    for (uint64_t i = 0; i < header.runCount; ++i) {
+        uint32_t run[2];
+        memcpy(run, runs + i * 8, 8);
+        cached.Append(run[0], run[1]);
+    }
+    areamap.Union(cached);
+    return true;
+}
+
+bool VDAllocationCache::Store(const std::string & filePath, const VDCacheKey & key, const DataAreaMap & areamap)
+{
+    VDCacheEntryHeader header;
+    memcpy(header.magic, VD_CACHE_MAGIC, sizeof(header.magic));
+    header.version = VD_CACHE_VERSION;
+    header.pathLength = (uint32_t)filePath.size();
+    header.fileSize = key.fileSize;
+    header.mtime = key.mtime;
+    header.sequence = key.sequence;
+    header.batHash = key.batHash;
+    header.runCount = areamap.Size();
+
+    std::vector<char> data(sizeof(header) + filePath.size() + areamap.Size() * 8 + sizeof(uint64_t));
+    memcpy(&data[0], &header, sizeof(header));
+    memcpy(&data[sizeof(header)], filePath.data(), filePath.size());
+    char *runs = &data[sizeof(header) + filePath.size()];
+    for (size_t i = 0; i < areamap.Size(); ++i) {
+        uint32_t run[2] = { areamap.Offset(i), areamap.Length(i) };
+        memcpy(runs + i * 8, run, 8);
+    }
+    uint64_t checksum = VDHash64(&data[0], data.size() - sizeof(checksum), 0);
+    memcpy(&data[data.size() - sizeof(checksum)], &checksum, sizeof(checksum));
+
+    /* write a private file and rename it over the entry, so readers never
+    * see half an entry */
+    std::string path = entryPath(filePath);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%llx.tmp", (unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::string tmpPath = path + suffix;
+    {
+        std::ofstream outfile(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+        if (outfile.fail()) {
+            return false;
+        }
+        outfile.write(&data[0], data.size());
+        if (outfile.fail()) {
+            outfile.close();
+            remove(tmpPath.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    remove(path.c_str());
+#endif
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+void VDAllocationCache::GetDataAreaList(ncIVDParserEx *parser, const std::string & filePath, DataAreaMap & areamap)
+{
+    VDCacheKey key;
+    lookup(parser, filePath, MakeKey(parser, filePath, key) ? &key : NULL, areamap);
+}
+
+void VDAllocationCache::GetDataAreaList(VDChain *chain, DataAreaMap & areamap)
+{
+    VDCacheKey key;
+    /* kept apart from the entry of the top image on its own */
+    lookup(chain, "chain:" + chain->GetLayerPath(0), MakeKey(chain, key) ? &key : NULL, areamap);
+}
+
+/* Serve name from its entry when key matches, otherwise scan; without a
+* key the image cannot be checked, so it is scanned and not stored. */
+void VDAllocationCache::lookup(ncIVDParserEx *parser, const std::string & name, const VDCacheKey *key, DataAreaMap & areamap)
+{
+    if (key && Load(name, *key, areamap)) {
+        ++_hits;
+        return;
+    }
+    ++_misses;
+    DataAreaMap scanned;
+    parser->GetDataAreaList(scanned);
+    if (key) {
+        Store(name, *key, scanned);
+    }
+    areamap.Union(scanned);
+}
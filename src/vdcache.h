@@ -0,0 +1,60 @@
+#pragma once
+#ifndef _VDCACHE_H_
+#define _VDCACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include "ncIVDParserEx.h"
+
+class VDChain;
+
+/* Everything an entry must match to be reused. */
+struct VDCacheKey
+{
+    uint64_t fileSize;
+    uint64_t mtime;         /* modification time, ns where available */
+    uint64_t sequence;
+    uint64_t batHash;
+};
+
+/*
+* On-disk cache of the data area maps of image files, one entry file per
+* image in the cache directory. An entry is reused only while the file's
+* size and modification time, the image's header sequence or footer
+* checksum and its BAT hash all still match, so frozen parent disks are
+* scanned once and then served from the cache.
+*/
+class VDAllocationCache
+{
+public:
+    explicit VDAllocationCache(const std::string & directory);
+
+    /* Data areas of the image open in parser, whose file is filePath: from
+    * the cache when the entry is current, otherwise scanned through the
+    * parser and stored. Appends to areamap like the parser does. */
+    void GetDataAreaList(ncIVDParserEx *parser, const std::string & filePath, DataAreaMap & areamap);
+
+    /* The same for an open chain, whose entry is only current while every
+    * layer file still matches. */
+    void GetDataAreaList(VDChain *chain, DataAreaMap & areamap);
+
+    bool MakeKey(ncIVDParserEx *parser, const std::string & filePath, VDCacheKey & key);
+    bool MakeKey(VDChain *chain, VDCacheKey & key);
+    bool Load(const std::string & filePath, const VDCacheKey & key, DataAreaMap & areamap);
+    /* Failing to write an entry is not an error, the next run rescans. */
+    bool Store(const std::string & filePath, const VDCacheKey & key, const DataAreaMap & areamap);
+
+    uint64_t Hits() const { return _hits; }
+    uint64_t Misses() const { return _misses; }
+
+private:
+    std::string entryPath(const std::string & filePath) const;
+    void lookup(ncIVDParserEx *parser, const std::string & name, const VDCacheKey *key, DataAreaMap & areamap);
+private:
+    std::string _directory;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+};
+
+#endif // !_VDCACHE_H_
@@ -0,0 +1,405 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <string.h>
+#include <fstream>
+#include <algorithm>
+#include "vdchain.h"
+#include "vd.h"
+
+using namespace std;
+
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
+
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
+NS_IMPL_ISUPPORTS2(VDChain, ncIVDParser, ncIVDParserEx)
+
+VDChain::VDChain()
+    : _virtualSize(0), _granularity(0)
+{
+}
+
+VDChain::~VDChain()
+{
+    Close();
+}
+
+static bool fileExists(const std::string & path)
+{
+    std::ifstream f(path.c_str(), ios::in | ios::binary);
+    return f.is_open();
+}
+
+static bool isAbsolutePath(const std::string & path)
+{
+    if (!path.empty() && (path[0] == '/' || path[0] == '\\')) {
+        return true;
+    }
+    return path.size() > 1 && path[1] == ':';
+}
+
+/*
+* Open the parent of the top layer as the next layer: the first location
+* that exists and, when the child records one, carries the identity the
+* child links to. Relative locations are taken from the directory of the
+* child; as a last resort the parent's file name is looked up next to the
+* child.
+*/
+void VDChain::openParent(const std::list<std::string> & candidates)
+{
+    const std::string & childPath = _paths.back();
+    VDImageId expected;
+    bool linked = _layers.back()->GetParentId(expected);
+
+    std::string dir;
+    size_t slash = childPath.find_last_of("/\\");
+    if (slash != std::string::npos) {
+        dir = childPath.substr(0, slash + 1);
+    }
+
+    std::list<std::string> paths;
+    for (auto & candidate : candidates) {
+        std::string path = candidate;
+#ifndef _WIN32
+        std::replace(path.begin(), path.end(), '\\', '/');
+#endif
+        if (path.compare(0, 2, "./") == 0 || path.compare(0, 2, ".\\") == 0) {
+            path = path.substr(2);
+        }
+        if (!isAbsolutePath(path)) {
+            path = dir + path;
+        }
+        paths.push_back(path);
+        size_t sep = path.find_last_of("/\\");
+        if (sep != std::string::npos) {
+            paths.push_back(dir + path.substr(sep + 1));
+        }
+    }
+    bool mismatch = false;
+    for (auto & path : paths) {
+        if (!fileExists(path)) {
+            continue;
+        }
+        if (std::find(_paths.begin(), _paths.end(), path) != _paths.end()) {
+            throw exception("disk chain loop");
+        }
+        ncIVDParserEx *parent = CreateVDParser(path);
+        VDImageId id;
+        try {
+            parent->Open(path);
+            parent->GetImageId(id);
+        }
+        catch (...) {
+            delete parent;
+            throw;
+        }
+        if (linked && memcmp(id.bytes, expected.bytes, sizeof(id.bytes)) != 0) {
+            /* a stale or unrelated disk of the same name */
+            parent->Close();
+            delete parent;
+            mismatch = true;
+            continue;
+        }
+        _paths.push_back(path);
+        _layers.push_back(parent);
+        return;
+    }
+    throw exception(mismatch ? "parent disk identity mismatch" : "parent disk not found");
+}
+
+NS_IMETHODIMP_(void)
+VDChain::Open(const std::string & filePath)
+{
+    Close();
+    try {
+        _paths.push_back(filePath);
+        _layers.push_back(CreateVDParser(filePath));
+        _layers.back()->Open(filePath);
+        for (;;) {
+            std::list<std::string> parents;
+            if (!_layers.back()->GetParentPaths(parents)) {
+                break;
+            }
+            if (_layers.size() >= VD_CHAIN_MAX_DEPTH) {
+                throw exception("disk chain too deep");
+            }
+            openParent(parents);
+        }
+
+        _virtualSize = _layers[0]->GetVirtualSize();
+        _granularity = 0;
+        _extents.resize(_layers.size());
+        for (size_t i = 0; i < _layers.size(); ++i) {
+            uint64_t blockSize = _layers[i]->GetBlockSize();
+            if (blockSize && (!_granularity || blockSize < _granularity)) {
+                _granularity = blockSize;
+            }
+            _layers[i]->GetDataExtentList(_extents[i]);
+        }
+        if (!_granularity) {
+            _granularity = MiB;
+        }
+        buildOwnerIndex();
+    }
+    catch (...) {
+        Close();
+        throw;
+    }
+}
+
+NS_IMETHODIMP_(void)
+VDChain::Close()
+{
+    for (size_t i = 0; i < _layers.size(); ++i) {
+        _layers[i]->Close();
+        delete _layers[i];
+    }
+    _layers.clear();
+    _paths.clear();
+    _extents.clear();
+    _owner.clear();
+    _virtualSize = 0;
+    _granularity = 0;
+}
+
+/*
+* Walk the layers from the base up. A granule fully covered by an extent of
+* a layer belongs to that layer, hiding whatever the layers below hold; a
+* granule only partly covered is shared with the layers below.
+*/
+void VDChain::buildOwnerIndex()
+{
+    _owner.assign((size_t)DIV_ROUND_UP(_virtualSize, _granularity), VD_CHAIN_NO_OWNER);
+    for (size_t layer = _layers.size(); layer-- > 0;) {
+        const std::vector<DataExtent> & extents = _extents[layer];
+        for (size_t i = 0; i < extents.size(); ++i) {
+            uint64_t start = extents[i].offset;
+            uint64_t end = std::min(start + extents[i].length, _virtualSize);
+            if (start >= end) {
+                continue;
+            }
+            for (uint64_t g = start / _granularity; g <= (end - 1) / _granularity; ++g) {
+                uint64_t gstart = g * _granularity;
+                uint64_t gend = std::min(gstart + _granularity, _virtualSize);
+                _owner[g] = (start <= gstart && end >= gend) ? (uint16_t)layer : VD_CHAIN_MIXED;
+            }
+        }
+    }
+}
+
+uint16_t VDChain::GetOwner(uint64_t offset) const
+{
+    if (offset >= _virtualSize) {
+        return VD_CHAIN_NO_OWNER;
+    }
+    return _owner[offset / _granularity];
+}
+
+/* Read a range from layer, taking whatever it does not hold from below. */
+void VDChain::readLayers(size_t layer, uint64_t offset, char * buffer, uint64_t size)
+{
+    if (layer == _layers.size()) {
+        memset(buffer, 0, (size_t)size);
+        return;
+    }
+    const std::vector<DataExtent> & extents = _extents[layer];
+    std::vector<DataExtent>::const_iterator it = std::upper_bound(extents.begin(), extents.end(), offset,
+        [](uint64_t value, const DataExtent & e) { return value < e.offset; });
+    if (it != extents.begin() && (it - 1)->offset + (it - 1)->length > offset) {
+        --it;
+    }
+
+    uint64_t pos = offset;
+    uint64_t end = offset + size;
+    while (pos < end) {
+        if (it == extents.end() || it->offset >= end) {
+            readLayers(layer + 1, pos, buffer + (pos - offset), end - pos);
+            break;
+        }
+        if (it->offset > pos) {
+            readLayers(layer + 1, pos, buffer + (pos - offset), it->offset - pos);
+            pos = it->offset;
+        }
+        uint64_t stop = std::min(it->offset + it->length, end);
+        _layers[layer]->ReadData(pos, buffer + (pos - offset), stop - pos);
+        pos = stop;
+        ++it;
+    }
+}
+
+NS_IMETHODIMP_(void)
+VDChain::ReadData(uint64_t offset, char * buffer, uint64_t size)
+{
+    if (offset >= _virtualSize) {
+        memset(buffer, 0, (size_t)size);
+        return;
+    }
+    if (size > _virtualSize - offset) {
+        memset(buffer + (_virtualSize - offset), 0, (size_t)(size - (_virtualSize - offset)));
+        size = _virtualSize - offset;
+    }
+    uint64_t end = offset + size;
+    while (offset < end) {
+        /* extend over the following granules of the same owner */
+        uint16_t owner = _owner[offset / _granularity];
+        uint64_t stop = std::min((offset / _granularity + 1) * _granularity, end);
+        while (owner != VD_CHAIN_MIXED && stop < end && _owner[stop / _granularity] == owner) {
+            stop = std::min(stop + _granularity, end);
+        }
+        uint64_t length = stop - offset;
+        if (owner == VD_CHAIN_NO_OWNER) {
+            memset(buffer, 0, (size_t)length);
+        }
+        else if (owner == VD_CHAIN_MIXED) {
+            readLayers(0, offset, buffer, length);
+        }
+        else {
+            _layers[owner]->ReadData(offset, buffer, length);
+        }
+        offset += length;
+        buffer += length;
+    }
+}
+
+NS_IMETHODIMP_(void)
+VDChain::GetDataAreaList(std::list<DataArea> & arealist)
+{
+    DataAreaMap areamap;
+    GetDataAreaList(areamap);
+    areamap.ToList(arealist);
+}
+
+NS_IMETHODIMP_(void)
+VDChain::GetDataAreaList(DataAreaMap & areamap)
+{
+    std::vector<DataAreaMap> layerMaps(_layers.size());
+    std::vector<const DataAreaMap *> maps;
+    for (size_t layer = 0; layer < _layers.size(); ++layer) {
+        const std::vector<DataExtent> & extents = _extents[layer];
+        for (size_t i = 0; i < extents.size(); ++i) {
+            uint64_t end = std::min(extents[i].offset + extents[i].length, _virtualSize);
+            if (extents[i].offset >= end) {
+                continue;
+            }
+            layerMaps[layer].Append((uint32_t)(extents[i].offset / MiB),
+                (uint32_t)(DIV_ROUND_UP(end, MiB) - extents[i].offset / MiB));
+        }
+        maps.push_back(&layerMaps[layer]);
+    }
+    DataAreaMapMerge(maps, areamap);
+}
+
+NS_IMETHODIMP_(void)
+VDChain::GetDataAreaList(AllocationBitmap & bitmap)
+{
+    bitmap.Resize(DIV_ROUND_UP(_virtualSize, MiB));
+    for (size_t layer = 0; layer < _layers.size(); ++layer) {
+        const std::vector<DataExtent> & extents = _extents[layer];
+        for (size_t i = 0; i < extents.size(); ++i) {
+            uint64_t end = std::min(extents[i].offset + extents[i].length, _virtualSize);
+            if (extents[i].offset >= end) {
+                continue;
+            }
+            bitmap.SetRange(extents[i].offset / MiB, DIV_ROUND_UP(end, MiB) - extents[i].offset / MiB);
+        }
+    }
+}
+
+/* The data of the merged disk spans several files, so the extents carry no
+* file offset. */
+NS_IMETHODIMP_(void)
+VDChain::GetDataExtentList(std::vector<DataExtent> & extents)
+{
+    std::vector<DataExtent> all;
+    for (size_t layer = 0; layer < _layers.size(); ++layer) {
+        all.insert(all.end(), _extents[layer].begin(), _extents[layer].end());
+    }
+    std::sort(all.begin(), all.end(),
+        [](const DataExtent & a, const DataExtent & b) { return a.offset < b.offset; });
+    for (size_t i = 0; i < all.size(); ++i) {
+        uint64_t start = all[i].offset;
+        uint64_t end = std::min(start + all[i].length, _virtualSize);
+        if (!extents.empty() && start < extents.back().offset + extents.back().length) {
+            start = extents.back().offset + extents.back().length;
+        }
+        if (start >= end) {
+            continue;
+        }
+        AppendDataExtent(extents, start, end - start, VD_NO_FILE_OFFSET);
+    }
+}
+
+NS_IMETHODIMP_(uint64_t)
+VDChain::GetVirtualSize()
+{
+    return _virtualSize;
+}
+
+/* the chain is complete in itself */
+NS_IMETHODIMP_(bool)
+VDChain::GetParentPaths(std::list<std::string> &)
+{
+    return false;
+}
+
+NS_IMETHODIMP_(uint32_t)
+VDChain::GetBlockSize()
+{
+    return (uint32_t)_granularity;
+}
+
+/* the identity of the disk that was opened */
+NS_IMETHODIMP_(void)
+VDChain::GetImageId(VDImageId & id)
+{
+    _layers[0]->GetImageId(id);
+}
+
+NS_IMETHODIMP_(bool)
+VDChain::GetParentId(VDImageId &)
+{
+    return false;
+}
+
+/* stamps of all layers folded together */
+NS_IMETHODIMP_(void)
+VDChain::GetImageStamp(VDImageStamp & stamp)
+{
+    stamp.fileSize = 0;
+    stamp.sequence = 0;
+    stamp.batHash = 0;
+    for (size_t i = 0; i < _layers.size(); ++i) {
+        VDImageStamp layer;
+        _layers[i]->GetImageStamp(layer);
+        stamp.fileSize += layer.fileSize;
+        stamp.sequence = VDHash64(&layer.sequence, sizeof(layer.sequence), stamp.sequence);
+        stamp.batHash = VDHash64(&layer.batHash, sizeof(layer.batHash), stamp.batHash);
+    }
+}
+
+void GetBackupChainBlocks(const std::string & childPath, std::list<DataArea> & arealist)
+{
+    VDChain chain;
+    chain.Open(childPath);
+    chain.GetDataAreaList(arealist);
+    chain.Close();
+}
+
+void GetBackupChainBlocks(const std::string & childPath, DataAreaMap & areamap)
+{
+    VDChain chain;
+    chain.Open(childPath);
+    chain.GetDataAreaList(areamap);
+    chain.Close();
+}
+
+void GetBackupChainBlocks(const std::string & childPath, AllocationBitmap & bitmap)
+{
+    VDChain chain;
+    chain.Open(childPath);
+    chain.GetDataAreaList(bitmap);
+    chain.Close();
+}
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef _VDCHAIN_H_
+#define _VDCHAIN_H_
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <vector>
+#include "ncIVDParserEx.h"
+
+#define VD_CHAIN_MAX_DEPTH 256
+
+/* owner index values that are not a layer number */
+#define VD_CHAIN_NO_OWNER  0xffff   /* no layer holds data, reads as zero */
+#define VD_CHAIN_MIXED     0xfffe   /* several layers share the granule */
+
+/*
+* A differencing disk together with all of its parents, opened once. Layer 0
+* is the disk that was opened, the last layer is the base disk. The virtual
+* disk reads through the chain: every byte comes from the topmost layer that
+* holds it.
+*
+* Open scans each layer once and builds an owner index with one entry per
+* granule (the smallest block size of the chain), so that reads and
+* allocation queries resolve the owning layer in O(1). Only granules shared
+* by several layers, e.g. a partially written differencing block, fall back
+* to the per-layer extent lists.
+*/
+class VDChain : public ncIVDParserEx
+{
+public:
+    NS_DECL_ISUPPORTS
+    NS_DECL_NCIVDPARSE
+    NS_DECL_NCIVDPARSEEX
+    VDChain();
+    ~VDChain();
+
+    size_t GetDepth() const { return _layers.size(); }
+    ncIVDParserEx *GetLayer(size_t layer) const { return _layers[layer]; }
+    const std::string & GetLayerPath(size_t layer) const { return _paths[layer]; }
+
+    /* Layer owning the granule that contains offset, VD_CHAIN_NO_OWNER or
+    * VD_CHAIN_MIXED. */
+    uint16_t GetOwner(uint64_t offset) const;
+
+private:
+    void openParent(const std::list<std::string> & candidates);
+    void buildOwnerIndex();
+    void readLayers(size_t layer, uint64_t offset, char * buffer, uint64_t size);
+private:
+    std::vector<ncIVDParserEx *> _layers;
+    std::vector<std::string> _paths;
+    std::vector<std::vector<DataExtent> > _extents;
+    std::vector<uint16_t> _owner;
+    uint64_t _virtualSize;
+    uint64_t _granularity;
+};
+
+/* Data areas of the whole chain of childPath, each layer scanned once. */
+void GetBackupChainBlocks(const std::string & childPath, std::list<DataArea> & arealist);
+
+void GetBackupChainBlocks(const std::string & childPath, DataAreaMap & areamap);
+
+void GetBackupChainBlocks(const std::string & childPath, AllocationBitmap & bitmap);
+
+#endif // !_VDCHAIN_H_
@@ -0,0 +1,44 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <algorithm>
+#include "vdinterval.h"
+
+using namespace std;
+
+size_t VDIntervalSet::lowerBound(uint64_t start) const
+{
+    /* the ranges are disjoint, so the ends are sorted as well */
+    return std::upper_bound(_ends.begin(), _ends.end(), start) - _ends.begin();
+}
+
+bool VDIntervalSet::Overlaps(uint64_t start, uint64_t length) const
+{
+    if (length == 0) {
+        return false;
+    }
+    size_t i = lowerBound(start);
+    return i < _starts.size() && _starts[i] < start + length;
+}
+
+bool VDIntervalSet::Insert(uint64_t start, uint64_t length)
+{
+    if (start + length < start) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    size_t i = lowerBound(start);
+    if (i < _starts.size() && _starts[i] < start + length) {
+        return false;
+    }
+    _starts.insert(_starts.begin() + i, start);
+    _ends.insert(_ends.begin() + i, start + length);
+    return true;
+}
+
+void VDIntervalSet::Clear()
+{
+    _starts.clear();
+    _ends.clear();
+}
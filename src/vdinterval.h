@@ -0,0 +1,36 @@
+#pragma once
+#ifndef _VDINTERVAL_H_
+#define _VDINTERVAL_H_
+
+#include <stdint.h>
+#include <vector>
+
+/*
+* Set of disjoint half open byte ranges kept sorted by start, so an overlap
+* query is a binary search instead of a walk over every range. Used to
+* validate that the structures of an image file do not overlap before any
+* of their offsets is trusted.
+*/
+class VDIntervalSet
+{
+public:
+    /* Add [start, start + length) unless it overlaps a range already in the
+    * set or wraps around. Returns false, leaving the set unchanged, if it
+    * does. Empty ranges are accepted and not stored. */
+    bool Insert(uint64_t start, uint64_t length);
+
+    /* true if [start, start + length) shares a byte with any range */
+    bool Overlaps(uint64_t start, uint64_t length) const;
+
+    void Clear();
+    size_t Size() const { return _starts.size(); }
+
+private:
+    /* index of the first range that ends after start */
+    size_t lowerBound(uint64_t start) const;
+private:
+    std::vector<uint64_t> _starts;
+    std::vector<uint64_t> _ends;
+};
+
+#endif // !_VDINTERVAL_H_
@@ -0,0 +1,583 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "vdio.h"
+#include "vd.h"
+#include "vdstats.h"
+
+using namespace std;
+
+const uint8_t *VDIo::View(uint64_t offset, uint64_t size, uint8_t *scratch)
+{
+    const uint8_t *p = Map(offset, size);
+    if (p) {
+        return p;
+    }
+    Read(offset, (char *)scratch, size);
+    return scratch;
+}
+
+/* Append [offset, end) to ranges sorted by offset, folding it into the last
+* range when they touch or overlap. */
+static void appendFileRange(std::vector<VDFileRange> & ranges, size_t first, uint64_t offset, uint64_t end)
+{
+    if (offset >= end) {
+        return;
+    }
+    if (ranges.size() > first) {
+        VDFileRange & last = ranges.back();
+        if (offset <= last.offset + last.length) {
+            last.length = std::max(last.offset + last.length, end) - last.offset;
+            return;
+        }
+    }
+    VDFileRange range;
+    range.offset = offset;
+    range.length = end - offset;
+    ranges.push_back(range);
+}
+
+#ifdef _WIN32
+static bool queryAllocatedRanges(HANDLE handle, uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges)
+{
+    size_t first = ranges.size();
+    uint64_t end = offset + size;
+    FILE_ALLOCATED_RANGE_BUFFER query;
+    FILE_ALLOCATED_RANGE_BUFFER found[256];
+    query.FileOffset.QuadPart = (LONGLONG)offset;
+    query.Length.QuadPart = (LONGLONG)size;
+    while (query.Length.QuadPart > 0) {
+        DWORD got = 0;
+        BOOL done = DeviceIoControl(handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+            found, sizeof(found), &got, NULL);
+        if (!done && GetLastError() != ERROR_MORE_DATA) {
+            ranges.resize(first);
+            return false;
+        }
+        DWORD n = got / sizeof(FILE_ALLOCATED_RANGE_BUFFER);
+        for (DWORD i = 0; i < n; ++i) {
+            uint64_t start = (uint64_t)found[i].FileOffset.QuadPart;
+            appendFileRange(ranges, first, std::max(start, offset),
+                std::min(start + (uint64_t)found[i].Length.QuadPart, end));
+        }
+        if (done || n == 0) {
+            break;
+        }
+        uint64_t next = (uint64_t)found[n - 1].FileOffset.QuadPart + (uint64_t)found[n - 1].Length.QuadPart;
+        query.FileOffset.QuadPart = (LONGLONG)next;
+        query.Length.QuadPart = next < end ? (LONGLONG)(end - next) : 0;
+    }
+    return true;
+}
+#else
+/* Walk the data ranges with SEEK_DATA and SEEK_HOLE. File systems without
+* hole tracking report the whole file as data. */
+static bool queryAllocatedRanges(int fd, uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+    size_t first = ranges.size();
+    uint64_t end = offset + size;
+    uint64_t pos = offset;
+    while (pos < end) {
+        off_t data = lseek(fd, (off_t)pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                /* nothing but a hole up to the end of the file */
+                break;
+            }
+            ranges.resize(first);
+            return false;
+        }
+        if ((uint64_t)data >= end) {
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            ranges.resize(first);
+            return false;
+        }
+        appendFileRange(ranges, first, (uint64_t)data, std::min((uint64_t)hole, end));
+        pos = (uint64_t)hole;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+#endif
+
+VDIo *CreateVDIo(VDIoBackend backend)
+{
+    switch (backend) {
+    case VD_IO_PREAD:
+        return new VDPreadIo();
+    case VD_IO_MMAP:
+        return new VDMmapIo();
+    default:
+        return new VDStreamIo();
+    }
+}
+
+/* ---- std::ifstream backend ---- */
+
+void VDStreamIo::Open(const std::string & filePath)
+{
+    fileHandle.open(filePath.c_str(), ios::in | ios::binary);
+    if (fileHandle.fail()) {
+        throw exception("open file failed");
+    }
+    _filePath = filePath;
+}
+
+void VDStreamIo::Close()
+{
+    fileHandle.close();
+    _filePath.clear();
+}
+
+bool VDStreamIo::IsOpen() const
+{
+    return fileHandle.is_open();
+}
+
+uint64_t VDStreamIo::GetFileSize()
+{
+    return ::GetFileSize(fileHandle);
+}
+
+void VDStreamIo::Read(uint64_t offset, char * buffer, uint64_t size)
+{
+    ::Read(fileHandle, offset, buffer, size);
+    uint64_t got = (uint64_t)fileHandle.gcount();
+    if (got < size) {
+        memset(buffer + got, 0, (size_t)(size - got));
+    }
+}
+
+bool VDStreamIo::GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges)
+{
+    if (_filePath.empty()) {
+        return false;
+    }
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(_filePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool known = queryAllocatedRanges(handle, offset, size, ranges);
+    CloseHandle(handle);
+#else
+    int fd = open(_filePath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool known = queryAllocatedRanges(fd, offset, size, ranges);
+    close(fd);
+#endif
+    return known;
+}
+
+/* ---- positional read backend ---- */
+
+VDPreadIo::VDPreadIo()
+{
+#ifdef _WIN32
+    _handle = INVALID_HANDLE_VALUE;
+#else
+    _fd = -1;
+#endif
+}
+
+VDPreadIo::~VDPreadIo()
+{
+    Close();
+}
+
+void VDPreadIo::Open(const std::string & filePath)
+{
+#ifdef _WIN32
+    _handle = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_handle == INVALID_HANDLE_VALUE) {
+        throw exception("open file failed");
+    }
+#else
+    _fd = open(filePath.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        throw exception("open file failed");
+    }
+#endif
+}
+
+void VDPreadIo::Close()
+{
+#ifdef _WIN32
+    if (_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(_handle);
+        _handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+#endif
+}
+
+bool VDPreadIo::IsOpen() const
+{
+#ifdef _WIN32
+    return _handle != INVALID_HANDLE_VALUE;
+#else
+    return _fd >= 0;
+#endif
+}
+
+uint64_t VDPreadIo::GetFileSize()
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_handle, &size)) {
+        throw exception("get file size failed");
+    }
+    return (uint64_t)size.QuadPart;
+#else
+    struct stat st;
+    if (fstat(_fd, &st) < 0) {
+        throw exception("get file size failed");
+    }
+    return (uint64_t)st.st_size;
+#endif
+}
+
+void VDPreadIo::Read(uint64_t offset, char * buffer, uint64_t size)
+{
+    uint64_t start = VD_STAT_NOW();
+    ReadUncounted(offset, buffer, size);
+    VD_STAT_READ(1, size, start);
+}
+
+void VDPreadIo::ReadUncounted(uint64_t offset, char * buffer, uint64_t size)
+{
+    uint64_t done = 0;
+    while (done < size) {
+#ifdef _WIN32
+        OVERLAPPED ov;
+        DWORD got = 0;
+        DWORD chunk = (DWORD)std::min<uint64_t>(size - done, 1U << 30);
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = (DWORD)(offset + done);
+        ov.OffsetHigh = (DWORD)((offset + done) >> 32);
+        if (!ReadFile(_handle, buffer + done, chunk, &got, &ov)) {
+            if (GetLastError() != ERROR_HANDLE_EOF) {
+                throw exception("read file failed");
+            }
+            got = 0;
+        }
+#else
+        ssize_t got = pread(_fd, buffer + done, (size_t)std::min<uint64_t>(size - done, 1U << 30), (off_t)(offset + done));
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw exception("read file failed");
+        }
+#endif
+        if (got == 0) {
+            memset(buffer + done, 0, (size_t)(size - done));
+            break;
+        }
+        done += got;
+    }
+}
+
+bool VDPreadIo::GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges)
+{
+#ifdef _WIN32
+    return queryAllocatedRanges((HANDLE)_handle, offset, size, ranges);
+#else
+    return queryAllocatedRanges(_fd, offset, size, ranges);
+#endif
+}
+
+/* ---- memory mapped backend ---- */
+
+VDMmapIo::VDMmapIo()
+    : _base(NULL), _size(0)
+{
+#ifdef _WIN32
+    _handle = INVALID_HANDLE_VALUE;
+    _mapping = NULL;
+#else
+    _fd = -1;
+#endif
+}
+
+VDMmapIo::~VDMmapIo()
+{
+    Close();
+}
+
+void VDMmapIo::Open(const std::string & filePath)
+{
+#ifdef _WIN32
+    _handle = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_handle == INVALID_HANDLE_VALUE) {
+        throw exception("open file failed");
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_handle, &size)) {
+        Close();
+        throw exception("get file size failed");
+    }
+    _size = (uint64_t)size.QuadPart;
+    if (_size) {
+        _mapping = CreateFileMappingA(_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (_mapping) {
+            _base = (const uint8_t *)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+        if (!_base) {
+            Close();
+            throw exception("map file failed");
+        }
+    }
+#else
+    _fd = open(filePath.c_str(), O_RDONLY);
+    if (_fd < 0) {
+        throw exception("open file failed");
+    }
+    struct stat st;
+    if (fstat(_fd, &st) < 0) {
+        Close();
+        throw exception("get file size failed");
+    }
+    _size = (uint64_t)st.st_size;
+    if (_size) {
+        void *p = mmap(NULL, (size_t)_size, PROT_READ, MAP_SHARED, _fd, 0);
+        if (p == MAP_FAILED) {
+            Close();
+            throw exception("map file failed");
+        }
+        _base = (const uint8_t *)p;
+    }
+#endif
+}
+
+void VDMmapIo::Close()
+{
+#ifdef _WIN32
+    if (_base) {
+        UnmapViewOfFile(_base);
+    }
+    if (_mapping) {
+        CloseHandle(_mapping);
+        _mapping = NULL;
+    }
+    if (_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(_handle);
+        _handle = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (_base) {
+        munmap((void *)_base, (size_t)_size);
+    }
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+#endif
+    _base = NULL;
+    _size = 0;
+}
+
+bool VDMmapIo::IsOpen() const
+{
+#ifdef _WIN32
+    return _handle != INVALID_HANDLE_VALUE;
+#else
+    return _fd >= 0;
+#endif
+}
+
+uint64_t VDMmapIo::GetFileSize()
+{
+    return _size;
+}
+
+void VDMmapIo::Read(uint64_t offset, char * buffer, uint64_t size)
+{
+    /* the copy is where the page faults, and so the storage time, land */
+    uint64_t start = VD_STAT_NOW();
+    uint64_t got = 0;
+    if (offset < _size) {
+        got = std::min(size, _size - offset);
+        memcpy(buffer, _base + offset, (size_t)got);
+    }
+    if (got < size) {
+        memset(buffer + got, 0, (size_t)(size - got));
+    }
+    VD_STAT_READ(1, size, start);
+}
+
+const uint8_t *VDMmapIo::Map(uint64_t offset, uint64_t size)
+{
+    if (!_base || offset > _size || size > _size - offset) {
+        return NULL;
+    }
+    VD_STAT_MAP(size);
+    return _base + offset;
+}
+
+bool VDMmapIo::GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges)
+{
+#ifdef _WIN32
+    return queryAllocatedRanges((HANDLE)_handle, offset, size, ranges);
+#else
+    return queryAllocatedRanges(_fd, offset, size, ranges);
+#endif
+}
+
+/* ---- in memory overlay ---- */
+
+VDOverlayIo::VDOverlayIo(VDIo *base)
+    : _base(base)
+{
+}
+
+void VDOverlayIo::Open(const std::string & filePath)
+{
+    _base->Open(filePath);
+}
+
+void VDOverlayIo::Close()
+{
+    _extents.clear();
+    _base->Close();
+}
+
+bool VDOverlayIo::IsOpen() const
+{
+    return _base->IsOpen();
+}
+
+uint64_t VDOverlayIo::GetFileSize()
+{
+    return _base->GetFileSize();
+}
+
+VDOverlayIo::ExtentMap::iterator VDOverlayIo::first(uint64_t offset)
+{
+    ExtentMap::iterator it = _extents.upper_bound(offset);
+    if (it != _extents.begin()) {
+        ExtentMap::iterator prev = it;
+        --prev;
+        if (prev->second.end > offset) {
+            return prev;
+        }
+    }
+    return it;
+}
+
+void VDOverlayIo::Write(uint64_t offset, const char * data, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    uint64_t end = offset + size;
+    /* cut the part of older extents that the new one covers */
+    ExtentMap::iterator it = first(offset);
+    while (it != _extents.end() && it->first < end) {
+        uint64_t start = it->first;
+        Extent old;
+        old.end = it->second.end;
+        old.data.swap(it->second.data);
+        it = _extents.erase(it);
+        if (start < offset) {
+            Extent & head = _extents[start];
+            head.end = offset;
+            if (!old.data.empty()) {
+                head.data.assign(old.data.begin(), old.data.begin() + (size_t)(offset - start));
+            }
+        }
+        if (old.end > end) {
+            Extent & tail = _extents[end];
+            tail.end = old.end;
+            if (!old.data.empty()) {
+                tail.data.assign(old.data.begin() + (size_t)(end - start), old.data.end());
+            }
+            break;
+        }
+    }
+    Extent & extent = _extents[offset];
+    extent.end = end;
+    if (data) {
+        extent.data.assign(data, data + size);
+    }
+}
+
+void VDOverlayIo::Read(uint64_t offset, char * buffer, uint64_t size)
+{
+    _base->Read(offset, buffer, size);
+    uint64_t end = offset + size;
+    for (ExtentMap::iterator it = first(offset); it != _extents.end() && it->first < end; ++it) {
+        uint64_t start = std::max(it->first, offset);
+        uint64_t stop = std::min(it->second.end, end);
+        if (it->second.data.empty()) {
+            memset(buffer + (start - offset), 0, (size_t)(stop - start));
+        }
+        else {
+            memcpy(buffer + (start - offset), &it->second.data[(size_t)(start - it->first)], (size_t)(stop - start));
+        }
+    }
+}
+
+const uint8_t *VDOverlayIo::Map(uint64_t offset, uint64_t size)
+{
+    ExtentMap::iterator it = first(offset);
+    if (it != _extents.end() && it->first < offset + size) {
+        return NULL;
+    }
+    return _base->Map(offset, size);
+}
+
+bool VDOverlayIo::GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges)
+{
+    size_t keep = ranges.size();
+    if (!_base->GetAllocatedRanges(offset, size, ranges)) {
+        return false;
+    }
+    uint64_t end = offset + size;
+    ExtentMap::iterator it = first(offset);
+    if (it == _extents.end() || it->first >= end) {
+        return true;
+    }
+    /* fold the replaced ranges into the ones of the base */
+    std::vector<VDFileRange> base(ranges.begin() + keep, ranges.end());
+    ranges.resize(keep);
+    size_t b = 0;
+    while (b < base.size() || (it != _extents.end() && it->first < end)) {
+        if (it == _extents.end() || it->first >= end ||
+            (b < base.size() && base[b].offset <= it->first)) {
+            appendFileRange(ranges, keep, base[b].offset, base[b].offset + base[b].length);
+            ++b;
+        }
+        else {
+            appendFileRange(ranges, keep, std::max(it->first, offset), std::min(it->second.end, end));
+            ++it;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,168 @@
+#pragma once
+#ifndef _VDIO_H_
+#define _VDIO_H_
+
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include <map>
+#include <vector>
+
+enum VDIoBackend
+{
+    VD_IO_STREAM = 0,   /* std::ifstream seek/read */
+    VD_IO_PREAD = 1,    /* positional reads, pread / ReadFile with OVERLAPPED */
+    VD_IO_MMAP = 2,     /* read only mapping of the whole file */
+};
+
+/* Byte range of an image file. */
+struct VDFileRange
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* Read only access to an image file. */
+class VDIo
+{
+public:
+    virtual ~VDIo() {}
+
+    virtual VDIoBackend Backend() const = 0;
+    virtual void Open(const std::string & filePath) = 0;
+    virtual void Close() = 0;
+    virtual bool IsOpen() const = 0;
+    virtual uint64_t GetFileSize() = 0;
+
+    /* Read size bytes at offset. Bytes past the end of the file read as
+    * zero. */
+    virtual void Read(uint64_t offset, char * buffer, uint64_t size) = 0;
+
+    /* Pointer to size bytes at offset, valid until Close, or NULL if the
+    * backend cannot map the range. */
+    virtual const uint8_t *Map(uint64_t, uint64_t) { return NULL; }
+
+    /* Map the range if possible, otherwise read it into scratch (which
+    * must hold size bytes) and return scratch. */
+    const uint8_t *View(uint64_t offset, uint64_t size, uint8_t *scratch);
+
+    /* Append the parts of [offset, offset + size) that the host file system
+    * has allocated to ranges, in file order, leaving out the holes of a
+    * sparse file. Returns false, with ranges unchanged, if the file system
+    * or the backend cannot tell. */
+    virtual bool GetAllocatedRanges(uint64_t, uint64_t, std::vector<VDFileRange> &) { return false; }
+};
+
+VDIo *CreateVDIo(VDIoBackend backend);
+
+class VDStreamIo : public VDIo
+{
+public:
+    virtual VDIoBackend Backend() const { return VD_IO_STREAM; }
+    virtual void Open(const std::string & filePath);
+    virtual void Close();
+    virtual bool IsOpen() const;
+    virtual uint64_t GetFileSize();
+    virtual void Read(uint64_t offset, char * buffer, uint64_t size);
+    /* queries through a handle of its own */
+    virtual bool GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges);
+
+private:
+    std::ifstream fileHandle;
+    std::string _filePath;
+};
+
+class VDPreadIo : public VDIo
+{
+public:
+    VDPreadIo();
+    ~VDPreadIo();
+    virtual VDIoBackend Backend() const { return VD_IO_PREAD; }
+    virtual void Open(const std::string & filePath);
+    virtual void Close();
+    virtual bool IsOpen() const;
+    virtual uint64_t GetFileSize();
+    virtual void Read(uint64_t offset, char * buffer, uint64_t size);
+    virtual bool GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges);
+
+    /* Read without recording it in the stats, for callers that count the
+    * read themselves on another thread. */
+    void ReadUncounted(uint64_t offset, char * buffer, uint64_t size);
+
+private:
+#ifdef _WIN32
+    void *_handle;
+#else
+    int _fd;
+#endif
+};
+
+class VDMmapIo : public VDIo
+{
+public:
+    VDMmapIo();
+    ~VDMmapIo();
+    virtual VDIoBackend Backend() const { return VD_IO_MMAP; }
+    virtual void Open(const std::string & filePath);
+    virtual void Close();
+    virtual bool IsOpen() const;
+    virtual uint64_t GetFileSize();
+    virtual void Read(uint64_t offset, char * buffer, uint64_t size);
+    virtual const uint8_t *Map(uint64_t offset, uint64_t size);
+    virtual bool GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges);
+
+private:
+    const uint8_t *_base;
+    uint64_t _size;
+#ifdef _WIN32
+    void *_handle;
+    void *_mapping;
+#else
+    int _fd;
+#endif
+};
+
+/*
+* Read only view of another VDIo with byte ranges replaced in memory, used to
+* replay a log over an image without writing to it. The base is not owned,
+* Open and Close are passed through to it.
+*/
+class VDOverlayIo : public VDIo
+{
+public:
+    explicit VDOverlayIo(VDIo *base);
+
+    VDIo *Base() const { return _base; }
+
+    /* Replace size bytes at offset with data, or with zeros if data is NULL.
+    * A later write wins over an earlier one. */
+    void Write(uint64_t offset, const char * data, uint64_t size);
+    bool Empty() const { return _extents.empty(); }
+
+    virtual VDIoBackend Backend() const { return _base->Backend(); }
+    virtual void Open(const std::string & filePath);
+    virtual void Close();
+    virtual bool IsOpen() const;
+    virtual uint64_t GetFileSize();
+    virtual void Read(uint64_t offset, char * buffer, uint64_t size);
+    /* NULL for any range that touches a replaced byte. */
+    virtual const uint8_t *Map(uint64_t offset, uint64_t size);
+    /* replaced bytes count as allocated */
+    virtual bool GetAllocatedRanges(uint64_t offset, uint64_t size, std::vector<VDFileRange> & ranges);
+
+private:
+    struct Extent
+    {
+        uint64_t end;
+        std::vector<char> data;     /* empty for zeros */
+    };
+    typedef std::map<uint64_t, Extent> ExtentMap;
+
+    /* first extent that ends after offset */
+    ExtentMap::iterator first(uint64_t offset);
+private:
+    VDIo *_base;
+    ExtentMap _extents;
+};
+
+#endif // !_VDIO_H_
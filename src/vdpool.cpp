@@ -0,0 +1,132 @@
+#include <abprec.h>
+#include <stdint.h>
+#include "vdpool.h"
+
+using namespace std;
+
+VDThreadPool::VDThreadPool(unsigned threads)
+    : _queues(threads ? threads : std::max(1U, std::thread::hardware_concurrency())),
+    _task(NULL), _generation(0), _remaining(0), _active(0), _stop(false)
+{
+    for (unsigned i = 1; i < _queues.size(); ++i) {
+        _workers.push_back(std::thread(&VDThreadPool::worker, this, i));
+    }
+}
+
+VDThreadPool::~VDThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        _stop = true;
+    }
+    _startCond.notify_all();
+    for (size_t i = 0; i < _workers.size(); ++i) {
+        _workers[i].join();
+    }
+}
+
+void VDThreadPool::ParallelFor(size_t count, const std::function<void(size_t)> & task)
+{
+    if (count == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        size_t n = _queues.size();
+        for (size_t q = 0; q < n; ++q) {
+            std::lock_guard<std::mutex> queueGuard(_queues[q].lock);
+            for (size_t i = q * count / n; i < (q + 1) * count / n; ++i) {
+                _queues[q].tasks.push_back(i);
+            }
+        }
+        _task = &task;
+        _remaining = count;
+        _error = std::exception_ptr();
+        ++_generation;
+    }
+    _startCond.notify_all();
+
+    runTasks(0);
+
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        while (_remaining != 0 || _active != 0) {
+            _doneCond.wait(guard);
+        }
+        _task = NULL;
+        error = _error;
+        _error = std::exception_ptr();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void VDThreadPool::worker(unsigned self)
+{
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(_lock);
+            while (_generation == seen && !_stop) {
+                _startCond.wait(guard);
+            }
+            if (_stop) {
+                return;
+            }
+            seen = _generation;
+            ++_active;
+        }
+        runTasks(self);
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            --_active;
+        }
+        _doneCond.notify_all();
+    }
+}
+
+void VDThreadPool::runTasks(unsigned self)
+{
+    size_t index;
+    while (popTask(self, index)) {
+        try {
+            (*_task)(index);
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> guard(_lock);
+            if (!_error) {
+                _error = std::current_exception();
+            }
+        }
+        if (--_remaining == 0) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _doneCond.notify_all();
+        }
+    }
+}
+
+/* Own queue from the back, then steal from the front of the others. */
+bool VDThreadPool::popTask(unsigned self, size_t & index)
+{
+    {
+        VDPoolQueue & own = _queues[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            index = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t k = 1; k < _queues.size(); ++k) {
+        VDPoolQueue & victim = _queues[(self + k) % _queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            index = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef _VDPOOL_H_
+#define _VDPOOL_H_
+
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+
+/* Task queue of one pool thread. */
+struct VDPoolQueue
+{
+    std::mutex lock;
+    std::deque<size_t> tasks;
+};
+
+/*
+* Fixed set of threads running index ranges. Every thread starts with a
+* contiguous slice of the indexes in its own queue and works it from the
+* back; a thread whose queue runs dry steals from the front of the others,
+* so uneven tasks (disks of very different sizes) still keep every core
+* busy until the end.
+*/
+class VDThreadPool
+{
+public:
+    /* threads counts the calling thread; 0 uses every core */
+    explicit VDThreadPool(unsigned threads = 0);
+    ~VDThreadPool();
+
+    unsigned Size() const { return (unsigned)_queues.size(); }
+
+    /* Run task(i) for every i in [0, count) and wait for all of them; the
+    * calling thread takes part. The first exception thrown by a task is
+    * rethrown once every task has finished. */
+    void ParallelFor(size_t count, const std::function<void(size_t)> & task);
+
+private:
+    void worker(unsigned self);
+    void runTasks(unsigned self);
+    bool popTask(unsigned self, size_t & index);
+
+private:
+    std::vector<std::thread> _workers;
+    std::vector<VDPoolQueue> _queues;
+    std::mutex _lock;
+    std::condition_variable _startCond;
+    std::condition_variable _doneCond;
+    const std::function<void(size_t)> *_task;
+    uint64_t _generation;
+    std::atomic<size_t> _remaining;
+    unsigned _active;
+    std::exception_ptr _error;
+    bool _stop;
+};
+
+#endif // !_VDPOOL_H_
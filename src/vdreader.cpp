@@ -0,0 +1,43 @@
+#include <abprec.h>
+#include <string.h>
+#include "ncIVDParserEx.h"
+#include "vdreader.h"
+
+VDStreamReader::VDStreamReader(ncIVDParserEx *parser, uint64_t readAhead)
+    : _parser(parser), _readAhead(readAhead), _windowOffset(0), _windowLength(0)
+{
+}
+
+void VDStreamReader::SetReadAhead(uint64_t readAhead)
+{
+    _readAhead = readAhead;
+    _window.clear();
+    _windowLength = 0;
+}
+
+void VDStreamReader::Read(uint64_t offset, char * buffer, uint64_t size)
+{
+    while (size) {
+        if (offset >= _windowOffset && offset < _windowOffset + _windowLength) {
+            uint64_t length = std::min(size, _windowOffset + _windowLength - offset);
+            memcpy(buffer, &_window[(size_t)(offset - _windowOffset)], (size_t)length);
+            offset += length;
+            buffer += length;
+            size -= length;
+            continue;
+        }
+        if (size >= _readAhead) {
+            _parser->ReadData(offset, buffer, size);
+            return;
+        }
+        uint64_t virtualSize = _parser->GetVirtualSize();
+        if (offset >= virtualSize) {
+            memset(buffer, 0, (size_t)size);
+            return;
+        }
+        _window.resize((size_t)_readAhead);
+        _windowOffset = offset;
+        _windowLength = std::min(_readAhead, virtualSize - offset);
+        _parser->ReadData(_windowOffset, &_window[0], _windowLength);
+    }
+}
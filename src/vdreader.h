@@ -0,0 +1,33 @@
+#pragma once
+#ifndef _VDREADER_H_
+#define _VDREADER_H_
+
+#include <stdint.h>
+#include <vector>
+
+class ncIVDParserEx;
+
+#define VD_DEFAULT_READ_AHEAD (8 * 1024 * 1024)
+
+/*
+* Sequential reader over the virtual disk of an open parser. Small reads are
+* served from a read-ahead window that is refilled with one large ReadData
+* call; reads at least as large as the window bypass it.
+*/
+class VDStreamReader
+{
+public:
+    VDStreamReader(ncIVDParserEx *parser, uint64_t readAhead = VD_DEFAULT_READ_AHEAD);
+
+    void SetReadAhead(uint64_t readAhead);
+    void Read(uint64_t offset, char * buffer, uint64_t size);
+
+private:
+    ncIVDParserEx *_parser;
+    uint64_t _readAhead;
+    std::vector<char> _window;
+    uint64_t _windowOffset;
+    uint64_t _windowLength;
+};
+
+#endif // !_VDREADER_H_
@@ -0,0 +1,319 @@
+#include <abprec.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include "vdstats.h"
+
+using namespace std;
+
+#define VD_STATS_WORDS (sizeof(VDStats) / sizeof(uint64_t))
+
+static const char *phaseNames[VD_STAT_PHASES] = {
+    "open", "header", "log_replay", "metadata", "bat_load", "bat_decode", "chain_scan", "chain_merge"
+};
+
+static const char *batStateNames[VD_STAT_BAT_STATES] = {
+    "not_present", "undefined", "zero", "unmapped", "reserved", "unmapped_v095", "fully_present", "partially_present"
+};
+
+VDStats::VDStats()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+void VDStats::Add(const VDStats & other)
+{
+    uint64_t *dst = (uint64_t *)this;
+    const uint64_t *src = (const uint64_t *)&other;
+    for (size_t i = 0; i < VD_STATS_WORDS; ++i) {
+        dst[i] += src[i];
+    }
+}
+
+void VDStats::Subtract(const VDStats & other)
+{
+    uint64_t *dst = (uint64_t *)this;
+    const uint64_t *src = (const uint64_t *)&other;
+    for (size_t i = 0; i < VD_STATS_WORDS; ++i) {
+        dst[i] -= src[i];
+    }
+}
+
+bool VDStatsEnabled()
+{
+#ifdef VD_ENABLE_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+#ifdef VD_ENABLE_STATS
+
+/* Counters of one thread. Only the owner writes them, with a relaxed load
+* and store rather than a locked add; VDStatsGet reads them from any thread. */
+struct VDStatsSlot {
+    std::atomic<uint64_t> words[VD_STATS_WORDS];
+};
+
+static std::mutex g_statsLock;
+static std::vector<VDStatsSlot *> g_statsSlots;
+/* totals of the threads that have exited */
+static VDStats g_statsRetired;
+
+class VDStatsThreadSlot
+{
+public:
+    VDStatsThreadSlot()
+    {
+        slot = new VDStatsSlot;
+        for (size_t i = 0; i < VD_STATS_WORDS; ++i) {
+            slot->words[i].store(0, std::memory_order_relaxed);
+        }
+        std::lock_guard<std::mutex> guard(g_statsLock);
+        g_statsSlots.push_back(slot);
+    }
+    ~VDStatsThreadSlot()
+    {
+        std::lock_guard<std::mutex> guard(g_statsLock);
+        uint64_t *retired = (uint64_t *)&g_statsRetired;
+        for (size_t i = 0; i < VD_STATS_WORDS; ++i) {
+            retired[i] += slot->words[i].load(std::memory_order_relaxed);
+        }
+        g_statsSlots.erase(std::find(g_statsSlots.begin(), g_statsSlots.end(), slot));
+        delete slot;
+    }
+    VDStatsSlot *slot;
+};
+
+static thread_local VDStatsThreadSlot t_statsSlot;
+
+static inline void statAdd(size_t word, uint64_t n)
+{
+    std::atomic<uint64_t> & counter = t_statsSlot.slot->words[word];
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+#define STAT_WORD(field) (offsetof(VDStats, field) / sizeof(uint64_t))
+
+uint64_t VDStatsNow()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void VDStatsPhase(VDStatPhase phase, uint64_t nanos)
+{
+    statAdd(STAT_WORD(phaseCalls) + phase, 1);
+    statAdd(STAT_WORD(phaseNanos) + phase, nanos);
+}
+
+void VDStatsRead(uint64_t calls, uint64_t bytes, uint64_t nanos)
+{
+    statAdd(STAT_WORD(readCalls), calls);
+    statAdd(STAT_WORD(readBytes), bytes);
+    statAdd(STAT_WORD(readNanos), nanos);
+}
+
+void VDStatsMap(uint64_t bytes)
+{
+    statAdd(STAT_WORD(mapCalls), 1);
+    statAdd(STAT_WORD(mapBytes), bytes);
+}
+
+void VDStatsBat(const uint64_t states[VD_STAT_BAT_STATES])
+{
+    for (int i = 0; i < VD_STAT_BAT_STATES; ++i) {
+        statAdd(STAT_WORD(batEntries) + i, states[i]);
+    }
+}
+
+void VDStatsMerge(uint64_t inputRuns, uint64_t outputRuns)
+{
+    statAdd(STAT_WORD(mergeCalls), 1);
+    statAdd(STAT_WORD(mergeInputRuns), inputRuns);
+    statAdd(STAT_WORD(mergeOutputRuns), outputRuns);
+}
+
+static void slotRead(const VDStatsSlot *slot, VDStats & stats)
+{
+    uint64_t *dst = (uint64_t *)&stats;
+    for (size_t i = 0; i < VD_STATS_WORDS; ++i) {
+        dst[i] += slot->words[i].load(std::memory_order_relaxed);
+    }
+}
+
+void VDStatsGet(VDStats & stats)
+{
+    stats = VDStats();
+    std::lock_guard<std::mutex> guard(g_statsLock);
+    stats.Add(g_statsRetired);
+    for (size_t i = 0; i < g_statsSlots.size(); ++i) {
+        slotRead(g_statsSlots[i], stats);
+    }
+}
+
+void VDStatsGetThread(VDStats & stats)
+{
+    stats = VDStats();
+    slotRead(t_statsSlot.slot, stats);
+}
+
+/* innermost sink of a VDStatScope on this thread */
+static thread_local VDStats *t_statsSink = NULL;
+
+VDStatScope::VDStatScope(VDStats & sink)
+    : _sink(sink), _outer(t_statsSink)
+{
+    t_statsSink = &sink;
+    if (_outer != &sink) {
+        VDStatsGetThread(_start);
+    }
+}
+
+VDStatScope::~VDStatScope()
+{
+    t_statsSink = _outer;
+    if (_outer != &_sink) {
+        VDStats now;
+        VDStatsGetThread(now);
+        now.Subtract(_start);
+        _sink.Add(now);
+    }
+}
+
+void VDStatsReset()
+{
+    std::lock_guard<std::mutex> guard(g_statsLock);
+    g_statsRetired = VDStats();
+    for (size_t i = 0; i < g_statsSlots.size(); ++i) {
+        for (size_t w = 0; w < VD_STATS_WORDS; ++w) {
+            g_statsSlots[i]->words[w].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+#else
+
+void VDStatsGet(VDStats & stats)
+{
+    stats = VDStats();
+}
+
+void VDStatsGetThread(VDStats & stats)
+{
+    stats = VDStats();
+}
+
+void VDStatsReset()
+{
+}
+
+#endif
+
+static std::string formatSeconds(uint64_t nanos)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.9f", nanos / 1e9);
+    return buf;
+}
+
+static std::string formatCount(uint64_t n)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)n);
+    return buf;
+}
+
+std::string VDStatsToJson(const VDStats & stats)
+{
+    std::string out = "{\"enabled\":";
+    out += VDStatsEnabled() ? "true" : "false";
+    out += ",\"phases\":{";
+    for (int i = 0; i < VD_STAT_PHASES; ++i) {
+        out += i ? ",\"" : "\"";
+        out += phaseNames[i];
+        out += "\":{\"calls\":" + formatCount(stats.phaseCalls[i]);
+        out += ",\"seconds\":" + formatSeconds(stats.phaseNanos[i]) + "}";
+    }
+    out += "},\"read\":{\"calls\":" + formatCount(stats.readCalls);
+    out += ",\"bytes\":" + formatCount(stats.readBytes);
+    out += ",\"seconds\":" + formatSeconds(stats.readNanos) + "}";
+    out += ",\"map\":{\"calls\":" + formatCount(stats.mapCalls);
+    out += ",\"bytes\":" + formatCount(stats.mapBytes) + "}";
+    out += ",\"bat_entries\":{";
+    for (int i = 0; i < VD_STAT_BAT_STATES; ++i) {
+        out += i ? ",\"" : "\"";
+        out += batStateNames[i];
+        out += "\":" + formatCount(stats.batEntries[i]);
+    }
+    out += "},\"merge\":{\"calls\":" + formatCount(stats.mergeCalls);
+    out += ",\"input_runs\":" + formatCount(stats.mergeInputRuns);
+    out += ",\"output_runs\":" + formatCount(stats.mergeOutputRuns) + "}}";
+    return out;
+}
+
+static void promHeader(std::string & out, const std::string & name, const char *help)
+{
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " counter\n";
+}
+
+static void promValue(std::string & out, const std::string & name, const std::string & value)
+{
+    out += name + " " + value + "\n";
+}
+
+std::string VDStatsToPrometheus(const VDStats & stats, const std::string & prefix)
+{
+    std::string out;
+    std::string name = prefix + "_phase_calls_total";
+    promHeader(out, name, "Parser phases entered.");
+    for (int i = 0; i < VD_STAT_PHASES; ++i) {
+        promValue(out, name + "{phase=\"" + phaseNames[i] + "\"}", formatCount(stats.phaseCalls[i]));
+    }
+    name = prefix + "_phase_seconds_total";
+    promHeader(out, name, "Time spent in parser phases.");
+    for (int i = 0; i < VD_STAT_PHASES; ++i) {
+        promValue(out, name + "{phase=\"" + phaseNames[i] + "\"}", formatSeconds(stats.phaseNanos[i]));
+    }
+
+    name = prefix + "_read_calls_total";
+    promHeader(out, name, "Reads issued to image files.");
+    promValue(out, name, formatCount(stats.readCalls));
+    name = prefix + "_read_bytes_total";
+    promHeader(out, name, "Bytes read from image files.");
+    promValue(out, name, formatCount(stats.readBytes));
+    name = prefix + "_read_seconds_total";
+    promHeader(out, name, "Time spent waiting on image file reads.");
+    promValue(out, name, formatSeconds(stats.readNanos));
+    name = prefix + "_map_calls_total";
+    promHeader(out, name, "Ranges served from a memory mapping.");
+    promValue(out, name, formatCount(stats.mapCalls));
+    name = prefix + "_map_bytes_total";
+    promHeader(out, name, "Bytes served from a memory mapping.");
+    promValue(out, name, formatCount(stats.mapBytes));
+
+    name = prefix + "_bat_entries_total";
+    promHeader(out, name, "BAT entries decoded, by block state.");
+    for (int i = 0; i < VD_STAT_BAT_STATES; ++i) {
+        promValue(out, name + "{state=\"" + batStateNames[i] + "\"}", formatCount(stats.batEntries[i]));
+    }
+
+    name = prefix + "_merge_calls_total";
+    promHeader(out, name, "Area map merges.");
+    promValue(out, name, formatCount(stats.mergeCalls));
+    name = prefix + "_merge_input_runs_total";
+    promHeader(out, name, "Runs fed into area map merges.");
+    promValue(out, name, formatCount(stats.mergeInputRuns));
+    name = prefix + "_merge_output_runs_total";
+    promHeader(out, name, "Runs produced by area map merges.");
+    promValue(out, name, formatCount(stats.mergeOutputRuns));
+    return out;
+}
@@ -0,0 +1,121 @@
+#pragma once
+#ifndef _VDSTATS_H_
+#define _VDSTATS_H_
+#include <stdint.h>
+#include <string>
+
+/* Parser instrumentation, compiled in with VD_ENABLE_STATS. Without it every
+*  VD_STAT_ macro is empty and the stats read back as zero. Counters are kept
+*  per thread and summed on demand, so recording takes no lock and shares no
+*  cache line with other threads. */
+
+enum VDStatPhase {
+    VD_STAT_OPEN,           /* whole Open */
+    VD_STAT_HEADER,         /* footer or header section, headers */
+    VD_STAT_LOG_REPLAY,     /* VHDX log scan and replay */
+    VD_STAT_METADATA,       /* region tables, metadata items, parent locators */
+    VD_STAT_BAT_LOAD,       /* BAT read or mapped */
+    VD_STAT_BAT_DECODE,     /* BAT swapped or scanned into runs */
+    VD_STAT_CHAIN_SCAN,     /* GetBackupDisksBlocks, per disk scans */
+    VD_STAT_CHAIN_MERGE,    /* GetBackupDisksBlocks, merge of the scans */
+    VD_STAT_PHASES
+};
+
+/* BAT entry states, indexed like the VHDX payload block states. A VHD entry
+*  counts as not present (0) or fully present (6). */
+#define VD_STAT_BAT_STATES 8
+
+/* Every field is a uint64_t, the struct is summed word by word. */
+struct VDStats {
+    uint64_t phaseCalls[VD_STAT_PHASES];
+    uint64_t phaseNanos[VD_STAT_PHASES];
+    /* reads issued to the image file, with the time spent waiting on them */
+    uint64_t readCalls;
+    uint64_t readBytes;
+    uint64_t readNanos;
+    /* ranges served straight from a memory mapping */
+    uint64_t mapCalls;
+    uint64_t mapBytes;
+    uint64_t batEntries[VD_STAT_BAT_STATES];
+    /* area map merges, with the runs that went in and came out */
+    uint64_t mergeCalls;
+    uint64_t mergeInputRuns;
+    uint64_t mergeOutputRuns;
+
+    VDStats();
+    void Add(const VDStats & other);
+    void Subtract(const VDStats & other);
+};
+
+/* true when built with VD_ENABLE_STATS */
+bool VDStatsEnabled();
+
+/* Totals of every thread, including threads that have exited. */
+void VDStatsGet(VDStats & stats);
+
+/* Totals of the calling thread only. */
+void VDStatsGetThread(VDStats & stats);
+
+/* Zero the totals. Counts recorded concurrently by other threads may be
+* partly lost. */
+void VDStatsReset();
+
+std::string VDStatsToJson(const VDStats & stats);
+
+/* Prometheus text exposition format, metric names start with prefix. */
+std::string VDStatsToPrometheus(const VDStats & stats, const std::string & prefix = "vd");
+
+#ifdef VD_ENABLE_STATS
+
+uint64_t VDStatsNow();
+void VDStatsPhase(VDStatPhase phase, uint64_t nanos);
+void VDStatsRead(uint64_t calls, uint64_t bytes, uint64_t nanos);
+void VDStatsMap(uint64_t bytes);
+void VDStatsBat(const uint64_t states[VD_STAT_BAT_STATES]);
+void VDStatsMerge(uint64_t inputRuns, uint64_t outputRuns);
+
+/* Times the enclosing scope as phase. */
+class VDStatTimer
+{
+public:
+    explicit VDStatTimer(VDStatPhase phase) : _phase(phase), _start(VDStatsNow()) {}
+    ~VDStatTimer() { VDStatsPhase(_phase, VDStatsNow() - _start); }
+private:
+    VDStatPhase _phase;
+    uint64_t _start;
+};
+
+/* Adds what the calling thread records in the enclosing scope to sink. A
+* scope nested in one of the same sink adds nothing, the outer one counts it. */
+class VDStatScope
+{
+public:
+    explicit VDStatScope(VDStats & sink);
+    ~VDStatScope();
+private:
+    VDStats & _sink;
+    VDStats *_outer;
+    VDStats _start;
+};
+
+#define VD_STAT_JOIN2(a, b) a##b
+#define VD_STAT_JOIN(a, b) VD_STAT_JOIN2(a, b)
+#define VD_STAT_PHASE(phase) VDStatTimer VD_STAT_JOIN(vdStatTimer, __LINE__)(phase)
+#define VD_STAT_SCOPE(sink) VDStatScope VD_STAT_JOIN(vdStatScope, __LINE__)(sink)
+#define VD_STAT_NOW() VDStatsNow()
+#define VD_STAT_READ(calls, bytes, start) VDStatsRead(calls, bytes, VDStatsNow() - (start))
+#define VD_STAT_MAP(bytes) VDStatsMap(bytes)
+#define VD_STAT_MERGE(inputRuns, outputRuns) VDStatsMerge(inputRuns, outputRuns)
+
+#else
+
+#define VD_STAT_PHASE(phase) ((void)0)
+#define VD_STAT_SCOPE(sink) ((void)0)
+#define VD_STAT_NOW() ((uint64_t)0)
+#define VD_STAT_READ(calls, bytes, start) ((void)(calls), (void)(bytes), (void)(start))
+#define VD_STAT_MAP(bytes) ((void)0)
+#define VD_STAT_MERGE(inputRuns, outputRuns) ((void)0)
+
+#endif
+
+#endif
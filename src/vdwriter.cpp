@@ -0,0 +1,700 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "vd.h"
+#include "ncIVDParserEx.h"
+#include "vdwriter.h"
+
+using namespace std;
+
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
+#define TiB ((uint64_t) MiB * 1024 * 1024)
+
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+#define ROUND_UP(n, d) (DIV_ROUND_UP(n, d) * (d))
+
+#define VD_WRITER_VHD_BLOCK_SIZE    (2 * MiB)
+#define VD_WRITER_VHDX_BLOCK_SIZE   (32 * MiB)
+#define VD_WRITER_VHD_MAX_SIZE      (2 * TiB)
+#define VD_WRITER_VHDX_MAX_SIZE     (64 * TiB)
+/* bytes of BAT buffered between writes */
+#define VD_WRITER_BAT_WINDOW        (1 * MiB)
+#define VD_WRITER_LOG_MAX_ENTRIES   4096
+
+#define VHD_TIMESTAMP_BASE 946684800
+#define VHD_SECTOR_SIZE 512
+#define VHD_PLATFORM_CODE_W2RU 0x57327275
+
+#define VHDX_LOG_SECTOR_SIZE 4096
+/* an entry is a header sector and one data sector */
+#define VHDX_LOG_ENTRY_SIZE (2 * VHDX_LOG_SECTOR_SIZE)
+#define VHDX_SB_BLOCK_SIZE (1 * MiB)
+#define VHDX_MAX_SECTORS_PER_BLOCK (1 << 23)
+#define PAYLOAD_BLOCK_FULLY_PRESENT     6
+#define PAYLOAD_BLOCK_PARTIALLY_PRESENT 7
+#define SB_BLOCK_PRESENT                6
+
+static void putLe16(char *p, uint16_t v) { for (int i = 0; i < 2; ++i) p[i] = (char)(v >> (8 * i)); }
+static void putLe32(char *p, uint32_t v) { for (int i = 0; i < 4; ++i) p[i] = (char)(v >> (8 * i)); }
+static void putLe64(char *p, uint64_t v) { for (int i = 0; i < 8; ++i) p[i] = (char)(v >> (8 * i)); }
+static void putBe16(char *p, uint16_t v) { for (int i = 0; i < 2; ++i) p[i] = (char)(v >> (8 * (1 - i))); }
+static void putBe32(char *p, uint32_t v) { for (int i = 0; i < 4; ++i) p[i] = (char)(v >> (8 * (3 - i))); }
+static void putBe64(char *p, uint64_t v) { for (int i = 0; i < 8; ++i) p[i] = (char)(v >> (8 * (7 - i))); }
+
+/* MS GUID: the first three fields little endian, the last eight bytes as is */
+static void putGuid(char *p, uint32_t d1, uint16_t d2, uint16_t d3, const uint8_t d4[8])
+{
+    putLe32(p, d1);
+    putLe16(p + 4, d2);
+    putLe16(p + 6, d3);
+    memcpy(p + 8, d4, 8);
+}
+
+/*
+* Identity of the parent of the differencing image at path, read from the
+* parent itself. A relative parentPath is taken from the directory of path.
+*/
+static VDImageId parentImageId(const std::string & path, const std::string & parentPath)
+{
+    std::string parent = parentPath;
+    bool absolute = parent[0] == '/' || parent[0] == '\\' || (parent.size() > 1 && parent[1] == ':');
+    size_t slash = path.find_last_of("/\\");
+    if (!absolute && slash != std::string::npos) {
+        parent = path.substr(0, slash + 1) + parent;
+    }
+    VDImageId id;
+    ncIVDParserEx *parser = CreateVDParser(parent);
+    try {
+        parser->Open(parent);
+        parser->GetImageId(id);
+        parser->Close();
+    }
+    catch (...) {
+        delete parser;
+        throw;
+    }
+    delete parser;
+    return id;
+}
+
+static bool isVhdx(VDImageType type)
+{
+    return type == VD_IMAGE_VHDX_DYNAMIC || type == VD_IMAGE_VHDX_DIFFERENCING || type == VD_IMAGE_VHDX_FIXED;
+}
+
+static double clampRatio(double r)
+{
+    return std::min(std::max(r, 0.0), 1.0);
+}
+
+/* uniform in [0, n) */
+static uint64_t draw(std::mt19937_64 & rng, uint64_t n)
+{
+    std::uniform_int_distribution<uint64_t> dist(0, n - 1);
+    return dist(rng);
+}
+
+VDImageSpec::VDImageSpec()
+    : type(VD_IMAGE_VHDX_DYNAMIC), virtualSize(0), blockSize(0), logicalSectorSize(512),
+    fillRatio(0.5), fragmentation(0.1), partialRatio(0), logEntries(0), stampData(false), seed(1)
+{
+}
+
+VDImageLayout::VDImageLayout(const VDImageSpec & spec)
+    : _rng(spec.seed), _sectorRng(spec.seed ^ UINT64_C(0x9e3779b97f4a7c15)), _pos(0), _inRun(false)
+{
+    bool vhdx = isVhdx(spec.type);
+    _blockSize = spec.blockSize ? spec.blockSize : (vhdx ? VD_WRITER_VHDX_BLOCK_SIZE : VD_WRITER_VHD_BLOCK_SIZE);
+    _sectorSize = vhdx ? spec.logicalSectorSize : VHD_SECTOR_SIZE;
+    _blocks = DIV_ROUND_UP(spec.virtualSize, _blockSize);
+    _allocated = std::min<uint64_t>((uint64_t)(clampRatio(spec.fillRatio) * _blocks + 0.5), _blocks);
+    /* partial blocks need sector bitmaps, which a dynamic VHDX lacks */
+    _partialRatio = spec.type == VD_IMAGE_VHD_FIXED || spec.type == VD_IMAGE_VHDX_DYNAMIC ||
+        spec.type == VD_IMAGE_VHDX_FIXED ? 0 : clampRatio(spec.partialRatio);
+    _allocLeft = _allocated;
+    _freeLeft = _blocks - _allocated;
+    _runsLeft = 0;
+    if (_allocated) {
+        /* every allocated block after the first starts a run with the
+        * fragmentation probability */
+        std::binomial_distribution<uint64_t> breaks(_allocated - 1, clampRatio(spec.fragmentation));
+        _runsLeft = 1 + breaks(_rng);
+    }
+}
+
+/*
+* The free blocks and the runs are shuffled uniformly, and the breaks between
+* runs are spread uniformly over the gaps between allocated blocks, both by
+* sequential selection so the exact counts come out without storing the
+* pattern.
+*/
+bool VDImageLayout::Next(VDImageBlock & block)
+{
+    if (_allocLeft == 0) {
+        return false;
+    }
+    if (!_inRun) {
+        while (_freeLeft && draw(_rng, _freeLeft + _runsLeft) >= _runsLeft) {
+            --_freeLeft;
+            ++_pos;
+        }
+        --_runsLeft;
+        _inRun = true;
+    }
+    block.index = _pos++;
+    --_allocLeft;
+    if (_allocLeft && _runsLeft && draw(_rng, _allocLeft) < _runsLeft) {
+        _inRun = false;
+    }
+
+    uint32_t sectors = SectorsPerBlock();
+    block.sectorStart = 0;
+    block.sectorCount = sectors;
+    if (_partialRatio > 0 && sectors > 1) {
+        std::uniform_real_distribution<double> chance(0.0, 1.0);
+        if (chance(_sectorRng) < _partialRatio) {
+            block.sectorCount = 1 + (uint32_t)draw(_sectorRng, sectors - 1);
+            block.sectorStart = (uint32_t)draw(_sectorRng, sectors - block.sectorCount + 1);
+        }
+    }
+    return true;
+}
+
+void VDImageStampSector(const VDImageSpec & spec, uint64_t index, char *sector, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; ++i) {
+        sector[i] = (char)(index * 31 + spec.seed + i);
+    }
+    if (size >= 24) {
+        memcpy(sector, "vdstamp", 8);
+        putLe64(sector + 8, index);
+        putLe64(sector + 16, spec.seed);
+    }
+}
+
+/* Output file, tracking its end so it can be extended with a hole. */
+struct VDImageFile {
+    std::ofstream outfile;
+    uint64_t end;
+};
+
+static void imageWrite(VDImageFile & file, uint64_t offset, const char *buffer, uint64_t size)
+{
+    Write(file.outfile, offset, (char *)buffer, size);
+    file.end = std::max(file.end, offset + size);
+}
+
+static void imageExtend(VDImageFile & file, uint64_t size)
+{
+    if (size > file.end) {
+        char zero = 0;
+        imageWrite(file, size - 1, &zero, 1);
+    }
+}
+
+static void imageStamp(VDImageFile & file, const VDImageSpec & spec, uint64_t index, uint64_t offset, uint32_t sectorSize)
+{
+    if (spec.stampData) {
+        std::vector<char> sector(sectorSize);
+        VDImageStampSector(spec, index, &sector[0], sectorSize);
+        imageWrite(file, offset, &sector[0], sectorSize);
+    }
+}
+
+static void setBits(uint8_t *bits, uint64_t start, uint64_t count, bool msbFirst)
+{
+    for (uint64_t i = start; i < start + count; ++i) {
+        bits[i / 8] |= (uint8_t)(msbFirst ? 0x80 >> (i % 8) : 1 << (i % 8));
+    }
+}
+
+/*
+* BAT produced in ascending entry order and written a window at a time, so
+* that a 64 TiB table never has to be in memory. Pages listed for the log
+* are kept aside and left zeroed in the file.
+*/
+struct VDBatWindow {
+    uint64_t offset;
+    uint64_t length;
+    char fill;
+    std::vector<char> window;
+    uint64_t start;
+    std::vector<char> logPages;
+};
+
+static void batWindowInit(VDBatWindow & bat, uint64_t offset, uint64_t length, char fill, uint64_t logPages)
+{
+    bat.offset = offset;
+    bat.length = length;
+    bat.fill = fill;
+    bat.window.assign(VD_WRITER_BAT_WINDOW, fill);
+    bat.start = 0;
+    bat.logPages.resize((size_t)(logPages * VHDX_LOG_SECTOR_SIZE));
+}
+
+static void batWindowFlush(VDImageFile & file, VDBatWindow & bat)
+{
+    uint64_t size = std::min<uint64_t>(bat.window.size(), bat.length - bat.start);
+    uint64_t logged = std::min<uint64_t>(bat.logPages.size() > bat.start ? bat.logPages.size() - bat.start : 0, size);
+    if (logged) {
+        memcpy(&bat.logPages[(size_t)bat.start], &bat.window[0], (size_t)logged);
+        memset(&bat.window[0], 0, (size_t)logged);
+    }
+    imageWrite(file, bat.offset + bat.start, &bat.window[0], size);
+    std::fill(bat.window.begin(), bat.window.end(), bat.fill);
+    bat.start += size;
+}
+
+static char *batWindowEntry(VDImageFile & file, VDBatWindow & bat, uint64_t index, uint32_t entrySize)
+{
+    uint64_t byte = index * entrySize;
+    while (byte >= bat.start + bat.window.size()) {
+        batWindowFlush(file, bat);
+    }
+    return &bat.window[(size_t)(byte - bat.start)];
+}
+
+static void batWindowFinish(VDImageFile & file, VDBatWindow & bat)
+{
+    while (bat.start < bat.length) {
+        batWindowFlush(file, bat);
+    }
+}
+
+/* ---- VHD ---- */
+
+/* CHS geometry from the VHD specification */
+static void vhdGeometry(uint64_t size, uint16_t & cylinders, uint8_t & heads, uint8_t & sectors)
+{
+    uint64_t total = std::min<uint64_t>(size / VHD_SECTOR_SIZE, 65535ULL * 16 * 255);
+    uint64_t cylTimesHeads;
+    uint32_t h;
+    uint32_t spt;
+    if (total >= 65535ULL * 16 * 63) {
+        spt = 255;
+        h = 16;
+        cylTimesHeads = total / spt;
+    }
+    else {
+        spt = 17;
+        cylTimesHeads = total / spt;
+        h = (uint32_t)std::max<uint64_t>((cylTimesHeads + 1023) / 1024, 4);
+        if (cylTimesHeads >= h * 1024ULL || h > 16) {
+            spt = 31;
+            h = 16;
+            cylTimesHeads = total / spt;
+        }
+        if (cylTimesHeads >= h * 1024ULL) {
+            spt = 63;
+            h = 16;
+            cylTimesHeads = total / spt;
+        }
+    }
+    cylinders = (uint16_t)(cylTimesHeads / h);
+    heads = (uint8_t)h;
+    sectors = (uint8_t)spt;
+}
+
+static uint32_t vhdChecksum(const char *buffer, size_t size)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < size; ++i) {
+        sum += (uint8_t)buffer[i];
+    }
+    return ~sum;
+}
+
+static void vhdFooter(char *footer, const VDImageSpec & spec, uint32_t diskType, uint64_t dataOffset, std::mt19937_64 & guids)
+{
+    memset(footer, 0, VHD_SECTOR_SIZE);
+    memcpy(footer, "conectix", 8);
+    putBe32(footer + 8, 2);
+    putBe32(footer + 12, 0x00010000);
+    putBe64(footer + 16, dataOffset);
+    putBe32(footer + 24, (uint32_t)(time(NULL) - VHD_TIMESTAMP_BASE));
+    memcpy(footer + 28, "vdwr", 4);
+    putBe32(footer + 32, 0x00010000);
+    memcpy(footer + 36, "Wi2k", 4);
+    putBe64(footer + 40, spec.virtualSize);
+    putBe64(footer + 48, spec.virtualSize);
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+    vhdGeometry(spec.virtualSize, cylinders, heads, sectors);
+    putBe16(footer + 56, cylinders);
+    footer[58] = (char)heads;
+    footer[59] = (char)sectors;
+    putBe32(footer + 60, diskType);
+    putLe64(footer + 68, guids());
+    putLe64(footer + 76, guids());
+    putBe32(footer + 64, vhdChecksum(footer, VHD_SECTOR_SIZE));
+}
+
+static void vhdWriteFixed(VDImageFile & file, const VDImageSpec & spec, VDImageLayout & layout, std::mt19937_64 & guids)
+{
+    VDImageBlock block;
+    while (layout.Next(block)) {
+        uint64_t offset = block.index * layout.BlockSize() + (uint64_t)block.sectorStart * VHD_SECTOR_SIZE;
+        if (offset < spec.virtualSize) {
+            imageStamp(file, spec, block.index, offset, VHD_SECTOR_SIZE);
+        }
+    }
+    char footer[VHD_SECTOR_SIZE];
+    vhdFooter(footer, spec, 2, UINT64_C(0xffffffffffffffff), guids);
+    imageWrite(file, spec.virtualSize, footer, sizeof(footer));
+}
+
+/* Layout: footer copy, dynamic header, BAT, parent locator, blocks, footer. */
+static void vhdWriteDynamic(VDImageFile & file, const VDImageSpec & spec, VDImageLayout & layout, std::mt19937_64 & guids,
+                            const VDImageId & parentId)
+{
+    bool differencing = spec.type == VD_IMAGE_VHD_DIFFERENCING;
+    uint32_t blockSize = layout.BlockSize();
+    uint32_t sectors = layout.SectorsPerBlock();
+    uint32_t count = (uint32_t)layout.BlockCount();
+    uint64_t batOffset = 3 * VHD_SECTOR_SIZE;
+    uint64_t batLength = ROUND_UP((uint64_t)count * 4, VHD_SECTOR_SIZE);
+    uint32_t bitmapLength = ROUND_UP(sectors / 8, VHD_SECTOR_SIZE);
+    uint64_t cur = batOffset + batLength;
+
+    char footer[VHD_SECTOR_SIZE];
+    vhdFooter(footer, spec, differencing ? 4 : 3, VHD_SECTOR_SIZE, guids);
+    imageWrite(file, 0, footer, sizeof(footer));
+
+    char header[2 * VHD_SECTOR_SIZE] = { 0 };
+    memcpy(header, "cxsparse", 8);
+    putBe64(header + 8, UINT64_C(0xffffffffffffffff));
+    putBe64(header + 16, batOffset);
+    putBe32(header + 24, 0x00010000);
+    putBe32(header + 28, count);
+    putBe32(header + 32, blockSize);
+    if (differencing) {
+        memcpy(header + 40, parentId.bytes, sizeof(parentId.bytes));
+        putBe32(header + 56, (uint32_t)(time(NULL) - VHD_TIMESTAMP_BASE));
+        std::vector<uint16_t> name = Utf8ToUtf16(spec.parentPath, true);
+        memcpy(header + 64, &name[0], std::min<size_t>(name.size(), 256) * 2);
+        /* one W2ru locator, UTF-16 LE relative path */
+        std::vector<uint16_t> locator = Utf8ToUtf16(spec.parentPath, false);
+        uint32_t length = (uint32_t)locator.size() * 2;
+        uint32_t space = DIV_ROUND_UP(length, VHD_SECTOR_SIZE);
+        putBe32(header + 576, VHD_PLATFORM_CODE_W2RU);
+        putBe32(header + 580, space);
+        putBe32(header + 584, length);
+        putBe64(header + 592, cur);
+        imageWrite(file, cur, (const char *)&locator[0], length);
+        cur += (uint64_t)space * VHD_SECTOR_SIZE;
+    }
+    putBe32(header + 36, vhdChecksum(header, sizeof(header)));
+    imageWrite(file, VHD_SECTOR_SIZE, header, sizeof(header));
+
+    VDBatWindow bat;
+    batWindowInit(bat, batOffset, batLength, (char)0xff, 0);
+    std::vector<uint8_t> full(bitmapLength, 0);
+    setBits(&full[0], 0, sectors, true);
+    std::vector<uint8_t> partial(bitmapLength);
+    VDImageBlock block;
+    while (layout.Next(block)) {
+        putBe32(batWindowEntry(file, bat, block.index, 4), (uint32_t)(cur / VHD_SECTOR_SIZE));
+        const uint8_t *bitmap = &full[0];
+        if (block.sectorCount < sectors) {
+            std::fill(partial.begin(), partial.end(), 0);
+            setBits(&partial[0], block.sectorStart, block.sectorCount, true);
+            bitmap = &partial[0];
+        }
+        imageWrite(file, cur, (const char *)bitmap, bitmapLength);
+        imageStamp(file, spec, block.index, cur + bitmapLength + (uint64_t)block.sectorStart * VHD_SECTOR_SIZE, VHD_SECTOR_SIZE);
+        cur += bitmapLength + blockSize;
+    }
+    batWindowFinish(file, bat);
+    imageWrite(file, cur, footer, sizeof(footer));
+}
+
+/* ---- VHDX ---- */
+
+static const uint8_t vhdxBatGuid[8] = { 0x9d, 0x64, 0x11, 0x5e, 0x9b, 0xfd, 0x4a, 0x08 };
+static const uint8_t vhdxMetadataGuid[8] = { 0xb8, 0xfe, 0x57, 0x5f, 0x05, 0x0f, 0x88, 0x6e };
+static const uint8_t vhdxFileParamsGuid[8] = { 0xb3, 0xb6, 0x33, 0xf0, 0xaa, 0x44, 0xe7, 0x6b };
+static const uint8_t vhdxVirtualSizeGuid[8] = { 0xb2, 0x11, 0x5d, 0xbe, 0xd8, 0x3b, 0xf4, 0xb8 };
+static const uint8_t vhdxPage83Guid[8] = { 0x93, 0xef, 0xc3, 0x09, 0xe0, 0x00, 0xc7, 0x46 };
+static const uint8_t vhdxLogicalSectorGuid[8] = { 0xba, 0x47, 0xf2, 0x33, 0xa8, 0xfa, 0xab, 0x5f };
+static const uint8_t vhdxPhysicalSectorGuid[8] = { 0x9c, 0xc9, 0xe9, 0x88, 0x52, 0x51, 0xc5, 0x56 };
+static const uint8_t vhdxParentLocatorGuid[8] = { 0xab, 0xf7, 0xd3, 0xd8, 0x48, 0x34, 0xab, 0x0c };
+static const uint8_t vhdxParentVhdxGuid[8] = { 0xb7, 0x89, 0x25, 0xb8, 0xe9, 0x44, 0x59, 0x13 };
+
+static void vhdxMetadataItem(char *table, int index, uint32_t d1, uint16_t d2, uint16_t d3, const uint8_t d4[8],
+                             uint32_t offset, uint32_t length, uint32_t dataBits)
+{
+    char *entry = table + 32 + index * 32;
+    putGuid(entry, d1, d2, d3, d4);
+    putLe32(entry + 16, offset);
+    putLe32(entry + 20, length);
+    putLe32(entry + 24, dataBits);
+}
+
+/* Parent locator item with parent_linkage, the DataWriteGuid of the parent,
+* and relative_path; returns its length. */
+static uint32_t vhdxParentLocator(char *item, const std::string & parentPath, const VDImageId & parentId)
+{
+    const uint8_t *g = parentId.bytes;
+    char linkage[40];
+    snprintf(linkage, sizeof(linkage), "{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+        (unsigned)(g[0] | g[1] << 8 | g[2] << 16 | (uint32_t)g[3] << 24), (unsigned)(g[4] | g[5] << 8),
+        (unsigned)(g[6] | g[7] << 8), g[8], g[9], g[10], g[11], g[12], g[13], g[14], g[15]);
+    std::vector<uint16_t> keys[2] = { Utf8ToUtf16("parent_linkage", false), Utf8ToUtf16("relative_path", false) };
+    std::vector<uint16_t> values[2] = { Utf8ToUtf16(linkage, false), Utf8ToUtf16(parentPath, false) };
+    putGuid(item, 0xb04aefb7, 0xd19e, 0x4a81, vhdxParentVhdxGuid);
+    putLe16(item + 18, 2);
+    uint32_t offset = 20 + 2 * 12;
+    for (int i = 0; i < 2; ++i) {
+        char *entry = item + 20 + i * 12;
+        uint32_t keyLength = (uint32_t)keys[i].size() * 2;
+        uint32_t valueLength = (uint32_t)values[i].size() * 2;
+        putLe32(entry, offset);
+        memcpy(item + offset, &keys[i][0], keyLength);
+        offset += keyLength;
+        putLe32(entry + 4, offset);
+        memcpy(item + offset, &values[i][0], valueLength);
+        offset += valueLength;
+        putLe16(entry + 8, (uint16_t)keyLength);
+        putLe16(entry + 10, (uint16_t)valueLength);
+    }
+    return offset;
+}
+
+/* Log entry of one data descriptor writing page at fileOffset. */
+static void vhdxLogEntry(char *entry, uint64_t sequence, const char *logGuid, uint64_t fileOffset,
+                         const char *page, uint64_t fileSize)
+{
+    memset(entry, 0, VHDX_LOG_ENTRY_SIZE);
+    putLe32(entry, 0x65676f6c);
+    putLe32(entry + 8, VHDX_LOG_ENTRY_SIZE);
+    putLe64(entry + 16, sequence);
+    putLe32(entry + 24, 1);
+    memcpy(entry + 32, logGuid, 16);
+    putLe64(entry + 48, fileSize);
+    putLe64(entry + 56, fileSize);
+
+    char *desc = entry + 64;
+    putLe32(desc, 0x63736564);
+    memcpy(desc + 4, page + VHDX_LOG_SECTOR_SIZE - 4, 4);
+    memcpy(desc + 8, page, 8);
+    putLe64(desc + 16, fileOffset);
+    putLe64(desc + 24, sequence);
+
+    char *data = entry + VHDX_LOG_SECTOR_SIZE;
+    putLe32(data, 0x61746164);
+    putLe32(data + 4, (uint32_t)(sequence >> 32));
+    memcpy(data + 8, page + 8, VHDX_LOG_SECTOR_SIZE - 12);
+    putLe32(data + VHDX_LOG_SECTOR_SIZE - 4, (uint32_t)sequence);
+
+    putLe32(entry + 4, VDCrc32c(entry, VHDX_LOG_ENTRY_SIZE, 0));
+}
+
+/* Layout: header section, log, 1 MiB metadata, BAT, payload and sector
+* bitmap blocks in allocation order. */
+static void vhdxWrite(VDImageFile & file, const VDImageSpec & spec, VDImageLayout & layout, std::mt19937_64 & guids,
+                      const VDImageId & parentId)
+{
+    bool differencing = spec.type == VD_IMAGE_VHDX_DIFFERENCING;
+    bool fixed = spec.type == VD_IMAGE_VHDX_FIXED;
+    uint32_t blockSize = layout.BlockSize();
+    uint32_t sectorSize = layout.SectorSize();
+    uint32_t sectors = layout.SectorsPerBlock();
+    uint64_t chunkRatio = (uint64_t)VHDX_MAX_SECTORS_PER_BLOCK * sectorSize / blockSize;
+    uint64_t count = layout.BlockCount();
+    uint64_t chunks = DIV_ROUND_UP(count, chunkRatio);
+    uint64_t entries = differencing ? chunks * (chunkRatio + 1) : count + (count - 1) / chunkRatio;
+    uint64_t logOffset = 1 * MiB;
+    uint64_t logLength = spec.logEntries ? ROUND_UP((uint64_t)spec.logEntries * VHDX_LOG_ENTRY_SIZE, MiB) : MiB;
+    uint64_t metadataOffset = logOffset + logLength;
+    uint64_t batOffset = metadataOffset + MiB;
+    uint64_t batLength = ROUND_UP(entries * 8, MiB);
+    uint64_t cur = batOffset + batLength;
+
+    char identifier[64 * KiB] = { 0 };
+    memcpy(identifier, "vhdxfile", 8);
+    std::vector<uint16_t> creator = Utf8ToUtf16("vdwriter", false);
+    memcpy(identifier + 8, &creator[0], creator.size() * 2);
+    imageWrite(file, 0, identifier, sizeof(identifier));
+
+    char logGuid[16] = { 0 };
+    if (spec.logEntries) {
+        putLe64(logGuid, guids());
+        putLe64(logGuid + 8, guids());
+    }
+    std::vector<char> header(4 * KiB, 0);
+    putLe32(&header[0], 0x64616568);
+    putLe64(&header[8], 1);
+    putLe64(&header[16], guids());
+    putLe64(&header[24], guids());
+    putLe64(&header[32], guids());
+    putLe64(&header[40], guids());
+    memcpy(&header[48], logGuid, 16);
+    putLe16(&header[66], 1);
+    putLe32(&header[68], (uint32_t)logLength);
+    putLe64(&header[72], logOffset);
+    putLe32(&header[4], VDCrc32c(&header[0], header.size(), 0));
+    imageWrite(file, 64 * KiB, &header[0], header.size());
+    imageWrite(file, 128 * KiB, &header[0], header.size());
+
+    std::vector<char> regions(64 * KiB, 0);
+    putLe32(&regions[0], 0x69676572);
+    putLe32(&regions[8], 2);
+    putGuid(&regions[16], 0x2dc27766, 0xf623, 0x4200, vhdxBatGuid);
+    putLe64(&regions[32], batOffset);
+    putLe32(&regions[40], (uint32_t)batLength);
+    putLe32(&regions[44], 1);
+    putGuid(&regions[48], 0x8b7ca206, 0x4790, 0x4b9a, vhdxMetadataGuid);
+    putLe64(&regions[64], metadataOffset);
+    putLe32(&regions[72], (uint32_t)MiB);
+    putLe32(&regions[76], 1);
+    putLe32(&regions[4], VDCrc32c(&regions[0], regions.size(), 0));
+    imageWrite(file, 192 * KiB, &regions[0], regions.size());
+    imageWrite(file, 256 * KiB, &regions[0], regions.size());
+
+    /* metadata table, then one 4 KiB aligned item each after its 64 KiB */
+    std::vector<char> metadata(256 * KiB, 0);
+    putLe64(&metadata[0], 0x617461646174656DULL);
+    putLe16(&metadata[10], differencing ? 6 : 5);
+    vhdxMetadataItem(&metadata[0], 0, 0xcaa16737, 0xfa36, 0x4d43, vhdxFileParamsGuid, 64 * KiB, 8, 4);
+    vhdxMetadataItem(&metadata[0], 1, 0x2fa54224, 0xcd1b, 0x4876, vhdxVirtualSizeGuid, 68 * KiB, 8, 6);
+    vhdxMetadataItem(&metadata[0], 2, 0xbeca12ab, 0xb2e6, 0x4523, vhdxPage83Guid, 72 * KiB, 16, 6);
+    vhdxMetadataItem(&metadata[0], 3, 0x8141bf1d, 0xa96f, 0x4709, vhdxLogicalSectorGuid, 76 * KiB, 4, 6);
+    vhdxMetadataItem(&metadata[0], 4, 0xcda348c7, 0x445d, 0x4471, vhdxPhysicalSectorGuid, 80 * KiB, 4, 6);
+    putLe32(&metadata[64 * KiB], blockSize);
+    /* has parent, or leave blocks allocated */
+    putLe32(&metadata[64 * KiB + 4], differencing ? 2 : fixed ? 1 : 0);
+    putLe64(&metadata[68 * KiB], spec.virtualSize);
+    putLe64(&metadata[72 * KiB], guids());
+    putLe64(&metadata[72 * KiB + 8], guids());
+    putLe32(&metadata[76 * KiB], sectorSize);
+    putLe32(&metadata[80 * KiB], 4096);
+    if (differencing) {
+        uint32_t length = vhdxParentLocator(&metadata[84 * KiB], spec.parentPath, parentId);
+        vhdxMetadataItem(&metadata[0], 5, 0xa8d35f2d, 0xb30b, 0x454d, vhdxParentLocatorGuid, 84 * KiB, length, 4);
+    }
+    imageWrite(file, metadataOffset, &metadata[0], metadata.size());
+
+    uint64_t logPages = std::min<uint64_t>(spec.logEntries, batLength / VHDX_LOG_SECTOR_SIZE);
+    VDBatWindow bat;
+    batWindowInit(bat, batOffset, batLength, 0, logPages);
+
+    /* sector bitmap of the current chunk, only the touched bytes are written */
+    std::vector<uint8_t> sb(differencing ? VHDX_SB_BLOCK_SIZE : 0);
+    uint64_t sbChunk = 0;
+    uint64_t sbLow = VHDX_SB_BLOCK_SIZE;
+    uint64_t sbHigh = 0;
+    VDImageBlock block;
+    if (fixed) {
+        /* every block in place, stamped only where the layout allocates
+        * one, which leaves the layout empty for the loop below */
+        for (uint64_t i = 0; i < count; ++i) {
+            putLe64(batWindowEntry(file, bat, i + i / chunkRatio, 8), (cur + i * blockSize) | PAYLOAD_BLOCK_FULLY_PRESENT);
+        }
+        while (layout.Next(block)) {
+            imageStamp(file, spec, block.index, cur + block.index * blockSize, sectorSize);
+        }
+        cur += count * blockSize;
+    }
+    bool more = layout.Next(block);
+    for (;;) {
+        uint64_t chunk = more ? block.index / chunkRatio : chunks;
+        if (differencing && chunk != sbChunk) {
+            if (sbHigh > sbLow) {
+                uint64_t sbindex = sbChunk * (chunkRatio + 1) + chunkRatio;
+                putLe64(batWindowEntry(file, bat, sbindex, 8), cur | SB_BLOCK_PRESENT);
+                imageWrite(file, cur + sbLow, (const char *)&sb[(size_t)sbLow], sbHigh - sbLow);
+                std::fill(sb.begin() + (size_t)sbLow, sb.begin() + (size_t)sbHigh, 0);
+                cur += VHDX_SB_BLOCK_SIZE;
+            }
+            sbChunk = chunk;
+            sbLow = VHDX_SB_BLOCK_SIZE;
+            sbHigh = 0;
+        }
+        if (!more) {
+            break;
+        }
+        uint64_t index = differencing ? chunk * (chunkRatio + 1) + block.index % chunkRatio : block.index + chunk;
+        uint64_t state = PAYLOAD_BLOCK_FULLY_PRESENT;
+        if (differencing && block.sectorCount < sectors) {
+            uint64_t first = (block.index % chunkRatio) * sectors + block.sectorStart;
+            setBits(&sb[0], first, block.sectorCount, false);
+            sbLow = std::min<uint64_t>(sbLow, first / 8);
+            sbHigh = std::max<uint64_t>(sbHigh, DIV_ROUND_UP(first + block.sectorCount, 8));
+            state = PAYLOAD_BLOCK_PARTIALLY_PRESENT;
+        }
+        putLe64(batWindowEntry(file, bat, index, 8), cur | state);
+        imageStamp(file, spec, block.index, cur + (uint64_t)block.sectorStart * sectorSize, sectorSize);
+        cur += blockSize;
+        more = layout.Next(block);
+    }
+    batWindowFinish(file, bat);
+    imageExtend(file, cur);
+
+    /* the log rewrites the BAT pages left zeroed above, all entries from the
+    * start of the log in one sequence */
+    std::vector<char> entry(VHDX_LOG_ENTRY_SIZE);
+    for (uint32_t i = 0; i < spec.logEntries && logPages; ++i) {
+        uint64_t page = i % logPages;
+        vhdxLogEntry(&entry[0], 1 + i, logGuid, batOffset + page * VHDX_LOG_SECTOR_SIZE,
+            &bat.logPages[(size_t)(page * VHDX_LOG_SECTOR_SIZE)], file.end);
+        imageWrite(file, logOffset + (uint64_t)i * VHDX_LOG_ENTRY_SIZE, &entry[0], entry.size());
+    }
+}
+
+void VDImageWrite(const std::string & path, const VDImageSpec & spec)
+{
+    bool vhdx = isVhdx(spec.type);
+    VDImageLayout layout(spec);
+    uint64_t maxSize = vhdx ? VD_WRITER_VHDX_MAX_SIZE : VD_WRITER_VHD_MAX_SIZE;
+    uint32_t blockSize = layout.BlockSize();
+    bool differencing = spec.type == VD_IMAGE_VHD_DIFFERENCING || spec.type == VD_IMAGE_VHDX_DIFFERENCING;
+    if (spec.virtualSize == 0 || spec.virtualSize > maxSize || spec.virtualSize % layout.SectorSize() ||
+        (blockSize & (blockSize - 1)) || (differencing && spec.parentPath.empty()) ||
+        (!vhdx && spec.logEntries) || spec.logEntries > VD_WRITER_LOG_MAX_ENTRIES) {
+        throw exception("image spec invalid");
+    }
+    if (vhdx && ((spec.logicalSectorSize != 512 && spec.logicalSectorSize != 4096) ||
+        blockSize < 1 * MiB || blockSize > 256 * MiB)) {
+        throw exception("image spec invalid");
+    }
+    if (!vhdx && blockSize < 8 * VHD_SECTOR_SIZE) {
+        throw exception("image spec invalid");
+    }
+
+    VDImageId parentId = {};
+    if (differencing) {
+        parentId = parentImageId(path, spec.parentPath);
+    }
+
+    VDImageFile file;
+    file.end = 0;
+    file.outfile.open(path.c_str(), ios::out | ios::binary | ios::trunc);
+    if (file.outfile.fail()) {
+        throw exception("open file failed");
+    }
+    std::mt19937_64 guids(spec.seed * UINT64_C(0x2545f4914f6cdd1d) + 1);
+    switch (spec.type) {
+    case VD_IMAGE_VHD_FIXED:
+        vhdWriteFixed(file, spec, layout, guids);
+        break;
+    case VD_IMAGE_VHD_DYNAMIC:
+    case VD_IMAGE_VHD_DIFFERENCING:
+        vhdWriteDynamic(file, spec, layout, guids, parentId);
+        break;
+    default:
+        vhdxWrite(file, spec, layout, guids, parentId);
+        break;
+    }
+    file.outfile.close();
+    if (file.outfile.fail()) {
+        throw exception("write file failed");
+    }
+}
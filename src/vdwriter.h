@@ -0,0 +1,103 @@
+#pragma once
+#ifndef _VDWRITER_H_
+#define _VDWRITER_H_
+#include <stdint.h>
+#include <string>
+#include <random>
+
+/* Synthetic VHD and VHDX images for load and scale tests. Payload blocks
+*  are left as holes of a sparse file, so only the metadata, the VHD sector
+*  bitmaps and the optional stamps take up disk space, and a 64 TiB VHDX is
+*  written in seconds. */
+
+enum VDImageType {
+    VD_IMAGE_VHD_FIXED,
+    VD_IMAGE_VHD_DYNAMIC,
+    VD_IMAGE_VHD_DIFFERENCING,
+    VD_IMAGE_VHDX_DYNAMIC,
+    VD_IMAGE_VHDX_DIFFERENCING,
+    /* every block allocated in place, the unfilled ones left as holes */
+    VD_IMAGE_VHDX_FIXED
+};
+
+struct VDImageSpec {
+    VDImageType type;
+    uint64_t virtualSize;
+    /* 0 picks the format default, 2 MiB for VHD and 32 MiB for VHDX */
+    uint32_t blockSize;
+    /* VHDX only, 512 or 4096 */
+    uint32_t logicalSectorSize;
+    /* fraction of the blocks that are allocated; for the fixed types the
+    * fraction that may hold data, the rest are holes */
+    double fillRatio;
+    /* chance that an allocated block starts a new run instead of extending
+    * the previous one: 0 gives a single run, 1 isolated blocks */
+    double fragmentation;
+    /* fraction of the allocated blocks with only a sector range present,
+    * through the sector bitmaps; VHD dynamic and differencing, VHDX
+    * differencing */
+    double partialRatio;
+    /* VHDX: number of log entries, each carrying one BAT page whose copy in
+    * the file is left zeroed, so the image only reads right after replay */
+    uint32_t logEntries;
+    /* write VDImageStampSector at the first present sector of every
+    * allocated block, costing one sector of real space each */
+    bool stampData;
+    uint64_t seed;
+    /* differencing: parent location recorded in the image, relative to the
+    * image unless absolute. The parent must exist there: its identity is
+    * recorded as the link to it. */
+    std::string parentPath;
+
+    VDImageSpec();
+};
+
+/* Allocated block of a synthetic image, present sectors in logical sectors. */
+struct VDImageBlock {
+    uint64_t index;
+    uint32_t sectorStart;
+    uint32_t sectorCount;
+};
+
+/* Allocation pattern of a spec, produced in ascending block order without
+*  holding it in memory. The same spec always yields the same blocks, and
+*  partialRatio only changes the sector ranges, never which blocks are
+*  allocated. */
+class VDImageLayout
+{
+public:
+    explicit VDImageLayout(const VDImageSpec & spec);
+
+    /* Next allocated block, false once all have been returned. */
+    bool Next(VDImageBlock & block);
+
+    uint64_t BlockCount() const { return _blocks; }
+    uint64_t AllocatedCount() const { return _allocated; }
+    uint32_t BlockSize() const { return _blockSize; }
+    uint32_t SectorSize() const { return _sectorSize; }
+    uint32_t SectorsPerBlock() const { return _blockSize / _sectorSize; }
+
+private:
+    std::mt19937_64 _rng;
+    std::mt19937_64 _sectorRng;
+    uint64_t _blocks;
+    uint64_t _allocated;
+    uint32_t _blockSize;
+    uint32_t _sectorSize;
+    double _partialRatio;
+    uint64_t _pos;
+    uint64_t _allocLeft;
+    uint64_t _freeLeft;
+    uint64_t _runsLeft;
+    bool _inRun;
+};
+
+/* Write the image described by spec to path, replacing any file there.
+*  Throws on an invalid spec or an I/O failure. */
+void VDImageWrite(const std::string & path, const VDImageSpec & spec);
+
+/* Content of the stamp sector written for block index of spec, size bytes,
+*  for checking what ReadData returns. */
+void VDImageStampSector(const VDImageSpec & spec, uint64_t index, char *sector, uint32_t size);
+
+#endif
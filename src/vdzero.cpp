@@ -0,0 +1,132 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include "ncIVDParserEx.h"
+#include "vdzero.h"
+
+#include "vd.h"
+
+#ifdef VD_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+typedef bool (*VDIsZeroFn)(const void *, size_t);
+
+static bool isZeroGeneric(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    for (; i + 64 <= size; i += 64) {
+        __m128i v = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i)), _mm_loadu_si128((const __m128i *)(p + i + 16))),
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(p + i + 32)), _mm_loadu_si128((const __m128i *)(p + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        if (w) {
+            return false;
+        }
+    }
+    for (; i < size; ++i) {
+        if (p[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef VD_X86_KERNELS
+
+VD_TARGET("avx2") static bool isZeroAvx2(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i = 0;
+    for (; i + 128 <= size; i += 128) {
+        __m256i v = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i)), _mm256_loadu_si256((const __m256i *)(p + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(p + i + 64)), _mm256_loadu_si256((const __m256i *)(p + i + 96))));
+        if (!_mm256_testz_si256(v, v)) {
+            return false;
+        }
+    }
+    return isZeroGeneric(p + i, size - i);
+}
+
+VD_TARGET("avx512f") static bool isZeroAvx512(const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i = 0;
+    for (; i + 256 <= size; i += 256) {
+        __m512i v = _mm512_or_si512(
+            _mm512_or_si512(_mm512_loadu_si512((const void *)(p + i)), _mm512_loadu_si512((const void *)(p + i + 64))),
+            _mm512_or_si512(_mm512_loadu_si512((const void *)(p + i + 128)), _mm512_loadu_si512((const void *)(p + i + 192))));
+        if (_mm512_test_epi64_mask(v, v)) {
+            return false;
+        }
+    }
+    return isZeroGeneric(p + i, size - i);
+}
+
+#endif /* VD_X86_KERNELS */
+
+/* the widest kernel the CPU has, picked once */
+static VDIsZeroFn isZeroKernel()
+{
+#ifdef VD_X86_KERNELS
+    static const VDIsZeroFn kernel = (VDCpuFeatures() & VD_CPU_AVX512F) ? isZeroAvx512 :
+        (VDCpuFeatures() & VD_CPU_AVX2) ? isZeroAvx2 : isZeroGeneric;
+    return kernel;
+#else
+    return isZeroGeneric;
+#endif
+}
+
+bool VDIsZero(const void *data, size_t size)
+{
+    return isZeroKernel()(data, size);
+}
+
+void VDPruneZeroExtents(ncIVDParserEx *parser, std::vector<DataExtent> & extents, uint32_t granularity)
+{
+    if (granularity < 512 || granularity > VD_ZERO_SCAN_CHUNK || (granularity & (granularity - 1))) {
+        throw exception("zero scan granularity invalid");
+    }
+    std::list<std::string> parentPaths;
+    bool hasParent = parser->GetParentPaths(parentPaths);
+    std::vector<DataExtent> pruned;
+    std::vector<char> buffer(VD_ZERO_SCAN_CHUNK);
+    VDIsZeroFn isZero = isZeroKernel();
+    for (size_t e = 0; e < extents.size(); ++e) {
+        const DataExtent & extent = extents[e];
+        if (extent.fileOffset == VD_NO_FILE_OFFSET) {
+            AppendDataExtent(pruned, extent.offset, extent.length, extent.fileOffset);
+            continue;
+        }
+        uint64_t end = extent.offset + extent.length;
+        uint64_t pos = extent.offset;
+        while (pos < end) {
+            /* chunks end on a granule boundary */
+            uint64_t length = std::min<uint64_t>(VD_ZERO_SCAN_CHUNK - pos % granularity, end - pos);
+            parser->ReadData(pos, &buffer[0], length);
+            for (uint64_t at = pos; at < pos + length;) {
+                uint64_t next = std::min<uint64_t>((at / granularity + 1) * granularity, pos + length);
+                if (!isZero(&buffer[(size_t)(at - pos)], (size_t)(next - at))) {
+                    AppendDataExtent(pruned, at, next - at, extent.fileOffset + (at - extent.offset));
+                }
+                else if (hasParent) {
+                    AppendDataExtent(pruned, at, next - at, VD_NO_FILE_OFFSET);
+                }
+                at = next;
+            }
+            pos += length;
+        }
+    }
+    extents.swap(pruned);
+}
@@ -0,0 +1,30 @@
+#pragma once
+#ifndef _VDZERO_H_
+#define _VDZERO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+class ncIVDParserEx;
+struct DataExtent;
+
+/* Bytes read per ReadData call while scanning for zeros. */
+#define VD_ZERO_SCAN_CHUNK (4 * 1024 * 1024)
+
+/* true if all size bytes at data are zero. Tests 256 bytes per step with
+*  AVX-512, 128 with AVX2 and 64 with SSE2, picked at run time from CPUID. */
+bool VDIsZero(const void *data, size_t size);
+
+/*
+* Read the data of every extent through parser and leave out the stretches,
+* granularity bytes aligned in the virtual disk, that are all zero. On a disk
+* with a parent those stretches stay, as extents without a file offset: the
+* zeros still hide the parent's data. Extents without a file offset, which
+* includes every extent of a VDChain, are kept as they are.
+*
+* granularity is a power of two from 512 up to VD_ZERO_SCAN_CHUNK.
+*/
+void VDPruneZeroExtents(ncIVDParserEx *parser, std::vector<DataExtent> & extents, uint32_t granularity);
+
+#endif // !_VDZERO_H_
@@ -3,8 +3,11 @@
 #include <iostream>
 #include <fstream>
 #include <string.h>
+#include <algorithm>
 #include "vhd.h"
 #include "vd.h"
+#include "vdpool.h"
+#include "vdzero.h"
 
 using namespace std;
 
@@ -21,6 +24,10 @@ enum vhd_type {
 #define GiB            (MiB * 1024)
 #define TiB ((uint64_t) GiB * 1024)
 
+#ifndef DIV_ROUND_UP
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#endif
+
 /* Seconds since Jan 1, 2000 0:00:00 (UTC) */
 #define VHD_TIMESTAMP_BASE 946684800
 
@@ -125,8 +132,15 @@ typedef struct VDVHDState
     uint32_t cDataBlockBitmapSectors;
     uint32_t cBlockAllocationTableEntries;
     uint32_t *pBlockAllocationTable;
+    uint32_t *pAllocatedBlocks;     /* indexes of allocated BAT entries, ascending */
+    uint32_t cAllocatedBlocks;
     uint64_t uBlockAllocationTableOffset;
     uint64_t curSize;
+    uint32_t footerTimestamp;
+    uint32_t footerChecksum;
+    uint8_t uniqueId[16];
+    uint8_t parentUuid[16];         /* all zero when not recorded */
+    bool hasParent;
 }VDVHDState;
 
 
@@ -146,65 +160,328 @@ void VHDParser::vhdParseHeader(VDVHDState *pImage)
     uint64_t fileSize;
     VHDFooter vhdFooter;
     pImage->diskType = VHD_DYNAMIC;
-    fileSize = GetFileSize(fileHandle);
-    Read(fileHandle, 0, (char *)&vhdFooter, sizeof(VHDFooter));
-    if (memcmp(vhdFooter.Cookie, VHD_FOOTER_COOKIE, VHD_FOOTER_COOKIE_SIZE) != 0) {
-        Read(fileHandle, fileSize - sizeof(VHDFooter), (char *)&vhdFooter, sizeof(VHDFooter));
+    fileSize = io->GetFileSize();
+    {
+        VD_STAT_PHASE(VD_STAT_HEADER);
+        io->Read(0, (char *)&vhdFooter, sizeof(VHDFooter));
         if (memcmp(vhdFooter.Cookie, VHD_FOOTER_COOKIE, VHD_FOOTER_COOKIE_SIZE) != 0) {
-            throw exception("vhd format error");
+            io->Read(fileSize - sizeof(VHDFooter), (char *)&vhdFooter, sizeof(VHDFooter));
+            if (memcmp(vhdFooter.Cookie, VHD_FOOTER_COOKIE, VHD_FOOTER_COOKIE_SIZE) != 0) {
+                throw exception("vhd format error");
+            }
+            pImage->diskType = VHD_FIXED;
         }
-        pImage->diskType = VHD_FIXED;
     }
+    /* a differencing disk is laid out like a dynamic one */
+    pImage->hasParent = swap32(vhdFooter.DiskType) == VHD_DIFFERENCING;
 
     //uint64_t total_sectors = swap64(vhdFooter.CurSize) / 512;
 
     pImage->curSize = swap64(vhdFooter.CurSize);
+    pImage->footerTimestamp = swap32(vhdFooter.Timestamp);
+    pImage->footerChecksum = swap32(vhdFooter.Checksum);
+    memcpy(pImage->uniqueId, vhdFooter.UniqueID, sizeof(pImage->uniqueId));
     VHDDynamicDiskHeader vhdDynamicDiskHeader;
-    uint32_t *pBlockAllocationTable;
+    const uint32_t *pBlockAllocationTable;
     if (pImage->diskType == VHD_DYNAMIC) {
-        Read(fileHandle, swap64(vhdFooter.DataOffset), (char *)&vhdDynamicDiskHeader, sizeof(VHDDynamicDiskHeader));
+        {
+            VD_STAT_PHASE(VD_STAT_HEADER);
+            io->Read(swap64(vhdFooter.DataOffset), (char *)&vhdDynamicDiskHeader, sizeof(VHDDynamicDiskHeader));
+        }
         pImage->blockSize = swap32(vhdDynamicDiskHeader.BlockSize);
         pImage->cSectorsPerDataBlock = pImage->blockSize / VHD_SECTOR_SIZE;
         pImage->cbDataBlockBitmap = pImage->cSectorsPerDataBlock / 8;
-        pImage->cDataBlockBitmapSectors = pImage->cbDataBlockBitmap / VHD_SECTOR_SIZE;
+        /* the bitmap is padded to a sector boundary, blocks smaller than
+        * 2MB have less than one sector of bitmap */
+        pImage->cDataBlockBitmapSectors = DIV_ROUND_UP(pImage->cbDataBlockBitmap, VHD_SECTOR_SIZE);
         pImage->cBlockAllocationTableEntries = swap32(vhdDynamicDiskHeader.MaxTableEntries);
-        pBlockAllocationTable = (uint32_t *)malloc(pImage->cBlockAllocationTableEntries * 4);
-        if (!pBlockAllocationTable)
-            throw exception("malloc memory error");
-
         pImage->uBlockAllocationTableOffset = swap64(vhdDynamicDiskHeader.TableOffset);
-        Read(fileHandle, pImage->uBlockAllocationTableOffset, (char *)pBlockAllocationTable, pImage->cBlockAllocationTableEntries * 4);
-        pImage->pBlockAllocationTable = (uint32_t *)malloc(pImage->cBlockAllocationTableEntries * 4);
-        for (size_t i = 0; i < pImage->cBlockAllocationTableEntries; i++) {
-            pImage->pBlockAllocationTable[i] = swap32(pBlockAllocationTable[i]);
+        pImage->pBlockAllocationTable = (uint32_t *)_arena.Alloc((size_t)pImage->cBlockAllocationTableEntries * 4, 64);
+        pImage->pAllocatedBlocks = (uint32_t *)_arena.Alloc((size_t)pImage->cBlockAllocationTableEntries * 4, 64);
+        /* swap straight out of the mapping when the backend has one,
+        * otherwise read the table in place and swap it there */
+        {
+            VD_STAT_PHASE(VD_STAT_BAT_LOAD);
+            pBlockAllocationTable = (const uint32_t *)io->Map(pImage->uBlockAllocationTableOffset, (uint64_t)pImage->cBlockAllocationTableEntries * 4);
+            if (!pBlockAllocationTable) {
+                io->Read(pImage->uBlockAllocationTableOffset, (char *)pImage->pBlockAllocationTable, (uint64_t)pImage->cBlockAllocationTableEntries * 4);
+                pBlockAllocationTable = pImage->pBlockAllocationTable;
+            }
         }
+        vhdSwapBat(pImage, pBlockAllocationTable);
+        vhdStatBat(pImage);
 
-        free(pBlockAllocationTable);
-        
-        //uint8_t *pu8Bitmap = (uint8_t *)malloc(pImage->cbDataBlockBitmap);
-        //Read(fileHandle, pBlockAllocationTable2[i] * VHD_SECTOR_SIZE, (char *)pu8Bitmap, cbDataBlockBitmap);
-        //for (int j = 0; i < cSectorsPerDataBlock; ++j) {
-        //    vhdBlockBitmapSectorContainsData(pu8Bitmap, j);
-        //}
+        if (pImage->hasParent) {
+            VD_STAT_PHASE(VD_STAT_METADATA);
+            vhdParseParentLocators(pImage, &vhdDynamicDiskHeader);
+        }
+    }
+    else {
+        pImage->blockSize = VHD_BLOCK_SIZE;
     }
 }
 
+/* BATs with fewer entries are swapped on the calling thread */
+#define VHD_PARALLEL_BAT_MIN (256 * 1024)
+
+/* Byte swap the big endian BAT src into host order and collect the indexes
+* of the allocated blocks in the same pass, in slices on the pool when the
+* table is large. src may be the table itself. */
+void VHDParser::vhdSwapBat(VDVHDState *pImage, const uint32_t *src)
+{
+    VD_STAT_PHASE(VD_STAT_BAT_DECODE);
+    uint32_t entries = pImage->cBlockAllocationTableEntries;
+    uint32_t *dst = pImage->pBlockAllocationTable;
+    uint32_t *allocated = pImage->pAllocatedBlocks;
+    if (_decodeThreads == 1 || entries < VHD_PARALLEL_BAT_MIN) {
+        pImage->cAllocatedBlocks = (uint32_t)swap32FindAllocated(dst, src, entries, 0, allocated);
+        return;
+    }
+    VDThreadPool pool(_decodeThreads);
+    size_t tasks = pool.Size();
+    std::vector<size_t> found(tasks);
+    pool.ParallelFor(tasks, [&](size_t t) {
+        size_t first = (size_t)entries * t / tasks;
+        size_t last = (size_t)entries * (t + 1) / tasks;
+        found[t] = swap32FindAllocated(dst + first, src + first, last - first, (uint32_t)first, allocated + first);
+    });
+    /* pack the index lists of the slices together */
+    size_t total = found[0];
+    for (size_t t = 1; t < tasks; ++t) {
+        memmove(allocated + total, allocated + (size_t)entries * t / tasks, found[t] * 4);
+        total += found[t];
+    }
+    pImage->cAllocatedBlocks = (uint32_t)total;
+}
+
+/* BAT entries are either unused or point at a block, counted as not present
+* and fully present like the VHDX payload states. */
+void VHDParser::vhdStatBat(VDVHDState *pImage)
+{
+#ifdef VD_ENABLE_STATS
+    uint64_t states[VD_STAT_BAT_STATES] = { 0 };
+    states[0] = pImage->cBlockAllocationTableEntries - pImage->cAllocatedBlocks;
+    states[6] = pImage->cAllocatedBlocks;
+    VDStatsBat(states);
+#else
+    (void)pImage;
+#endif
+}
+
+/*
+* Record the parent UUID of a differencing disk and collect its parent
+* locations, the relative path first. Without usable locators fall back to
+* the parent file name from the header, which the caller resolves next to
+* the child.
+*/
+void VHDParser::vhdParseParentLocators(VDVHDState *pImage, const VHDDynamicDiskHeader *header)
+{
+    std::string relative;
+    std::string absolute;
+    memcpy(pImage->parentUuid, header->ParentUuid, sizeof(pImage->parentUuid));
+    for (int i = 0; i < VHD_MAX_LOCATOR_ENTRIES; ++i) {
+        const VHDPLE *ple = &header->ParentLocatorEntry[i];
+        uint32_t code = swap32(ple->u32Code);
+        uint32_t length = swap32(ple->u32DataLength);
+        if (code != VHD_PLATFORM_CODE_W2RU && code != VHD_PLATFORM_CODE_W2KU) {
+            continue;
+        }
+        if (length < 2 || length > (uint64_t)swap32(ple->u32DataSpace) * VHD_SECTOR_SIZE || length > 64 * KiB) {
+            continue;
+        }
+        std::vector<uint16_t> name(length / 2);
+        io->Read(swap64(ple->u64DataOffset), (char *)&name[0], name.size() * 2);
+        if (code == VHD_PLATFORM_CODE_W2RU) {
+            relative = Utf16ToUtf8(&name[0], name.size(), false);
+        }
+        else {
+            absolute = Utf16ToUtf8(&name[0], name.size(), false);
+        }
+    }
+    if (!relative.empty()) {
+        _parentPaths.push_back(relative);
+    }
+    if (!absolute.empty()) {
+        _parentPaths.push_back(absolute);
+    }
+    if (_parentPaths.empty()) {
+        std::string name = Utf16ToUtf8(header->ParentUnicodeName, 256, true);
+        if (!name.empty()) {
+            _parentPaths.push_back(name);
+        }
+    }
+}
+
+/* Number of block bitmaps read per batch in fine grained mode. */
+#define VHD_BITMAP_BATCH 256
+
+void VHDParser::vhdGetSectorExtents(VDVHDState *pImage, std::vector<DataExtent> & extents)
+{
+    uint32_t cbBitmap = pImage->cDataBlockBitmapSectors * VHD_SECTOR_SIZE;
+    std::vector<uint8_t> bitmaps((size_t)VHD_BITMAP_BATCH * cbBitmap);
+    std::vector<uint32_t> batch;
+    std::vector<std::pair<uint32_t, uint32_t> > order;
+    std::vector<VDAioRequest> reqs;
+    std::vector<BitmapRun> runs;
+    batch.reserve(VHD_BITMAP_BATCH);
+    order.reserve(VHD_BITMAP_BATCH);
+
+    uint32_t i = 0;
+    while (i < pImage->cAllocatedBlocks) {
+        batch.clear();
+        for (; i < pImage->cAllocatedBlocks && batch.size() < VHD_BITMAP_BATCH; ++i) {
+            if ((uint64_t)pImage->pAllocatedBlocks[i] * pImage->blockSize >= pImage->curSize) {
+                i = pImage->cAllocatedBlocks;
+                break;
+            }
+            batch.push_back(pImage->pAllocatedBlocks[i]);
+        }
+
+        if (_aio && !batch.empty()) {
+            /* all bitmaps of the batch in flight at once */
+            reqs.resize(batch.size());
+            for (uint32_t k = 0; k < batch.size(); ++k) {
+                reqs[k].offset = (uint64_t)pImage->pBlockAllocationTable[batch[k]] * VHD_SECTOR_SIZE;
+                reqs[k].length = cbBitmap;
+                reqs[k].buffer = (char *)&bitmaps[(size_t)k * cbBitmap];
+                reqs[k].user = NULL;
+            }
+            _aio->ReadBatch(&reqs[0], reqs.size());
+        }
+        else {
+            /* read the bitmaps of the batch in file order */
+            order.clear();
+            for (uint32_t k = 0; k < batch.size(); ++k) {
+                order.push_back(std::make_pair(pImage->pBlockAllocationTable[batch[k]], k));
+            }
+            std::sort(order.begin(), order.end());
+            for (size_t k = 0; k < order.size(); ++k) {
+                io->Read((uint64_t)order[k].first * VHD_SECTOR_SIZE,
+                    (char *)&bitmaps[(size_t)order[k].second * cbBitmap], cbBitmap);
+            }
+        }
+
+        /* then report the sector runs in virtual disk order */
+        for (uint32_t k = 0; k < batch.size(); ++k) {
+            uint64_t offset = (uint64_t)batch[k] * pImage->blockSize;
+            uint64_t fileOffset = ((uint64_t)pImage->pBlockAllocationTable[batch[k]] + pImage->cDataBlockBitmapSectors) * VHD_SECTOR_SIZE;
+            runs.clear();
+            BitmapRuns(&bitmaps[(size_t)k * cbBitmap], pImage->cSectorsPerDataBlock, true, runs);
+            for (size_t r = 0; r < runs.size(); ++r) {
+                uint64_t start = runs[r].start * VHD_SECTOR_SIZE;
+                if (offset + start >= pImage->curSize) {
+                    break;
+                }
+                uint64_t length = std::min(runs[r].count * VHD_SECTOR_SIZE, pImage->curSize - offset - start);
+                AppendDataExtent(extents, offset + start, length, fileOffset + start);
+            }
+        }
+    }
+}
+
+/*
+* Data of a fixed disk sits at the same offset in the file, so the ranges the
+* host has allocated are its data extents and the rest are holes that read as
+* zero.
+*/
+void VHDParser::vhdQueryHostRanges(VDVHDState *pImage)
+{
+    _hostRanges.clear();
+    if (!_hostAllocation || !io->GetAllocatedRanges(0, pImage->curSize, _hostRanges)) {
+        VDFileRange range;
+        range.offset = 0;
+        range.length = pImage->curSize;
+        _hostRanges.push_back(range);
+    }
+}
+
+void VHDParser::vhdGetFixedExtents(std::vector<DataExtent> & extents)
+{
+    for (size_t r = 0; r < _hostRanges.size(); ++r) {
+        AppendDataExtent(extents, _hostRanges[r].offset, _hostRanges[r].length, _hostRanges[r].offset);
+    }
+}
+
+/*
+* MiB areas of the allocated blocks, or of the host ranges of a fixed disk.
+* Blocks smaller than a MiB round outward, so none of them is lost.
+*/
+void VHDParser::vhdGetAreas(VDVHDState *pImage, DataAreaMap & areamap)
+{
+    std::vector<DataExtent> extents;
+    if (pImage->diskType == VHD_DYNAMIC) {
+        vhdGetBlockExtents(pImage, extents);
+    }
+    else {
+        vhdGetFixedExtents(extents);
+    }
+    AppendExtentAreas(areamap, extents);
+}
+
 void VHDParser::vhdInit(VDVHDState *pImage)
 {
     pImage->pBlockAllocationTable = NULL;
+    pImage->pAllocatedBlocks = NULL;
+    pImage->cAllocatedBlocks = 0;
+    memset(pImage->parentUuid, 0, sizeof(pImage->parentUuid));
+    pImage->hasParent = false;
 }
 
 
-NS_IMPL_ISUPPORTS1(VHDParser, ncIVDParser)
+NS_IMPL_ISUPPORTS2(VHDParser, ncIVDParser, ncIVDParserEx)
 
 VHDParser::VHDParser()
 {
     pImage = 0;
+    io = NULL;
+    _ioBackend = VD_IO_STREAM;
+    _aio = NULL;
+    _queueDepth = 0;
+    _fineGrained = false;
+    _decodeThreads = 1;
+    _hostAllocation = true;
+    _zeroGranularity = 0;
+}
+
+void VHDParser::SetIoBackend(VDIoBackend backend)
+{
+    _ioBackend = backend;
+}
+
+void VHDParser::SetAsyncIo(unsigned queueDepth)
+{
+    _queueDepth = queueDepth;
+}
+
+void VHDParser::SetFineGrained(bool fineGrained)
+{
+    _fineGrained = fineGrained;
+}
+
+void VHDParser::SetDecodeThreads(unsigned threads)
+{
+    _decodeThreads = threads;
+}
+
+void VHDParser::SetHostAllocation(bool hostAllocation)
+{
+    _hostAllocation = hostAllocation;
+}
+
+void VHDParser::SetZeroScan(uint32_t granularity)
+{
+    _zeroGranularity = granularity;
+}
+
+void VHDParser::GetStats(VDStats & stats) const
+{
+    stats = _stats;
 }
 
 VHDParser::~VHDParser()
 {
     Close();
+    delete io;
 }
 
 
@@ -212,49 +489,251 @@ VHDParser::~VHDParser()
 NS_IMETHODIMP_(void)
 VHDParser::Open(const std::string & filePath)
 {
-    fileHandle.open(filePath.c_str(), ios::in | ios::binary);
-    if (fileHandle.fail()) {
-        throw exception("open file failed");
+    _stats = VDStats();
+    VD_STAT_SCOPE(_stats);
+    VD_STAT_PHASE(VD_STAT_OPEN);
+    /* release whatever a previous open, failed or not closed, left behind */
+    Close();
+    if (io && io->Backend() != _ioBackend) {
+        delete io;
+        io = NULL;
+    }
+    if (!io) {
+        io = CreateVDIo(_ioBackend);
+    }
+    io->Open(filePath);
+    if (_queueDepth && io->Backend() != VD_IO_MMAP) {
+        _aio = new VDAsyncReader();
+        _aio->Open(filePath, _queueDepth);
     }
-    pImage = (VDVHDState *)malloc(sizeof(VDVHDState));
+    pImage = _arena.Alloc<VDVHDState>();
+    _parentPaths.clear();
     vhdInit(pImage);
     vhdParseHeader(pImage);
+    if (pImage->diskType == VHD_FIXED) {
+        vhdQueryHostRanges(pImage);
+    }
 }
 
 NS_IMETHODIMP_(void)
 VHDParser::Close()
 {
-    fileHandle.close();
-    if (pImage && pImage->pBlockAllocationTable) {
-        free(pImage->pBlockAllocationTable);
-        pImage->pBlockAllocationTable = NULL;
+    if (io) {
+        io->Close();
     }
-    if (pImage)
-    {
-        free(pImage);
-        pImage = NULL;
+    if (_aio) {
+        delete _aio;
+        _aio = NULL;
     }
+    /* the state and both tables live in the arena */
+    pImage = NULL;
+    _arena.Reset();
+    _hostRanges.clear();
 }
 
 
 NS_IMETHODIMP_(void)
 VHDParser::GetDataAreaList(std::list<DataArea> & arealist)
 {
-    if (pImage->diskType == VHD_DYNAMIC) {
-        for (uint64_t i = 0; i < pImage->cBlockAllocationTableEntries; ++i) {
-            if (pImage->pBlockAllocationTable[i] == ~0U) {
-                continue;
-            }
-            DataArea area;
-            area.offset = (uint32_t)((i*pImage->cSectorsPerDataBlock*VHD_SECTOR_SIZE) / MiB);
-            area.length = pImage->blockSize / MiB;
-            arealist.push_back(area);
-        }
+    VD_STAT_SCOPE(_stats);
+    DataAreaMap pruned;
+    if (vhdGetPrunedAreas(pruned)) {
+        pruned.ToList(arealist);
+        return;
+    }
+    DataAreaMap areamap;
+    vhdGetAreas(pImage, areamap);
+    areamap.ToList(arealist);
+}
+
+NS_IMETHODIMP_(void)
+VHDParser::GetDataAreaList(DataAreaMap & areamap)
+{
+    VD_STAT_SCOPE(_stats);
+    if (vhdGetPrunedAreas(areamap)) {
+        return;
+    }
+    vhdGetAreas(pImage, areamap);
+}
+
+NS_IMETHODIMP_(void)
+VHDParser::GetDataAreaList(AllocationBitmap & bitmap)
+{
+    VD_STAT_SCOPE(_stats);
+    bitmap.Resize(DIV_ROUND_UP(pImage->curSize, MiB));
+    DataAreaMap areamap;
+    if (!vhdGetPrunedAreas(areamap)) {
+        vhdGetAreas(pImage, areamap);
+    }
+    for (size_t i = 0; i < areamap.Size(); ++i) {
+        bitmap.SetRange(areamap.Offset(i), areamap.Length(i));
+    }
+}
+
+NS_IMETHODIMP_(void)
+VHDParser::GetDataExtentList(std::vector<DataExtent> & extents)
+{
+    VD_STAT_SCOPE(_stats);
+    if (!_zeroGranularity) {
+        vhdGetDataExtents(pImage, extents);
+        return;
+    }
+    std::vector<DataExtent> found;
+    vhdGetDataExtents(pImage, found);
+    VDPruneZeroExtents(this, found, _zeroGranularity);
+    extents.insert(extents.end(), found.begin(), found.end());
+}
+
+/* Areas of the extents left by the zero scan, false if the scan is off. */
+bool VHDParser::vhdGetPrunedAreas(DataAreaMap & areamap)
+{
+    if (!_zeroGranularity) {
+        return false;
+    }
+    std::vector<DataExtent> extents;
+    GetDataExtentList(extents);
+    AppendExtentAreas(areamap, extents);
+    return true;
+}
+
+void VHDParser::vhdGetDataExtents(VDVHDState *pImage, std::vector<DataExtent> & extents)
+{
+    /* sectors a differencing disk does not mark come from its parent, so
+    * its bitmaps are always honoured */
+    if (pImage->diskType == VHD_DYNAMIC && (_fineGrained || pImage->hasParent)) {
+        vhdGetSectorExtents(pImage, extents);
+    }
+    else if (pImage->diskType == VHD_DYNAMIC) {
+        vhdGetBlockExtents(pImage, extents);
     }
     else {
-        DataArea area;
-        area.offset = 0;
-        area.length = (uint32_t)(pImage->curSize / MiB);
-        arealist.push_back(area);
+        vhdGetFixedExtents(extents);
+    }
+}
+
+void VHDParser::vhdGetBlockExtents(VDVHDState *pImage, std::vector<DataExtent> & extents)
+{
+    for (uint32_t k = 0; k < pImage->cAllocatedBlocks; ++k) {
+        uint64_t i = pImage->pAllocatedBlocks[k];
+        uint64_t offset = i * pImage->blockSize;
+        if (offset >= pImage->curSize) {
+            break;
+        }
+        uint64_t length = std::min((uint64_t)pImage->blockSize, pImage->curSize - offset);
+        uint64_t fileOffset = ((uint64_t)pImage->pBlockAllocationTable[i] + pImage->cDataBlockBitmapSectors) * VHD_SECTOR_SIZE;
+        AppendDataExtent(extents, offset, length, fileOffset);
+    }
+}
+
+/*
+* Map the virtual range [offset, offset + size) to the image file. Returns the
+* length of the leading part that is either contiguous in the file, with
+* fileOffset set to its start, or unallocated throughout, with fileOffset set
+* to VD_NO_FILE_OFFSET.
+*/
+uint64_t VHDParser::vhdMapRange(VDVHDState *pImage, uint64_t offset, uint64_t size, uint64_t *fileOffset)
+{
+    if (pImage->diskType != VHD_DYNAMIC) {
+        /* fixed disk data starts at the beginning of the file */
+        *fileOffset = offset;
+        return size;
+    }
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t block = (offset + done) / pImage->blockSize;
+        uint64_t inBlock = (offset + done) % pImage->blockSize;
+        uint64_t length = std::min(pImage->blockSize - inBlock, size - done);
+        uint64_t blockFileOffset = VD_NO_FILE_OFFSET;
+        if (block < pImage->cBlockAllocationTableEntries && pImage->pBlockAllocationTable[block] != ~0U) {
+            blockFileOffset = ((uint64_t)pImage->pBlockAllocationTable[block] + pImage->cDataBlockBitmapSectors) * VHD_SECTOR_SIZE + inBlock;
+        }
+        if (done == 0) {
+            *fileOffset = blockFileOffset;
+        }
+        else if (*fileOffset == VD_NO_FILE_OFFSET ? blockFileOffset != VD_NO_FILE_OFFSET
+                                                  : blockFileOffset != *fileOffset + done) {
+            break;
+        }
+        done += length;
+    }
+    return done;
+}
+
+NS_IMETHODIMP_(uint64_t)
+VHDParser::GetVirtualSize()
+{
+    return pImage->curSize;
+}
+
+NS_IMETHODIMP_(void)
+VHDParser::ReadData(uint64_t offset, char * buffer, uint64_t size)
+{
+    VD_STAT_SCOPE(_stats);
+    if (offset >= pImage->curSize) {
+        memset(buffer, 0, (size_t)size);
+        return;
+    }
+    if (size > pImage->curSize - offset) {
+        memset(buffer + (pImage->curSize - offset), 0, (size_t)(size - (pImage->curSize - offset)));
+        size = pImage->curSize - offset;
+    }
+    while (size) {
+        uint64_t fileOffset;
+        uint64_t length = vhdMapRange(pImage, offset, size, &fileOffset);
+        if (fileOffset == VD_NO_FILE_OFFSET) {
+            memset(buffer, 0, (size_t)length);
+        }
+        else {
+            io->Read(fileOffset, buffer, length);
+        }
+        offset += length;
+        buffer += length;
+        size -= length;
+    }
+}
+
+NS_IMETHODIMP_(bool)
+VHDParser::GetParentPaths(std::list<std::string> & parentPaths)
+{
+    parentPaths.insert(parentPaths.end(), _parentPaths.begin(), _parentPaths.end());
+    return pImage->hasParent;
+}
+
+NS_IMETHODIMP_(uint32_t)
+VHDParser::GetBlockSize()
+{
+    return pImage->blockSize;
+}
+
+NS_IMETHODIMP_(void)
+VHDParser::GetImageId(VDImageId & id)
+{
+    memcpy(id.bytes, pImage->uniqueId, sizeof(id.bytes));
+}
+
+/* false for a disk without parent or one that does not record the UUID */
+NS_IMETHODIMP_(bool)
+VHDParser::GetParentId(VDImageId & id)
+{
+    static const uint8_t none[16] = {};
+    if (!pImage->hasParent || !memcmp(pImage->parentUuid, none, sizeof(none))) {
+        return false;
+    }
+    memcpy(id.bytes, pImage->parentUuid, sizeof(id.bytes));
+    return true;
+}
+
+NS_IMETHODIMP_(void)
+VHDParser::GetImageStamp(VDImageStamp & stamp)
+{
+    stamp.fileSize = io->GetFileSize();
+    stamp.sequence = ((uint64_t)pImage->footerTimestamp << 32) | pImage->footerChecksum;
+    stamp.batHash = 0;
+    if (pImage->pBlockAllocationTable) {
+        stamp.batHash = VDHash64(pImage->pBlockAllocationTable, (size_t)pImage->cBlockAllocationTableEntries * 4, 0);
+    }
+    if (!_hostRanges.empty()) {
+        /* writes to a fixed disk only show in what the host allocated */
+        stamp.batHash = VDHash64(&_hostRanges[0], _hostRanges.size() * sizeof(VDFileRange), stamp.batHash);
     }
 }
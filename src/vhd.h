@@ -1,9 +1,13 @@
-#pragma once
+﻿#pragma once
 #include <iostream>
 #include <string>
 #include <list>
 #include <fstream>
-#include "ncIVDParser.h"
+#include "ncIVDParserEx.h"
+#include "vdio.h"
+#include "vdaio.h"
+#include "vdarena.h"
+#include "vdstats.h"
 
 /* struct DataArea
 {
@@ -12,19 +16,77 @@
 }; */
 
 struct VDVHDState;
-class  VHDParser : public ncIVDParser
+struct VHDDynamicDiskHeader;
+class  VHDParser : public ncIVDParserEx
 {
 public:
     NS_DECL_ISUPPORTS
     NS_DECL_NCIVDPARSE
+    NS_DECL_NCIVDPARSEEX
     VHDParser();
     ~VHDParser();
 
+    /* Report only the sectors marked in each block's sector bitmap from
+    * GetDataExtentList, instead of whole blocks. Costs one bitmap read per
+    * allocated block. */
+    void SetFineGrained(bool fineGrained);
+
+    /* I/O backend used by the next Open, VD_IO_STREAM by default. */
+    void SetIoBackend(VDIoBackend backend);
+
+    /* Read block bitmaps through a VDAsyncReader with queueDepth reads in
+    * flight, 0 (the default) reads them one at a time. */
+    void SetAsyncIo(unsigned queueDepth);
+
+    /* Swap large BATs on threads threads, 0 uses every core. The default
+    * of 1 swaps on the calling thread. */
+    void SetDecodeThreads(unsigned threads);
+
+    /* Report only the parts of a fixed disk that the host file system has
+    * allocated, queried once at Open, so the holes of a thin provisioned
+    * image are skipped. On by default; where the host cannot tell, the
+    * whole disk is reported. */
+    void SetHostAllocation(bool hostAllocation);
+
+    /* Read the data of every extent and leave out the all zero stretches of
+    * granularity bytes, see VDPruneZeroExtents, from GetDataExtentList and
+    * GetDataAreaList. Costs a read of all the data; 0, the default, skips
+    * the scan. */
+    void SetZeroScan(uint32_t granularity);
+
+    /* What the calling thread recorded in this parser since the last Open,
+    * the open itself included. All zero without VD_ENABLE_STATS. */
+    void GetStats(VDStats & stats) const;
+
 private:
     void vhdParseHeader(VDVHDState *s);
     void vhdInit(VDVHDState *pImage);
+    void vhdSwapBat(VDVHDState *pImage, const uint32_t *src);
+    void vhdStatBat(VDVHDState *pImage);
+    void vhdParseParentLocators(VDVHDState *pImage, const VHDDynamicDiskHeader *header);
+    void vhdGetSectorExtents(VDVHDState *pImage, std::vector<DataExtent> & extents);
+    void vhdQueryHostRanges(VDVHDState *pImage);
+    void vhdGetFixedExtents(std::vector<DataExtent> & extents);
+    void vhdGetAreas(VDVHDState *pImage, DataAreaMap & areamap);
+    void vhdGetBlockExtents(VDVHDState *pImage, std::vector<DataExtent> & extents);
+    void vhdGetDataExtents(VDVHDState *pImage, std::vector<DataExtent> & extents);
+    bool vhdGetPrunedAreas(DataAreaMap & areamap);
+    uint64_t vhdMapRange(VDVHDState *pImage, uint64_t offset, uint64_t size, uint64_t *fileOffset);
 private:
     std::string _filePath;
-    std::ifstream fileHandle;
+    std::list<std::string> _parentPaths;
+    VDIo *io;
+    VDIoBackend _ioBackend;
+    VDAsyncReader *_aio;
+    unsigned _queueDepth;
     VDVHDState *pImage;
+    bool _fineGrained;
+    unsigned _decodeThreads;
+    bool _hostAllocation;
+    uint32_t _zeroGranularity;
+    VDStats _stats;
+    /* state of the open image, reset by Close */
+    VDArena _arena;
+    /* fixed disk: allocated ranges of the file within the disk */
+    std::vector<VDFileRange> _hostRanges;
 };
@@ -1,12 +1,20 @@
-// vhdxTest.cpp 
+﻿// vhdxTest.cpp 
 #include <abprec.h>
 #include <stdint.h>
-#include "queue.h"
 #include <iostream>
 #include <fstream>
 #include <string.h>
+#include <stdio.h>
+#include <algorithm>
 #include "vhdx.h"
 #include "vd.h"
+#include "vdpool.h"
+#include "vdinterval.h"
+#include "vdzero.h"
+
+#ifdef VD_X86_KERNELS
+#include <immintrin.h>
+#endif
 using namespace std;
 
 /*********************************************************************************************************************************
@@ -400,11 +408,7 @@ typedef struct VHDXLogEntries {
     uint32_t tail;
 } VHDXLogEntries;
 
-typedef struct VHDXRegionEntry {
-    uint64_t start;
-    uint64_t end;
-    QLIST_ENTRY(VHDXRegionEntry) entries;
-} VHDXRegionEntry;
+static const MSGUID zero_guid = {};
 
 /* ------- Known Region Table GUIDs ---------------------- */
 static const MSGUID bat_guid = { 0x2dc27766, 0xf623,0x4200, { 0x9d, 0x64, 0x11, 0x5e,0x9b, 0xfd, 0x4a, 0x08 } };
@@ -470,11 +474,30 @@ typedef struct VDVHDXState {
     uint32_t bat_entries;
     VHDXBatEntry *bat;
     uint64_t bat_offset;
+    bool bat_mapped;
+
+    /* sector bitmap block of chunk sb_chunk, loaded on demand */
+    const uint8_t *sb_view;
+    uint8_t *sb_buffer;
+    int64_t sb_chunk;
 
     VHDXParentLocatorHeader parent_header;
     VHDXParentLocatorEntry *parent_entries;
-
-    QLIST_HEAD(, VHDXRegionEntry) regions;
+    MSGUID parent_linkage;               /* DataWriteGuid of the parent */
+    bool has_parent_linkage;
+
+    /* highest sequence number of the valid entries of the current log, 0
+    * without a log. Every BAT update goes through the log, so the BAT
+    * cannot have changed while this and the header stay the same. */
+    uint64_t log_sequence;
+
+    /* header section and metadata region, each read in one go and only
+    * kept while opening; the buffers are NULL when the range is mapped */
+    const uint8_t *section;
+    uint8_t *section_buffer;
+    const uint8_t *metadata;
+    uint8_t *metadata_buffer;
+    uint32_t metadata_length;
 } VDVHDXState;
 
 
@@ -508,14 +531,18 @@ static uint32_t __inline clz64(uint32_t x)
 
 
 
-void VHDXParser::vhdxRegionUnregisterAll(VDVHDXState *s)
-{
-    VHDXRegionEntry *r, *r_next;
 
-    QLIST_FOREACH_SAFE(r, &s->regions, entries, r_next) {
-        QLIST_REMOVE(r, entries);
-        free(r);
-    }
+/* CRC-32C of size bytes of buf, taken with the 4 byte checksum field at
+* crcOffset as zero, against the value stored there */
+static bool vhdxChecksumValid(const uint8_t *buf, size_t size, size_t crcOffset)
+{
+    static const uint8_t zero[4] = { 0 };
+    uint32_t stored;
+    memcpy(&stored, buf + crcOffset, sizeof(stored));
+    uint32_t crc = VDCrc32c(buf, crcOffset, 0);
+    crc = VDCrc32c(zero, sizeof(zero), crc);
+    crc = VDCrc32c(buf + crcOffset + 4, size - crcOffset - 4, crc);
+    return crc == stored;
 }
 
 void VHDXParser::vhdxParseHeader(VDVHDXState *s)
@@ -526,23 +553,21 @@ void VHDXParser::vhdxParseHeader(VDVHDXState *s)
     bool h2_valid = false;
     uint64_t h1_seq = 0;
     uint64_t h2_seq = 0;
-    header1 = (VHDXHeader *)malloc(sizeof(VHDXHeader));
-    header2 = (VHDXHeader *)malloc(sizeof(VHDXHeader));
-    uint8_t *buffer;
-    buffer = (uint8_t *)malloc(VHDX_HEADER_SIZE);
+    header1 = _arena.Alloc<VHDXHeader>();
+    header2 = _arena.Alloc<VHDXHeader>();
     s->headers[0] = header1;
     s->headers[1] = header2;
-    Read(fileHandle, VHDX_HEADER1_OFFSET, (char *)buffer, VHDX_HEADER_SIZE);
-    memcpy(header1, buffer, sizeof(VHDXHeader));
+    memcpy(header1, s->section + VHDX_HEADER1_OFFSET, VHDX_HEADER_SIZE);
     if (header1->signature == VHDX_HEADER_SIGNATURE &&
-        header1->version == 1) {
+        header1->version == 1 &&
+        (!_strict || vhdxChecksumValid((const uint8_t *)header1, VHDX_HEADER_SIZE, 4))) {
         h1_seq = header1->sequence_number;
         h1_valid = true;
     }
-    Read(fileHandle, VHDX_HEADER2_OFFSET,  (char *)buffer, VHDX_HEADER_SIZE);
-    memcpy(header2, buffer, sizeof(VHDXHeader));
+    memcpy(header2, s->section + VHDX_HEADER2_OFFSET, VHDX_HEADER_SIZE);
     if (header2->signature == VHDX_HEADER_SIGNATURE &&
-        header2->version == 1) {
+        header2->version == 1 &&
+        (!_strict || vhdxChecksumValid((const uint8_t *)header2, VHDX_HEADER_SIZE, 4))) {
         h2_seq = header2->sequence_number;
         h2_valid = true;
     }
@@ -581,40 +606,232 @@ void VHDXParser::vhdxParseHeader(VDVHDXState *s)
     goto exit;
 
 fail:
-    free(header1);
-    free(header2);
     s->headers[0] = NULL;
     s->headers[1] = NULL;
 exit:
-    free(buffer);
+    return;
 }
 
-/* Register a region for future checks */
-void VHDXParser::vhdxRegionRegister(VDVHDXState *s,uint64_t start, uint64_t length)
+/* log entry found in the log region, see vhdxLogEntryValid */
+typedef struct VHDXLogEntryInfo {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t tail;
+    uint64_t sequence;
+} VHDXLogEntryInfo;
+
+/*
+* Validate the log entry at offset of log, which holds the log twice so that
+* an entry wrapping around the end is contiguous: header, descriptors, and
+* the sequence number stamped into every descriptor and data sector. Strict
+* checking adds the CRC-32C of the whole entry.
+*/
+static bool vhdxLogEntryValid(const uint8_t *log, uint32_t logLength, uint32_t offset,
+    const MSGUID & logGuid, bool strict, VHDXLogEntryInfo & info)
 {
-    VHDXRegionEntry *r;
+    const VHDXLogEntryHeader *hdr = (const VHDXLogEntryHeader *)(log + offset);
+    if (hdr->signature != VHDX_LOG_SIGNATURE || memcmp(&hdr->log_guid, &logGuid, sizeof(MSGUID)) ||
+        hdr->sequence_number == 0 ||
+        hdr->entry_length == 0 || hdr->entry_length % VHDX_LOG_SECTOR_SIZE || hdr->entry_length > logLength ||
+        hdr->tail % VHDX_LOG_SECTOR_SIZE || hdr->tail >= logLength ||
+        hdr->descriptor_count > hdr->entry_length / VHDX_LOG_DESC_SIZE) {
+        return false;
+    }
+    uint64_t descSectors = DIV_ROUND_UP(VHDX_LOG_HDR_SIZE + (uint64_t)hdr->descriptor_count * VHDX_LOG_DESC_SIZE, VHDX_LOG_SECTOR_SIZE);
+    uint64_t dataSectors = 0;
+    const VHDXLogDescriptor *desc = (const VHDXLogDescriptor *)(log + offset + VHDX_LOG_HDR_SIZE);
+    for (uint32_t i = 0; i < hdr->descriptor_count; ++i) {
+        if (desc[i].sequence_number != hdr->sequence_number || desc[i].file_offset % VHDX_LOG_SECTOR_SIZE) {
+            return false;
+        }
+        if (desc[i].signature == VHDX_LOG_DESC_SIGNATURE) {
+            ++dataSectors;
+        }
+        else if (desc[i].signature != VHDX_LOG_ZERO_SIGNATURE || desc[i].zero_length % VHDX_LOG_SECTOR_SIZE) {
+            return false;
+        }
+    }
+    if ((descSectors + dataSectors) * VHDX_LOG_SECTOR_SIZE > hdr->entry_length) {
+        return false;
+    }
+    const VHDXLogDataSector *data = (const VHDXLogDataSector *)(log + offset + descSectors * VHDX_LOG_SECTOR_SIZE);
+    for (uint64_t i = 0; i < dataSectors; ++i) {
+        if (data[i].data_signature != VHDX_LOG_DATA_SIGNATURE ||
+            data[i].sequence_high != (uint32_t)(hdr->sequence_number >> 32) ||
+            data[i].sequence_low != (uint32_t)hdr->sequence_number) {
+            return false;
+        }
+    }
+    if (strict && !vhdxChecksumValid(log + offset, hdr->entry_length, 4)) {
+        return false;
+    }
+    info.offset = offset;
+    info.length = hdr->entry_length;
+    info.tail = hdr->tail;
+    info.sequence = hdr->sequence_number;
+    return true;
+}
 
-    r = (VHDXRegionEntry *)malloc(sizeof(*r));
+/*
+* Replay a log left behind by a writer that did not close the image cleanly.
+* The active sequence ends at the valid entry with the highest sequence number
+* and starts at the tail that entry records; every entry in between must be
+* valid and numbered consecutively. Its data and zero descriptors are applied
+* to an in memory overlay that all further reads go through, the file itself
+* is never written.
+*/
+void VHDXParser::vhdxReplayLog(VDVHDXState *s)
+{
+    VHDXHeader *header = s->headers[s->curr_header];
+    if (!memcmp(&header->log_guid, &zero_guid, sizeof(MSGUID)) || header->log_length == 0) {
+        return;
+    }
+    VD_STAT_PHASE(VD_STAT_LOG_REPLAY);
+    if (header->log_length % VHDX_LOG_SECTOR_SIZE) {
+        throw exception("vhdx log format error");
+    }
+    uint32_t logLength = header->log_length;
+    uint8_t *log = _arena.Alloc<uint8_t>((size_t)logLength * 2);
+    std::vector<VHDXLogEntryInfo> entries;
+    std::vector<VHDXLogEntryInfo> sequence;
+    {
+        io->Read(header->log_offset, (char *)log, logLength);
+        memcpy(log + logLength, log, logLength);
+
+        std::map<uint32_t, VHDXLogEntryInfo> byOffset;
+        for (uint32_t offset = 0; offset < logLength; offset += VHDX_LOG_SECTOR_SIZE) {
+            VHDXLogEntryInfo info;
+            if (vhdxLogEntryValid(log, logLength, offset, header->log_guid, _strict, info)) {
+                entries.push_back(info);
+                byOffset[offset] = info;
+            }
+        }
+        std::sort(entries.begin(), entries.end(), [](const VHDXLogEntryInfo & a, const VHDXLogEntryInfo & b) {
+            return a.sequence > b.sequence;
+        });
+        if (!entries.empty()) {
+            s->log_sequence = entries[0].sequence;
+        }
+        /* an older head is tried when the newest sequence is torn */
+        for (size_t h = 0; h < entries.size() && sequence.empty(); ++h) {
+            const VHDXLogEntryInfo & head = entries[h];
+            uint32_t offset = head.tail;
+            for (size_t step = 0; step < entries.size(); ++step) {
+                std::map<uint32_t, VHDXLogEntryInfo>::iterator it = byOffset.find(offset);
+                if (it == byOffset.end() || it->second.sequence > head.sequence ||
+                    (!sequence.empty() && it->second.sequence != sequence.back().sequence + 1)) {
+                    break;
+                }
+                sequence.push_back(it->second);
+                if (it->second.offset == head.offset) {
+                    break;
+                }
+                offset = (uint32_t)(((uint64_t)offset + it->second.length) % logLength);
+            }
+            if (sequence.empty() || sequence.back().offset != head.offset) {
+                sequence.clear();
+            }
+        }
+        if (sequence.empty()) {
+            return;
+        }
+
+        VDOverlayIo *overlay = new VDOverlayIo(io);
+        _logOverlay = overlay;
+        io = overlay;
+        std::vector<char> sector(VHDX_LOG_SECTOR_SIZE);
+        for (size_t e = 0; e < sequence.size(); ++e) {
+            const uint8_t *entry = log + sequence[e].offset;
+            const VHDXLogEntryHeader *hdr = (const VHDXLogEntryHeader *)entry;
+            const VHDXLogDescriptor *desc = (const VHDXLogDescriptor *)(entry + VHDX_LOG_HDR_SIZE);
+            const VHDXLogDataSector *data = (const VHDXLogDataSector *)(entry +
+                DIV_ROUND_UP(VHDX_LOG_HDR_SIZE + (uint64_t)hdr->descriptor_count * VHDX_LOG_DESC_SIZE, VHDX_LOG_SECTOR_SIZE) * VHDX_LOG_SECTOR_SIZE);
+            for (uint32_t i = 0; i < hdr->descriptor_count; ++i) {
+                uint64_t length = desc[i].signature == VHDX_LOG_ZERO_SIGNATURE ? desc[i].zero_length : VHDX_LOG_SECTOR_SIZE;
+                if (vhdxRegionCheck(desc[i].file_offset, length) < 0) {
+                    throw exception("vhdx log format error");
+                }
+                if (desc[i].signature == VHDX_LOG_ZERO_SIGNATURE) {
+                    overlay->Write(desc[i].file_offset, NULL, desc[i].zero_length);
+                    continue;
+                }
+                /* the data sector's own signature and sequence fields hide
+                * 12 bytes that the descriptor carries */
+                memcpy(&sector[0], &desc[i].leading_bytes, 8);
+                memcpy(&sector[8], data->data, sizeof(data->data));
+                memcpy(&sector[VHDX_LOG_SECTOR_SIZE - 4], &desc[i].trailing_bytes, 4);
+                overlay->Write(desc[i].file_offset, &sector[0], VHDX_LOG_SECTOR_SIZE);
+                ++data;
+            }
+        }
+    }
 
-    r->start = start;
-    r->end = start + length;
+    /* sector bitmaps may be in the log too, prefetch would bypass it */
+    if (_aio) {
+        delete _aio;
+        _aio = NULL;
+    }
+}
 
-    QLIST_INSERT_HEAD(&s->regions, r, entries);
+/* Drop the replayed log, io is the plain file again. */
+void VHDXParser::vhdxReleaseLog()
+{
+    if (_logOverlay) {
+        io = _logOverlay->Base();
+        delete _logOverlay;
+        _logOverlay = NULL;
+    }
+}
+
+/* Register a region for future checks, failing if it overlaps one that is
+* already registered */
+int VHDXParser::vhdxRegionRegister(uint64_t start, uint64_t length)
+{
+    if (!_regions.Insert(start, length)) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* The header section and the log are off limits to the regions and to the
+* log's own writes, register them first. */
+int VHDXParser::vhdxRegisterHeaderRegions(VDVHDXState *s)
+{
+    int ret = vhdxRegionRegister(0, VHDX_HEADER_SECTION_END);
+    if (ret < 0) {
+        return ret;
+    }
+    VHDXHeader *header = s->headers[s->curr_header];
+    if (header->log_length == 0) {
+        return 0;
+    }
+    if (header->log_offset % MiB || header->log_offset < VHDX_HEADER_SECTION_END) {
+        return -EINVAL;
+    }
+    return vhdxRegionRegister(header->log_offset, header->log_length);
 }
 
 int VHDXParser::vhdxOpenRegionTables(VDVHDXState *s)
 {
     int ret = 0;
-    uint8_t *buffer;
+    const uint8_t *buffer;
     int offset = 0;
     VHDXRegionTableEntry rt_entry;
     uint32_t i;
     bool bat_rt_found = false;
     bool metadata_rt_found = false;
-    /* We have to read the whole 64KB block, because the crc32 is over the
-    * whole block */
-    buffer = (uint8_t *)malloc(VHDX_HEADER_BLOCK_SIZE);
-    Read(fileHandle, VHDX_REGION_TABLE_OFFSET, (char *)buffer, VHDX_HEADER_BLOCK_SIZE);
+    /* the crc32 is over the whole 64KB block, which is part of the header
+    * section read at open */
+    buffer = s->section + VHDX_REGION_TABLE_OFFSET;
+    if (_strict && !vhdxChecksumValid(buffer, VHDX_HEADER_BLOCK_SIZE, 4)) {
+        /* both copies are identical, the second one stands in for a
+        * damaged first */
+        buffer = s->section + VHDX_REGION_TABLE2_OFFSET;
+        if (!vhdxChecksumValid(buffer, VHDX_HEADER_BLOCK_SIZE, 4)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
     memcpy(&s->rt, buffer, sizeof(s->rt));
     offset += sizeof(s->rt);
 
@@ -629,7 +846,16 @@ int VHDXParser::vhdxOpenRegionTables(VDVHDXState *s)
     for (i = 0; i < s->rt.entry_count; i++) {
         memcpy(&rt_entry, buffer + offset, sizeof(rt_entry));
         offset += sizeof(rt_entry);
-        vhdxRegionRegister(s, rt_entry.file_offset, rt_entry.length);
+        /* regions are 1MB aligned, and may not overlap each other, the
+        * headers or the log */
+        if (rt_entry.file_offset % MiB) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = vhdxRegionRegister(rt_entry.file_offset, rt_entry.length);
+        if (ret < 0) {
+            goto fail;
+        }
         /* see if we recognize the entry */
         if (guid_eq(rt_entry.guid, bat_guid)) {
             /* must be unique; if we have already found it this is invalid */
@@ -667,21 +893,52 @@ int VHDXParser::vhdxOpenRegionTables(VDVHDXState *s)
 
     ret = 0;
 fail:
-    free(buffer);
     return ret;
 }
 
+/* largest metadata region read in one go, items past it are read singly */
+#define VHDX_METADATA_READ_MAX (8 * MiB)
+
+/*
+* Read the metadata region, table and items alike, with a single read. The
+* region is 1 MiB in every image seen in practice.
+*/
+void VHDXParser::vhdxReadMetadata(VDVHDXState *s)
+{
+    uint32_t length = (uint32_t)std::min<uint64_t>(s->metadata_rt.length, VHDX_METADATA_READ_MAX);
+    length = std::max<uint32_t>(length, VHDX_METADATA_TABLE_MAX_SIZE);
+    s->metadata_length = length;
+    s->metadata = io->Map(s->metadata_rt.file_offset, length);
+    if (s->metadata) {
+        return;
+    }
+    s->metadata_buffer = _arena.Alloc<uint8_t>(length);
+    io->Read(s->metadata_rt.file_offset, (char *)s->metadata_buffer, length);
+    s->metadata = s->metadata_buffer;
+}
+
+/* Copy size bytes of the metadata item of entry, from the metadata region
+* read at open when it holds them. */
+void VHDXParser::vhdxReadMetadataItem(VDVHDXState *s, const VHDXMetadataTableEntry & entry, void *buffer, uint32_t size)
+{
+    if ((uint64_t)entry.offset + size <= s->metadata_length) {
+        memcpy(buffer, s->metadata + entry.offset, size);
+        return;
+    }
+    io->Read(s->metadata_rt.file_offset + entry.offset, (char *)buffer, size);
+}
+
 int VHDXParser::vhdxParseMetadata(VDVHDXState *s)
 {
     int ret = 0;
-    uint8_t *buffer;
+    const uint8_t *buffer;
     int offset = 0;
     uint32_t i = 0;
     VHDXMetadataTableEntry md_entry;
+    VDIntervalSet items;
 
-    buffer = (uint8_t *)malloc(VHDX_METADATA_TABLE_MAX_SIZE);
-
-    Read(fileHandle, s->metadata_rt.file_offset, (char *)buffer, VHDX_METADATA_TABLE_MAX_SIZE);
+    vhdxReadMetadata(s);
+    buffer = s->metadata;
     memcpy(&s->metadata_hdr, buffer, sizeof(s->metadata_hdr));
     offset += sizeof(s->metadata_hdr);
 
@@ -697,9 +954,17 @@ int VHDXParser::vhdxParseMetadata(VDVHDXState *s)
         ret = -EINVAL;
         goto exit;
     }
+    /* items follow the 64KB table inside the region, and may not overlap */
+    items.Insert(0, VHDX_METADATA_TABLE_MAX_SIZE);
     for (i = 0; i < s->metadata_hdr.entry_count; i++) {
         memcpy(&md_entry, buffer + offset, sizeof(md_entry));
         offset += sizeof(md_entry);
+        if (md_entry.length &&
+            ((uint64_t)md_entry.offset + md_entry.length > s->metadata_rt.length ||
+            !items.Insert(md_entry.offset, md_entry.length))) {
+            ret = -EINVAL;
+            goto exit;
+        }
         if (guid_eq(md_entry.item_id, file_param_guid)) {
             if (s->metadata_entries.present & META_FILE_PARAMETER_PRESENT) {
                 ret = -EINVAL;
@@ -772,7 +1037,7 @@ int VHDXParser::vhdxParseMetadata(VDVHDXState *s)
         goto exit;
     }*/
 
-    Read(fileHandle, s->metadata_entries.file_parameters_entry.offset + s->metadata_rt.file_offset, (char *)&s->params, sizeof(s->params));
+    vhdxReadMetadataItem(s, s->metadata_entries.file_parameters_entry, &s->params, sizeof(s->params));
 
     /* We now have the file parameters, so we can tell if this is a
     * differencing file (i.e.. has_parent), is dynamic or fixed
@@ -780,16 +1045,10 @@ int VHDXParser::vhdxParseMetadata(VDVHDXState *s)
     /* The parent locator required if the file parameters has_parent set */
     if (s->params.data_bits & VHDX_PARAMS_HAS_PARENT) {
         if (s->metadata_entries.present & META_PARENT_LOCATOR_PRESENT) {
-           Read(fileHandle, s->metadata_entries.parent_locator_entry.offset + s->metadata_rt.file_offset, (char *)&s->parent_header, sizeof(VHDXParentLocatorHeader));
-           
-           if (guid_eq(s->parent_header.locator_type, parent_vhdx_guid)) {
-               s->parent_entries = (VHDXParentLocatorEntry *)malloc(sizeof(VHDXParentLocatorEntry));
-               //
-               /*for (i = 0; i < s->parent_header.key_value_count; ++i) {
-                   Read(fileHandle, s->metadata_entries.parent_locator_entry.offset + s->metadata_rt.file_offset + sizeof(VHDXParentLocatorHeader) + i * sizeof(VHDXParentLocatorEntry),
-                       (char *)(&(s->parent_entries[i])), sizeof(VHDXParentLocatorEntry));
-               }*/
-           }
+            ret = vhdxParseParentLocator(s);
+            if (ret < 0) {
+                goto exit;
+            }
         }
         else {
             /* if has_parent is set, but there is not parent locator present,
@@ -800,9 +1059,9 @@ int VHDXParser::vhdxParseMetadata(VDVHDXState *s)
     /* determine virtual disk size, logical sector size,
     * and phys sector size */
 
-    Read(fileHandle, s->metadata_entries.virtual_disk_size_entry.offset + s->metadata_rt.file_offset, (char *)(&s->virtual_disk_size), sizeof(uint64_t));
-    Read(fileHandle, s->metadata_entries.logical_sector_size_entry.offset + s->metadata_rt.file_offset,(char *)(&s->logical_sector_size), sizeof(uint32_t));
-    Read(fileHandle, s->metadata_entries.phys_sector_size_entry.offset + s->metadata_rt.file_offset,(char *) (&s->physical_sector_size), sizeof(uint32_t));
+    vhdxReadMetadataItem(s, s->metadata_entries.virtual_disk_size_entry, &s->virtual_disk_size, sizeof(uint64_t));
+    vhdxReadMetadataItem(s, s->metadata_entries.logical_sector_size_entry, &s->logical_sector_size, sizeof(uint32_t));
+    vhdxReadMetadataItem(s, s->metadata_entries.phys_sector_size_entry, &s->physical_sector_size, sizeof(uint32_t));
 
     if (s->params.block_size < VHDX_BLOCK_SIZE_MIN ||
         s->params.block_size > VHDX_BLOCK_SIZE_MAX) {
@@ -848,7 +1107,100 @@ int VHDXParser::vhdxParseMetadata(VDVHDXState *s)
 
     ret = 0;
 exit:
-    free(buffer);
+    return ret;
+}
+
+/* largest parent locator item we accept */
+#define VHDX_PARENT_LOCATOR_MAX_SIZE (64 * KiB)
+
+/* Parse a GUID in registry format, {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}. */
+static bool vhdxParseGuid(const std::string & str, MSGUID *guid)
+{
+    unsigned int d[11];
+    char end;
+    if (str.size() != 38 ||
+        sscanf(str.c_str(), "{%8x-%4x-%4x-%2x%2x-%2x%2x%2x%2x%2x%2x%c",
+            &d[0], &d[1], &d[2], &d[3], &d[4], &d[5], &d[6], &d[7], &d[8], &d[9], &d[10], &end) != 12 ||
+        end != '}') {
+        return false;
+    }
+    guid->data1 = d[0];
+    guid->data2 = (uint16_t)d[1];
+    guid->data3 = (uint16_t)d[2];
+    for (int i = 0; i < 8; ++i) {
+        guid->data4[i] = (uint8_t)d[3 + i];
+    }
+    return true;
+}
+
+/*
+* Read the parent locator item and its key/value entries, and collect the
+* parent linkage and the parent locations, relative path first. Keys and values are UTF-16 LE
+* strings addressed from the start of the item.
+*/
+int VHDXParser::vhdxParseParentLocator(VDVHDXState *s)
+{
+    int ret = 0;
+    uint32_t i;
+    uint8_t *buffer = NULL;
+    uint32_t length = s->metadata_entries.parent_locator_entry.length;
+    std::string relative;
+    std::string absolute;
+    std::string volume;
+
+    if (length < sizeof(VHDXParentLocatorHeader) || length > VHDX_PARENT_LOCATOR_MAX_SIZE) {
+        ret = -EINVAL;
+        goto exit;
+    }
+    buffer = _arena.Alloc<uint8_t>(length);
+    vhdxReadMetadataItem(s, s->metadata_entries.parent_locator_entry, buffer, length);
+    memcpy(&s->parent_header, buffer, sizeof(VHDXParentLocatorHeader));
+    if (!guid_eq(s->parent_header.locator_type, parent_vhdx_guid)) {
+        /* not a VHDX parent, nothing we can follow */
+        goto exit;
+    }
+    if (sizeof(VHDXParentLocatorHeader) + (uint64_t)s->parent_header.key_value_count * sizeof(VHDXParentLocatorEntry) > length) {
+        ret = -EINVAL;
+        goto exit;
+    }
+
+    s->parent_entries = _arena.Alloc<VHDXParentLocatorEntry>(std::max<size_t>(s->parent_header.key_value_count, 1));
+    memcpy(s->parent_entries, buffer + sizeof(VHDXParentLocatorHeader),
+        s->parent_header.key_value_count * sizeof(VHDXParentLocatorEntry));
+
+    for (i = 0; i < s->parent_header.key_value_count; ++i) {
+        VHDXParentLocatorEntry *e = &s->parent_entries[i];
+        if ((uint64_t)e->key_offset + e->key_length > length ||
+            (uint64_t)e->value_offset + e->value_length > length) {
+            ret = -EINVAL;
+            goto exit;
+        }
+        std::string key = Utf16ToUtf8((const uint16_t *)(buffer + e->key_offset), e->key_length / 2, false);
+        std::string value = Utf16ToUtf8((const uint16_t *)(buffer + e->value_offset), e->value_length / 2, false);
+        if (key == "parent_linkage") {
+            s->has_parent_linkage = vhdxParseGuid(value, &s->parent_linkage);
+        }
+        else if (key == "relative_path") {
+            relative = value;
+        }
+        else if (key == "absolute_win32_path") {
+            absolute = value;
+        }
+        else if (key == "volume_path") {
+            volume = value;
+        }
+    }
+    if (!relative.empty()) {
+        _parentPaths.push_back(relative);
+    }
+    if (!absolute.empty()) {
+        _parentPaths.push_back(absolute);
+    }
+    if (!volume.empty()) {
+        _parentPaths.push_back(volume);
+    }
+
+exit:
     return ret;
 }
 
@@ -872,28 +1224,18 @@ void VHDXParser::vhdxCalcBatEntries(VDVHDXState *s)
 }
 
 /* Check for region overlaps inside the VHDX image */
-int VHDXParser::vhdxRegionCheck(VDVHDXState *s, uint64_t start, uint64_t length)
+int VHDXParser::vhdxRegionCheck(uint64_t start, uint64_t length)
 {
-    int ret = 0;
-    uint64_t end;
-    VHDXRegionEntry *r;
-    end = start + length;
-    QLIST_FOREACH(r, &s->regions, entries) {
-        if (!((start >= r->end) || (end <= r->start))) {
-            ret = -EINVAL;
-            goto exit;
-        }
+    if (start + length < start || _regions.Overlaps(start, length)) {
+        return -EINVAL;
     }
-exit:
-    return ret;
+    return 0;
 }
 
 bool VHDXParser::vhdxSignatureCheck(VDVHDXState *s)
 {
     //check file
-    uint64_t signature;
-    fileHandle.read((char *)&signature, sizeof(uint64_t));
-    if (memcmp(&signature, "vhdxfile", 8)) {
+    if (memcmp(s->section + VHDX_FILE_IDENTIFIER_OFFSET, "vhdxfile", 8)) {
         return false;
     }
     return true;
@@ -902,111 +1244,738 @@ bool VHDXParser::vhdxSignatureCheck(VDVHDXState *s)
 void VHDXParser::vhdxInit(VDVHDXState *s)
 {
     s->parent_entries = NULL;
+    s->has_parent_linkage = false;
+    s->log_sequence = 0;
     s->headers[0] = NULL;
     s->headers[1] = NULL;
     s->bat = NULL;
-    QLIST_INIT(&s->regions);
+    s->bat_mapped = false;
+    s->sb_view = NULL;
+    s->sb_buffer = NULL;
+    s->sb_chunk = -1;
+    s->section = NULL;
+    s->section_buffer = NULL;
+    s->metadata = NULL;
+    s->metadata_buffer = NULL;
+    s->metadata_length = 0;
+}
+
+/*
+* Read the whole 1 MiB header section, file identifier, both headers and
+* both region tables, in one go. Everything up to the metadata is parsed
+* from it, so an open costs two reads whatever the storage latency.
+*/
+void VHDXParser::vhdxReadSection(VDVHDXState *s)
+{
+    s->section = io->Map(0, VHDX_HEADER_SECTION_END);
+    if (s->section) {
+        return;
+    }
+    if (s->section_buffer == NULL) {
+        s->section_buffer = _arena.Alloc<uint8_t>(VHDX_HEADER_SECTION_END);
+    }
+    io->Read(0, (char *)s->section_buffer, VHDX_HEADER_SECTION_END);
+    s->section = s->section_buffer;
+}
+
+/* The open time buffers are not needed once the image is parsed, their
+* arena space is reused by the next open. */
+void VHDXParser::vhdxReleaseOpenBuffers(VDVHDXState *s)
+{
+    s->section_buffer = NULL;
+    s->section = NULL;
+    s->metadata_buffer = NULL;
+    s->metadata = NULL;
+    s->metadata_length = 0;
 }
 
 NS_IMETHODIMP_(void) 
 VHDXParser::Open(const string & filePath)
 {
-    s = (VDVHDXState *)malloc(sizeof(VDVHDXState));
-    if ( NULL == s) {
-        throw exception("malloc memory failed");
-    }
+    _stats = VDStats();
+    VD_STAT_SCOPE(_stats);
+    VD_STAT_PHASE(VD_STAT_OPEN);
+    /* release whatever a previous open, failed or not closed, left behind */
+    Close();
+    s = _arena.Alloc<VDVHDXState>();
 
-    fileHandle.open(filePath.c_str(), ios::in | ios::binary);
-    if (fileHandle.fail()) {
-        throw exception("open file failed");
+    if (io && io->Backend() != _ioBackend) {
+        delete io;
+        io = NULL;
+    }
+    if (!io) {
+        io = CreateVDIo(_ioBackend);
+    }
+    io->Open(filePath);
+    if (_queueDepth && io->Backend() != VD_IO_MMAP) {
+        _aio = new VDAsyncReader();
+        _aio->Open(filePath, _queueDepth);
     }
-    vhdxSignatureCheck(s);
+    _parentPaths.clear();
     vhdxInit(s);
-    vhdxParseHeader(s);
-    int ret = 0;
-    ret = vhdxOpenRegionTables(s);
-    if (ret < 0) {
-        throw exception("vhdxOpenRegionTables failed");
+    {
+        VD_STAT_PHASE(VD_STAT_HEADER);
+        vhdxReadSection(s);
+        vhdxSignatureCheck(s);
+        vhdxParseHeader(s);
+        if (s->headers[0] == NULL) {
+            /* no usable header, or in strict mode none with a valid CRC */
+            throw exception("vhdx header invalid");
+        }
+        if (vhdxRegisterHeaderRegions(s) < 0) {
+            throw exception("vhdx format error");
+        }
     }
-    ret = vhdxParseMetadata(s);
-    if (ret < 0) {
-        throw exception("vhdxParseMetadata failed");
+    vhdxReplayLog(s);
+    {
+        VD_STAT_PHASE(VD_STAT_METADATA);
+        int ret = 0;
+        ret = vhdxOpenRegionTables(s);
+        if (ret < 0) {
+            throw exception("vhdxOpenRegionTables failed");
+        }
+        ret = vhdxParseMetadata(s);
+        if (ret < 0) {
+            throw exception("vhdxParseMetadata failed");
+        }
+        vhdxCalcBatEntries(s);
     }
-    vhdxCalcBatEntries(s);
 
     if (s->bat_entries > s->bat_rt.length / sizeof(VHDXBatEntry)) {
     /* BAT allocation is not large enough for all entries */ 
         throw exception("vhdx format error");
     }
+    vhdxReleaseOpenBuffers(s);
+    vhdxQueryHostRanges(s);
 }
 
 NS_IMETHODIMP_(void)
 VHDXParser::Close()
 {
-    fileHandle.close();
-    if (s && s->bat) {
-        free(s->bat);
-        s->bat = NULL;
+    vhdxReleaseLog();
+    if (io) {
+        io->Close();
     }
-    if (s && s->parent_entries) {
-        free(s->parent_entries);
-        s->parent_entries = NULL;
+    if (_aio) {
+        delete _aio;
+        _aio = NULL;
     }
-    if (s) {
-        if(s->headers[0]) {
-            free(s->headers[0]);
-            s->headers[0] = NULL;
+    _sbWindow.clear();
+    _sbWindowChunks.clear();
+    _regions.Clear();
+    _hostRanges.clear();
+    _hostSparse = false;
+    /* the state and everything it points to lives in the arena */
+    s = NULL;
+    _arena.Reset();
+}
+
+void VHDXParser::vhdxLoadBat(VDVHDXState *s)
+{
+    if (s->bat) {
+        return;
+    }
+    {
+        VD_STAT_PHASE(VD_STAT_BAT_LOAD);
+        s->bat = (VHDXBatEntry *)io->Map(s->bat_offset, s->bat_rt.length);
+        if (s->bat) {
+            s->bat_mapped = true;
         }
-        if (s->headers[1]) {
-            free(s->headers[1]);
-            s->headers[1] = NULL;
+        else {
+            s->bat = (VHDXBatEntry *)_arena.Alloc(s->bat_rt.length, 64);
+            io->Read(s->bat_offset, (char *)s->bat, s->bat_rt.length);
         }
     }
-    if (s) {
-        vhdxRegionUnregisterAll(s);
+    vhdxStatBat(s);
+}
+
+/* Histogram of the payload entry states, once per loaded BAT. */
+void VHDXParser::vhdxStatBat(VDVHDXState *s)
+{
+#ifdef VD_ENABLE_STATS
+    uint64_t states[VD_STAT_BAT_STATES] = { 0 };
+    uint64_t blocks = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    for (uint64_t pbindex = 0; pbindex < blocks; ++pbindex) {
+        ++states[s->bat[pbindex + (pbindex >> s->chunk_ratio_bits)] & VHDX_BAT_STATE_BIT_MASK];
     }
-    if (s) {
-        free(s);
-        s = NULL;
+    VDStatsBat(states);
+#else
+    (void)s;
+#endif
+}
+
+#define VHDX_SB_BLOCK_SIZE (1 * MiB)
+
+/* run of consecutive payload blocks in the same BAT state */
+typedef struct VHDXBlockRun {
+    uint64_t block;
+    uint64_t count;
+    uint32_t state;
+} VHDXBlockRun;
+
+/*
+* Collect the sector runs of payload block pbindex that are stored in this
+* file. A fully present block is a single run; a partially present block is
+* resolved through the sector bitmap block of its chunk, which is read once
+* and reused for the other blocks of the chunk. Returns false if the block
+* holds no data in this file.
+*/
+bool VHDXParser::vhdxBlockRuns(VDVHDXState *s, uint64_t pbindex, std::vector<BitmapRun> & runs)
+{
+    uint64_t chunk = pbindex >> s->chunk_ratio_bits;
+    VHDXBatEntry entry = s->bat[pbindex + chunk];
+    BitmapRun run;
+
+    runs.clear();
+    switch (entry & VHDX_BAT_STATE_BIT_MASK) {
+    case PAYLOAD_BLOCK_FULLY_PRESENT:
+        break;
+    case PAYLOAD_BLOCK_PARTIALLY_PRESENT: {
+        uint64_t sbindex = chunk * (s->chunk_ratio + 1) + s->chunk_ratio;
+        if (sbindex >= s->bat_rt.length / sizeof(VHDXBatEntry) ||
+            (s->bat[sbindex] & VHDX_BAT_STATE_BIT_MASK) != SB_BLOCK_PRESENT) {
+            /* no sector bitmap to resolve the block, keep all of it */
+            break;
+        }
+        if (s->sb_chunk != (int64_t)chunk) {
+            uint64_t sbOffset = s->bat[sbindex] & VHDX_BAT_FILE_OFF_MASK;
+            s->sb_view = io->Map(sbOffset, VHDX_SB_BLOCK_SIZE);
+            if (!s->sb_view && _aio) {
+                s->sb_view = vhdxPrefetchSectorBitmaps(s, chunk);
+            }
+            if (!s->sb_view) {
+                if (!s->sb_buffer) {
+                    s->sb_buffer = _arena.Alloc<uint8_t>(VHDX_SB_BLOCK_SIZE);
+                }
+                io->Read(sbOffset, (char *)s->sb_buffer, VHDX_SB_BLOCK_SIZE);
+                s->sb_view = s->sb_buffer;
+            }
+            s->sb_chunk = chunk;
+        }
+        uint64_t bitmapOffset = ((pbindex & (s->chunk_ratio - 1)) * s->sectors_per_block) / 8;
+        BitmapRuns(s->sb_view + bitmapOffset, s->sectors_per_block, false, runs);
+        return !runs.empty();
+    }
+    default:
+        return false;
+    }
+    run.start = 0;
+    run.count = s->sectors_per_block;
+    runs.push_back(run);
+    return true;
+}
+
+bool VHDXParser::vhdxChunkHasPartial(VDVHDXState *s, uint64_t chunk)
+{
+    uint64_t first = chunk * (s->chunk_ratio + 1);
+    uint64_t last = std::min<uint64_t>(first + s->chunk_ratio, s->bat_entries);
+    for (uint64_t i = first; i < last; ++i) {
+        if ((s->bat[i] & VHDX_BAT_STATE_BIT_MASK) == PAYLOAD_BLOCK_PARTIALLY_PRESENT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+* Return the sector bitmap block of chunk from the prefetch window. On a miss
+* the window is refilled with the bitmap blocks of chunk and of the following
+* chunks that have partially present blocks, all read in one async batch.
+*/
+const uint8_t *VHDXParser::vhdxPrefetchSectorBitmaps(VDVHDXState *s, uint64_t chunk)
+{
+    for (size_t k = 0; k < _sbWindowChunks.size(); ++k) {
+        if (_sbWindowChunks[k] == chunk) {
+            return &_sbWindow[k * VHDX_SB_BLOCK_SIZE];
+        }
+    }
+
+    uint64_t blocks = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    uint64_t chunks = DIV_ROUND_UP(blocks, s->chunk_ratio);
+    uint64_t batEntries = s->bat_rt.length / sizeof(VHDXBatEntry);
+    std::vector<VDAioRequest> reqs;
+    _sbWindowChunks.clear();
+    for (uint64_t c = chunk; c < chunks && _sbWindowChunks.size() < _queueDepth; ++c) {
+        uint64_t sbindex = c * (s->chunk_ratio + 1) + s->chunk_ratio;
+        if (sbindex >= batEntries) {
+            break;
+        }
+        if ((s->bat[sbindex] & VHDX_BAT_STATE_BIT_MASK) != SB_BLOCK_PRESENT) {
+            continue;
+        }
+        if (c != chunk && !vhdxChunkHasPartial(s, c)) {
+            continue;
+        }
+        VDAioRequest req;
+        req.offset = s->bat[sbindex] & VHDX_BAT_FILE_OFF_MASK;
+        req.length = VHDX_SB_BLOCK_SIZE;
+        req.buffer = NULL;
+        req.user = NULL;
+        reqs.push_back(req);
+        _sbWindowChunks.push_back(c);
+    }
+    if (reqs.empty()) {
+        return NULL;
+    }
+    _sbWindow.resize(reqs.size() * VHDX_SB_BLOCK_SIZE);
+    for (size_t k = 0; k < reqs.size(); ++k) {
+        reqs[k].buffer = (char *)&_sbWindow[k * VHDX_SB_BLOCK_SIZE];
+    }
+    _aio->ReadBatch(&reqs[0], reqs.size());
+    return &_sbWindow[0];
+}
+
+/* BATs with fewer entries are decoded on the calling thread */
+#define VHDX_PARALLEL_BAT_MIN (1024 * 1024)
+
+static __inline uint32_t trailingZeros64(uint64_t x)
+{
+#if defined(_MSC_VER)
+    unsigned long r = 0;
+    _BitScanForward64(&r, x);
+    return r;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+/* Bit i of the result is set when entry i, of at most 64, is in state. */
+typedef uint64_t (*VDBatStateMaskFn)(const VHDXBatEntry *entries, size_t n, uint64_t state);
+
+static uint64_t batStateMaskGeneric(const VHDXBatEntry *entries, size_t n, uint64_t state)
+{
+    uint64_t mask = 0;
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    /* no 64 bit compare before SSE4.1; after masking the high dword is zero,
+    * so an entry matches when both of its dwords do */
+    const __m128i stateBits = _mm_set1_epi64x(VHDX_BAT_STATE_BIT_MASK);
+    const __m128i want = _mm_set1_epi64x(state);
+    for (; i + 2 <= n; i += 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(entries + i));
+        __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, stateBits), want);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+#endif
+    for (; i < n; ++i) {
+        if ((entries[i] & VHDX_BAT_STATE_BIT_MASK) == state) {
+            mask |= UINT64_C(1) << i;
+        }
+    }
+    return mask;
+}
+
+#ifdef VD_X86_KERNELS
+VD_TARGET("avx2") static uint64_t batStateMaskAvx2(const VHDXBatEntry *entries, size_t n, uint64_t state)
+{
+    uint64_t mask = 0;
+    size_t i = 0;
+    const __m256i stateBits = _mm256_set1_epi64x(VHDX_BAT_STATE_BIT_MASK);
+    const __m256i want = _mm256_set1_epi64x(state);
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(entries + i));
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_and_si256(v, stateBits), want);
+        mask |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+    return mask | (i < n ? batStateMaskGeneric(entries + i, n - i, state) << i : 0);
+}
+#endif
+
+/* the AVX2 kernel when the CPU has it, picked once */
+static VDBatStateMaskFn batStateMaskKernel()
+{
+#ifdef VD_X86_KERNELS
+    static const VDBatStateMaskFn kernel = (VDCpuFeatures() & VD_CPU_AVX2) ? batStateMaskAvx2 : batStateMaskGeneric;
+    return kernel;
+#else
+    return batStateMaskGeneric;
+#endif
+}
+
+static void appendBlockRun(std::vector<VHDXBlockRun> & runs, const VHDXBlockRun & run)
+{
+    if (!runs.empty()) {
+        VHDXBlockRun & last = runs.back();
+        if (last.state == run.state && last.block + last.count == run.block) {
+            last.count += run.count;
+            return;
+        }
+    }
+    runs.push_back(run);
+}
+
+/*
+* Collect the runs of payload blocks of chunks [first, last) that hold data:
+* fully or partially present, and for a differencing disk zeroed. Entries are
+* classified 64 at a time into state masks, and runs are cut from the masks.
+*/
+void VHDXParser::vhdxDecodeChunks(VDVHDXState *s, uint64_t first, uint64_t last, std::vector<VHDXBlockRun> & runs)
+{
+    VDBatStateMaskFn batStateMask = batStateMaskKernel();
+    uint64_t blocks = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    for (uint64_t chunk = first; chunk < last; ++chunk) {
+        const VHDXBatEntry *entries = s->bat + chunk * (s->chunk_ratio + 1);
+        uint64_t base = chunk * s->chunk_ratio;
+        uint64_t n = std::min<uint64_t>(s->chunk_ratio, blocks - base);
+        for (uint64_t i = 0; i < n; i += 64) {
+            size_t count = (size_t)std::min<uint64_t>(64, n - i);
+            uint64_t full = batStateMask(entries + i, count, PAYLOAD_BLOCK_FULLY_PRESENT);
+            uint64_t partial = batStateMask(entries + i, count, PAYLOAD_BLOCK_PARTIALLY_PRESENT);
+            uint64_t zero = s->parent_entries ? batStateMask(entries + i, count, PAYLOAD_BLOCK_ZERO) : 0;
+            uint64_t any = full | partial | zero;
+            while (any) {
+                uint32_t bit = trailingZeros64(any);
+                VHDXBlockRun run;
+                uint64_t same;
+                if ((full >> bit) & 1) {
+                    same = full;
+                    run.state = PAYLOAD_BLOCK_FULLY_PRESENT;
+                }
+                else if ((partial >> bit) & 1) {
+                    same = partial;
+                    run.state = PAYLOAD_BLOCK_PARTIALLY_PRESENT;
+                }
+                else {
+                    same = zero;
+                    run.state = PAYLOAD_BLOCK_ZERO;
+                }
+                uint64_t rest = ~(same >> bit);
+                uint32_t length = rest ? trailingZeros64(rest) : 64 - bit;
+                run.block = base + i + bit;
+                run.count = length;
+                appendBlockRun(runs, run);
+                any = (bit + length >= 64) ? 0 : any & (~UINT64_C(0) << (bit + length));
+            }
+        }
+    }
+}
+
+/*
+* Decode the whole BAT into block runs. Large tables are split on chunk
+* boundaries, so that no task sees a sector bitmap entry in the middle of
+* its range, decoded on the pool and the per-task runs stitched in order.
+*/
+void VHDXParser::vhdxDecodeBat(VDVHDXState *s, std::vector<VHDXBlockRun> & runs)
+{
+    VD_STAT_PHASE(VD_STAT_BAT_DECODE);
+    uint64_t blocks = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    uint64_t chunks = DIV_ROUND_UP(blocks, s->chunk_ratio);
+    runs.clear();
+    if (_decodeThreads == 1 || s->bat_entries < VHDX_PARALLEL_BAT_MIN || chunks < 2) {
+        vhdxDecodeChunks(s, 0, chunks, runs);
+        return;
+    }
+
+    VDThreadPool pool(_decodeThreads);
+    size_t tasks = (size_t)std::min<uint64_t>(chunks, (uint64_t)pool.Size() * 4);
+    std::vector<std::vector<VHDXBlockRun> > parts(tasks);
+    pool.ParallelFor(tasks, [&](size_t t) {
+        vhdxDecodeChunks(s, chunks * t / tasks, chunks * (t + 1) / tasks, parts[t]);
+    });
+    for (size_t t = 0; t < tasks; ++t) {
+        for (size_t r = 0; r < parts[t].size(); ++r) {
+            appendBlockRun(runs, parts[t][r]);
+        }
+    }
+}
+
+/*
+* A fixed image keeps every block allocated, laid out when the image was
+* created, but the file may still be sparse. Remember where the host has
+* allocated it, unless that is the whole file.
+*/
+void VHDXParser::vhdxQueryHostRanges(VDVHDXState *s)
+{
+    _hostRanges.clear();
+    _hostSparse = false;
+    if (!_hostAllocation || (s->params.data_bits & VHDX_PARAMS_HAS_PARENT) ||
+        !(s->params.data_bits & VHDX_PARAMS_LEAVE_BLOCKS_ALLOCED)) {
+        return;
+    }
+    uint64_t fileSize = io->GetFileSize();
+    if (!io->GetAllocatedRanges(0, fileSize, _hostRanges)) {
+        return;
+    }
+    _hostSparse = !(_hostRanges.size() == 1 && _hostRanges[0].offset == 0 && _hostRanges[0].length == fileSize);
+    if (!_hostSparse) {
+        _hostRanges.clear();
+    }
+}
+
+/* Extents of a fixed image that the host has allocated, the holes of its
+* payload read as zero. */
+void VHDXParser::vhdxGetAllocatedExtents(VDVHDXState *s, const std::vector<VHDXBlockRun> & blockRuns, std::vector<DataExtent> & extents)
+{
+    uint64_t runOffset = 0, runLength = 0, runFileOffset = 0;
+    for (size_t b = 0; b < blockRuns.size(); ++b) {
+        if (blockRuns[b].state != PAYLOAD_BLOCK_FULLY_PRESENT) {
+            continue;
+        }
+        for (uint64_t pbindex = blockRuns[b].block; pbindex < blockRuns[b].block + blockRuns[b].count; ++pbindex) {
+            uint64_t offset = pbindex * s->block_size;
+            if (offset >= s->virtual_disk_size) {
+                break;
+            }
+            uint64_t length = std::min<uint64_t>(s->block_size, s->virtual_disk_size - offset);
+            uint64_t fileOffset = s->bat[pbindex + (pbindex >> s->chunk_ratio_bits)] & VHDX_BAT_FILE_OFF_MASK;
+            /* look up contiguous blocks, usually the whole image, at once */
+            if (runLength && runOffset + runLength == offset && runFileOffset + runLength == fileOffset) {
+                runLength += length;
+                continue;
+            }
+            if (runLength) {
+                AppendAllocatedExtent(extents, runOffset, runLength, runFileOffset, _hostRanges);
+            }
+            runOffset = offset;
+            runLength = length;
+            runFileOffset = fileOffset;
+        }
+    }
+    if (runLength) {
+        AppendAllocatedExtent(extents, runOffset, runLength, runFileOffset, _hostRanges);
     }
 }
 
 NS_IMETHODIMP_(void)
 VHDXParser::GetDataAreaList(std::list<DataArea> & arealist)
 {
-    int ret = 0;
-    s->bat = (VHDXBatEntry*)malloc(s->bat_rt.length);
-    if (s->bat == NULL) {
-        throw exception("malloc  memory failed");
-    }
-    Read(fileHandle, s->bat_offset, (char *)s->bat, s->bat_rt.length);
-    uint64_t payblocks = s->chunk_ratio;
-    uint64_t pbindex = 0;
-    for (uint32_t i = 0; i < s->bat_entries; ++i) {
-        if (payblocks--) {
-            /* payload bat entries */
-            if (((s->bat[i] & VHDX_BAT_STATE_BIT_MASK) == PAYLOAD_BLOCK_FULLY_PRESENT)
-                || ((s->bat[i] & VHDX_BAT_STATE_BIT_MASK) == PAYLOAD_BLOCK_PARTIALLY_PRESENT)) {
-                //uint64_t payblocksOffset = s->bat[i] & VHDX_BAT_FILE_OFF_MASK;
-                DataArea area;
-                area.offset = (uint32_t)((pbindex*s->block_size)/MiB);
-                area.length = s->block_size/MiB;
-                arealist.push_back(area);
+    VD_STAT_SCOPE(_stats);
+    DataAreaMap areamap;
+    GetDataAreaList(areamap);
+    areamap.ToList(arealist);
+}
+
+NS_IMETHODIMP_(void)
+VHDXParser::GetDataAreaList(DataAreaMap & areamap)
+{
+    VD_STAT_SCOPE(_stats);
+    if (vhdxGetPrunedAreas(areamap)) {
+        return;
+    }
+    std::vector<BitmapRun> runs;
+    std::vector<VHDXBlockRun> blockRuns;
+    vhdxLoadBat(s);
+    vhdxDecodeBat(s, blockRuns);
+    if (_hostSparse) {
+        std::vector<DataExtent> extents;
+        vhdxGetAllocatedExtents(s, blockRuns, extents);
+        AppendExtentAreas(areamap, extents);
+        return;
+    }
+    for (size_t b = 0; b < blockRuns.size(); ++b) {
+        if (blockRuns[b].state == PAYLOAD_BLOCK_ZERO) {
+            continue;
+        }
+        if (blockRuns[b].state == PAYLOAD_BLOCK_FULLY_PRESENT) {
+            uint64_t start = blockRuns[b].block * s->block_size;
+            uint64_t end = std::min((blockRuns[b].block + blockRuns[b].count) * s->block_size, s->virtual_disk_size);
+            areamap.Append((uint32_t)(start / MiB), (uint32_t)(DIV_ROUND_UP(end, MiB) - start / MiB));
+            continue;
+        }
+        for (uint64_t pbindex = blockRuns[b].block; pbindex < blockRuns[b].block + blockRuns[b].count; ++pbindex) {
+            if (!vhdxBlockRuns(s, pbindex, runs)) {
+                continue;
+            }
+            uint64_t offset = pbindex * s->block_size;
+            for (size_t r = 0; r < runs.size(); ++r) {
+                uint64_t start = offset + runs[r].start * s->logical_sector_size;
+                uint64_t end = std::min(start + runs[r].count * s->logical_sector_size, s->virtual_disk_size);
+                if (start >= end) {
+                    break;
+                }
+                areamap.Append((uint32_t)(start / MiB), (uint32_t)(DIV_ROUND_UP(end, MiB) - start / MiB));
+            }
+        }
+    }
+}
+
+NS_IMETHODIMP_(void)
+VHDXParser::GetDataAreaList(AllocationBitmap & bitmap)
+{
+    VD_STAT_SCOPE(_stats);
+    DataAreaMap pruned;
+    if (vhdxGetPrunedAreas(pruned)) {
+        bitmap.Resize(DIV_ROUND_UP(s->virtual_disk_size, MiB));
+        for (size_t i = 0; i < pruned.Size(); ++i) {
+            bitmap.SetRange(pruned.Offset(i), pruned.Length(i));
+        }
+        return;
+    }
+    std::vector<BitmapRun> runs;
+    std::vector<VHDXBlockRun> blockRuns;
+    vhdxLoadBat(s);
+    vhdxDecodeBat(s, blockRuns);
+    bitmap.Resize(DIV_ROUND_UP(s->virtual_disk_size, MiB));
+    if (_hostSparse) {
+        std::vector<DataExtent> extents;
+        DataAreaMap areamap;
+        vhdxGetAllocatedExtents(s, blockRuns, extents);
+        AppendExtentAreas(areamap, extents);
+        for (size_t i = 0; i < areamap.Size(); ++i) {
+            bitmap.SetRange(areamap.Offset(i), areamap.Length(i));
+        }
+        return;
+    }
+    for (size_t b = 0; b < blockRuns.size(); ++b) {
+        if (blockRuns[b].state == PAYLOAD_BLOCK_ZERO) {
+            continue;
+        }
+        if (blockRuns[b].state == PAYLOAD_BLOCK_FULLY_PRESENT) {
+            uint64_t start = blockRuns[b].block * s->block_size;
+            uint64_t end = std::min((blockRuns[b].block + blockRuns[b].count) * s->block_size, s->virtual_disk_size);
+            bitmap.SetRange(start / MiB, DIV_ROUND_UP(end, MiB) - start / MiB);
+            continue;
+        }
+        for (uint64_t pbindex = blockRuns[b].block; pbindex < blockRuns[b].block + blockRuns[b].count; ++pbindex) {
+            if (!vhdxBlockRuns(s, pbindex, runs)) {
+                continue;
+            }
+            uint64_t offset = pbindex * s->block_size;
+            for (size_t r = 0; r < runs.size(); ++r) {
+                uint64_t start = offset + runs[r].start * s->logical_sector_size;
+                uint64_t end = std::min(start + runs[r].count * s->logical_sector_size, s->virtual_disk_size);
+                if (start >= end) {
+                    break;
+                }
+                bitmap.SetRange(start / MiB, DIV_ROUND_UP(end, MiB) - start / MiB);
+            }
+        }
+    }
+}
+
+NS_IMETHODIMP_(void)
+VHDXParser::GetDataExtentList(std::vector<DataExtent> & extents)
+{
+    VD_STAT_SCOPE(_stats);
+    if (!_zeroGranularity) {
+        vhdxGetDataExtents(s, extents);
+        return;
+    }
+    std::vector<DataExtent> found;
+    vhdxGetDataExtents(s, found);
+    VDPruneZeroExtents(this, found, _zeroGranularity);
+    extents.insert(extents.end(), found.begin(), found.end());
+}
+
+/* Areas of the extents left by the zero scan, false if the scan is off. */
+bool VHDXParser::vhdxGetPrunedAreas(DataAreaMap & areamap)
+{
+    if (!_zeroGranularity) {
+        return false;
+    }
+    std::vector<DataExtent> extents;
+    GetDataExtentList(extents);
+    AppendExtentAreas(areamap, extents);
+    return true;
+}
+
+void VHDXParser::vhdxGetDataExtents(VDVHDXState *s, std::vector<DataExtent> & extents)
+{
+    std::vector<BitmapRun> runs;
+    std::vector<VHDXBlockRun> blockRuns;
+    vhdxLoadBat(s);
+    vhdxDecodeBat(s, blockRuns);
+    if (_hostSparse) {
+        vhdxGetAllocatedExtents(s, blockRuns, extents);
+        return;
+    }
+    for (size_t b = 0; b < blockRuns.size(); ++b) {
+        if (blockRuns[b].state == PAYLOAD_BLOCK_ZERO) {
+            /* a zeroed block of a differencing disk hides its parent's data */
+            uint64_t start = blockRuns[b].block * s->block_size;
+            uint64_t end = std::min((blockRuns[b].block + blockRuns[b].count) * s->block_size, s->virtual_disk_size);
+            AppendDataExtent(extents, start, end - start, VD_NO_FILE_OFFSET);
+            continue;
+        }
+        for (uint64_t pbindex = blockRuns[b].block; pbindex < blockRuns[b].block + blockRuns[b].count; ++pbindex) {
+            if (!vhdxBlockRuns(s, pbindex, runs)) {
+                continue;
             }
-            ++pbindex;
+            uint64_t offset = pbindex * s->block_size;
+            uint64_t fileOffset = s->bat[pbindex + (pbindex >> s->chunk_ratio_bits)] & VHDX_BAT_FILE_OFF_MASK;
+            for (size_t r = 0; r < runs.size(); ++r) {
+                uint64_t start = runs[r].start * s->logical_sector_size;
+                if (offset + start >= s->virtual_disk_size) {
+                    break;
+                }
+                uint64_t length = std::min(runs[r].count * s->logical_sector_size, s->virtual_disk_size - offset - start);
+                AppendDataExtent(extents, offset + start, length, fileOffset + start);
+            }
+        }
+    }
+}
+
+/*
+* Map the virtual range [offset, offset + size) to the image file. Returns the
+* length of the leading part that is either contiguous in the file, with
+* fileOffset set to its start, or not stored in the file throughout, with
+* fileOffset set to VD_NO_FILE_OFFSET.
+*/
+uint64_t VHDXParser::vhdxMapRange(VDVHDXState *s, uint64_t offset, uint64_t size, uint64_t *fileOffset)
+{
+    uint64_t done = 0;
+    while (done < size) {
+        uint64_t pbindex = (offset + done) >> s->block_size_bits;
+        uint64_t inBlock = (offset + done) & (s->block_size - 1);
+        uint64_t length = std::min(s->block_size - inBlock, size - done);
+        uint64_t blockFileOffset = VD_NO_FILE_OFFSET;
+        VHDXBatEntry entry = s->bat[pbindex + (pbindex >> s->chunk_ratio_bits)];
+        if ((entry & VHDX_BAT_STATE_BIT_MASK) == PAYLOAD_BLOCK_FULLY_PRESENT ||
+            (entry & VHDX_BAT_STATE_BIT_MASK) == PAYLOAD_BLOCK_PARTIALLY_PRESENT) {
+            blockFileOffset = (entry & VHDX_BAT_FILE_OFF_MASK) + inBlock;
+        }
+        if (done == 0) {
+            *fileOffset = blockFileOffset;
+        }
+        else if (*fileOffset == VD_NO_FILE_OFFSET ? blockFileOffset != VD_NO_FILE_OFFSET
+                                                  : blockFileOffset != *fileOffset + done) {
+            break;
+        }
+        done += length;
+    }
+    return done;
+}
+
+NS_IMETHODIMP_(uint64_t)
+VHDXParser::GetVirtualSize()
+{
+    return s->virtual_disk_size;
+}
+
+NS_IMETHODIMP_(void)
+VHDXParser::ReadData(uint64_t offset, char * buffer, uint64_t size)
+{
+    VD_STAT_SCOPE(_stats);
+    vhdxLoadBat(s);
+    if (offset >= s->virtual_disk_size) {
+        memset(buffer, 0, (size_t)size);
+        return;
+    }
+    if (size > s->virtual_disk_size - offset) {
+        memset(buffer + (s->virtual_disk_size - offset), 0, (size_t)(size - (s->virtual_disk_size - offset)));
+        size = s->virtual_disk_size - offset;
+    }
+    while (size) {
+        uint64_t fileOffset;
+        uint64_t length = vhdxMapRange(s, offset, size, &fileOffset);
+        if (fileOffset == VD_NO_FILE_OFFSET) {
+            memset(buffer, 0, (size_t)length);
         }
         else {
-            payblocks = s->chunk_ratio;
-            /* Once differencing files are supported, verify sector bitmap
-            * blocks here */
+            io->Read(fileOffset, buffer, length);
         }
+        offset += length;
+        buffer += length;
+        size -= length;
     }
 }
 
-NS_IMPL_ISUPPORTS1(VHDXParser, ncIVDParser)
+NS_IMPL_ISUPPORTS2(VHDXParser, ncIVDParser, ncIVDParserEx)
 
 VHDXParser::VHDXParser()
-    :s(NULL)
+    :io(NULL), _logOverlay(NULL), _ioBackend(VD_IO_STREAM), _aio(NULL), _queueDepth(0), _decodeThreads(1), _strict(false),
+    _hostAllocation(true), _zeroGranularity(0), _hostSparse(false), s(NULL)
 {
 
 }
@@ -1014,4 +1983,251 @@ VHDXParser::VHDXParser()
 VHDXParser::~VHDXParser()
 {
     Close();
+    delete io;
+}
+
+void VHDXParser::SetIoBackend(VDIoBackend backend)
+{
+    _ioBackend = backend;
+}
+
+void VHDXParser::SetAsyncIo(unsigned queueDepth)
+{
+    _queueDepth = queueDepth;
+}
+
+void VHDXParser::SetDecodeThreads(unsigned threads)
+{
+    _decodeThreads = threads;
+}
+
+void VHDXParser::SetStrictChecks(bool strict)
+{
+    _strict = strict;
+}
+
+void VHDXParser::SetHostAllocation(bool hostAllocation)
+{
+    _hostAllocation = hostAllocation;
+}
+
+void VHDXParser::SetZeroScan(uint32_t granularity)
+{
+    _zeroGranularity = granularity;
+}
+
+void VHDXParser::GetStats(VDStats & stats) const
+{
+    stats = _stats;
+}
+
+NS_IMETHODIMP_(bool)
+VHDXParser::GetParentPaths(std::list<std::string> & parentPaths)
+{
+    parentPaths.insert(parentPaths.end(), _parentPaths.begin(), _parentPaths.end());
+    return (s->params.data_bits & VHDX_PARAMS_HAS_PARENT) != 0;
+}
+
+NS_IMETHODIMP_(void)
+VHDXParser::GetImageId(VDImageId & id)
+{
+    memcpy(id.bytes, &s->headers[s->curr_header]->data_write_guid, sizeof(id.bytes));
+}
+
+/* false for a disk without parent or one that does not record the linkage */
+NS_IMETHODIMP_(bool)
+VHDXParser::GetParentId(VDImageId & id)
+{
+    if (!(s->params.data_bits & VHDX_PARAMS_HAS_PARENT) || !s->has_parent_linkage ||
+        guid_eq(s->parent_linkage, zero_guid)) {
+        return false;
+    }
+    memcpy(id.bytes, &s->parent_linkage, sizeof(id.bytes));
+    return true;
+}
+
+NS_IMETHODIMP_(uint32_t)
+VHDXParser::GetBlockSize()
+{
+    return s->block_size;
+}
+
+NS_IMETHODIMP_(void)
+VHDXParser::GetImageStamp(VDImageStamp & stamp)
+{
+    VHDXHeader *header = s->headers[s->curr_header];
+    vhdxLoadBat(s);
+    stamp.fileSize = io->GetFileSize();
+    stamp.sequence = header->sequence_number;
+    /* a new data write guid means the visible data changed */
+    stamp.batHash = VDHash64(s->bat, (size_t)s->bat_entries * sizeof(VHDXBatEntry),
+        VDHash64(&header->data_write_guid, sizeof(MSGUID), 0));
+    if (_hostSparse) {
+        /* writes into the holes of a fixed image change no BAT entry */
+        stamp.batHash = VDHash64(&_hostRanges[0], _hostRanges.size() * sizeof(VDFileRange), stamp.batHash);
+    }
+}
+
+void VHDXParser::SaveBatSnapshot(VHDXBatSnapshot & snapshot)
+{
+    VHDXHeader *header = s->headers[s->curr_header];
+    uint64_t blocks = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    vhdxLoadBat(s);
+    memcpy(snapshot.dataWriteGuid, &header->data_write_guid, sizeof(snapshot.dataWriteGuid));
+    memcpy(snapshot.logGuid, &header->log_guid, sizeof(snapshot.logGuid));
+    snapshot.sequence = header->sequence_number;
+    snapshot.logSequence = s->log_sequence;
+    snapshot.virtualSize = s->virtual_disk_size;
+    snapshot.blockSize = s->block_size;
+    snapshot.entries.resize((size_t)blocks);
+    for (uint64_t base = 0; base < blocks; base += s->chunk_ratio) {
+        uint64_t n = std::min<uint64_t>(s->chunk_ratio, blocks - base);
+        memcpy(&snapshot.entries[(size_t)base], s->bat + base / s->chunk_ratio * (s->chunk_ratio + 1), (size_t)n * sizeof(VHDXBatEntry));
+    }
+}
+
+bool VHDXParser::GetChangedAreaList(const VHDXBatSnapshot & snapshot, DataAreaMap & areamap)
+{
+    VD_STAT_SCOPE(_stats);
+    VHDXHeader *header = s->headers[s->curr_header];
+    uint64_t blocks = DIV_ROUND_UP(s->virtual_disk_size, s->block_size);
+    if (snapshot.blockSize != s->block_size || snapshot.virtualSize != s->virtual_disk_size ||
+        snapshot.entries.size() != blocks) {
+        return false;
+    }
+    if (snapshot.sequence == header->sequence_number &&
+        !memcmp(snapshot.dataWriteGuid, &header->data_write_guid, sizeof(MSGUID)) &&
+        !memcmp(snapshot.logGuid, &header->log_guid, sizeof(MSGUID)) &&
+        snapshot.logSequence == s->log_sequence) {
+        return true;
+    }
+
+    vhdxLoadBat(s);
+    const uint64_t changeBits = VHDX_BAT_STATE_BIT_MASK | VHDX_BAT_FILE_OFF_MASK;
+    for (uint64_t base = 0; base < blocks; base += s->chunk_ratio) {
+        const VHDXBatEntry *entries = s->bat + base / s->chunk_ratio * (s->chunk_ratio + 1);
+        const uint64_t *saved = &snapshot.entries[(size_t)base];
+        uint64_t n = std::min<uint64_t>(s->chunk_ratio, blocks - base);
+        /* most chunks are untouched between two backups */
+        if (!memcmp(entries, saved, (size_t)n * sizeof(VHDXBatEntry))) {
+            continue;
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            if (((entries[i] ^ saved[i]) & changeBits) == 0) {
+                continue;
+            }
+            uint64_t start = (base + i) * s->block_size;
+            uint64_t end = std::min(start + s->block_size, s->virtual_disk_size);
+            areamap.Append((uint32_t)(start / MiB), (uint32_t)(DIV_ROUND_UP(end, MiB) - start / MiB));
+        }
+    }
+    return true;
+}
+
+#define VHDX_SNAPSHOT_MAGIC "vhdxbat1"
+#define VHDX_SNAPSHOT_VERSION 1
+
+/* snapshot file layout, all little endian, followed by the entries and a
+* VDHash64 of everything before it */
+typedef struct VHDXSnapshotHeader
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t blockSize;
+    uint8_t  dataWriteGuid[16];
+    uint8_t  logGuid[16];
+    uint64_t sequence;
+    uint64_t logSequence;
+    uint64_t virtualSize;
+    uint64_t entryCount;
+} VHDXSnapshotHeader;
+
+bool VHDXBatSnapshot::Store(const std::string & filePath) const
+{
+    VHDXSnapshotHeader header;
+    memcpy(header.magic, VHDX_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = VHDX_SNAPSHOT_VERSION;
+    header.blockSize = blockSize;
+    memcpy(header.dataWriteGuid, dataWriteGuid, sizeof(header.dataWriteGuid));
+    memcpy(header.logGuid, logGuid, sizeof(header.logGuid));
+    header.sequence = sequence;
+    header.logSequence = logSequence;
+    header.virtualSize = virtualSize;
+    header.entryCount = entries.size();
+
+    uint64_t checksum = VDHash64(&header, sizeof(header), 0);
+    if (!entries.empty()) {
+        checksum = VDHash64(&entries[0], entries.size() * sizeof(uint64_t), checksum);
+    }
+
+    /* write a private file and rename it over the snapshot, so a crash never
+    * leaves half a snapshot behind */
+    std::string tmpPath = filePath + ".tmp";
+    {
+        std::ofstream outfile(tmpPath.c_str(), ios::out | ios::binary | ios::trunc);
+        if (outfile.fail()) {
+            return false;
+        }
+        outfile.write((const char *)&header, sizeof(header));
+        if (!entries.empty()) {
+            outfile.write((const char *)&entries[0], entries.size() * sizeof(uint64_t));
+        }
+        outfile.write((const char *)&checksum, sizeof(checksum));
+        if (outfile.fail()) {
+            outfile.close();
+            remove(tmpPath.c_str());
+            return false;
+        }
+    }
+#ifdef _WIN32
+    remove(filePath.c_str());
+#endif
+    if (rename(tmpPath.c_str(), filePath.c_str()) != 0) {
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool VHDXBatSnapshot::Load(const std::string & filePath)
+{
+    std::ifstream infile(filePath.c_str(), ios::in | ios::binary);
+    if (infile.fail()) {
+        return false;
+    }
+    VHDXSnapshotHeader header;
+    infile.read((char *)&header, sizeof(header));
+    if (infile.fail() || memcmp(header.magic, VHDX_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != VHDX_SNAPSHOT_VERSION) {
+        return false;
+    }
+    /* a VHDX holds at most 64 TiB in blocks of at least 1 MiB */
+    if (header.entryCount > VHDX_MAX_IMAGE_SIZE / MiB) {
+        return false;
+    }
+    std::vector<uint64_t> loaded((size_t)header.entryCount);
+    if (!loaded.empty()) {
+        infile.read((char *)&loaded[0], loaded.size() * sizeof(uint64_t));
+    }
+    uint64_t checksum;
+    infile.read((char *)&checksum, sizeof(checksum));
+    if (infile.fail() || infile.peek() != EOF) {
+        return false;
+    }
+    uint64_t expected = VDHash64(&header, sizeof(header), 0);
+    if (!loaded.empty()) {
+        expected = VDHash64(&loaded[0], loaded.size() * sizeof(uint64_t), expected);
+    }
+    if (checksum != expected) {
+        return false;
+    }
+
+    memcpy(dataWriteGuid, header.dataWriteGuid, sizeof(dataWriteGuid));
+    memcpy(logGuid, header.logGuid, sizeof(logGuid));
+    sequence = header.sequence;
+    logSequence = header.logSequence;
+    virtualSize = header.virtualSize;
+    blockSize = header.blockSize;
+    entries.swap(loaded);
+    return true;
 }
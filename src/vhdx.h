@@ -1,4 +1,4 @@
-#pragma once
+﻿#pragma once
 #ifndef _VHDX_H_
 #define _VHDX_H_
 
@@ -6,7 +6,12 @@
 #include <string>
 #include <list>
 #include <fstream>
-#include "ncIVDParser.h"
+#include "ncIVDParserEx.h"
+#include "vdio.h"
+#include "vdaio.h"
+#include "vdarena.h"
+#include "vdinterval.h"
+#include "vdstats.h"
 using namespace std;
 
 /* struct DataArea
@@ -15,26 +20,133 @@ using namespace std;
     uint32_t length;
 }; */
 struct VDVHDXState;
-class  VHDXParser : public ncIVDParser
+struct VHDXBlockRun;
+struct VHDXMetadataTableEntry;
+
+/*
+* Payload BAT entries of a VHDX image as of one open, with the header and log
+* state that identify it, to diff a later state of the same image against.
+* Sector bitmap entries are left out.
+*/
+struct VHDXBatSnapshot
+{
+    uint8_t  dataWriteGuid[16];
+    uint8_t  logGuid[16];
+    uint64_t sequence;          /* header sequence number */
+    uint64_t logSequence;       /* highest log entry sequence, 0 if none */
+    uint64_t virtualSize;
+    uint32_t blockSize;
+    std::vector<uint64_t> entries;
+
+    /* Save to or restore from filePath. A missing, damaged or foreign file
+    * fails the load. */
+    bool Store(const std::string & filePath) const;
+    bool Load(const std::string & filePath);
+};
+
+class  VHDXParser : public ncIVDParserEx
 {
 public:
     NS_DECL_ISUPPORTS
     NS_DECL_NCIVDPARSE
+    NS_DECL_NCIVDPARSEEX
     VHDXParser();
     ~VHDXParser();
 
+    /* I/O backend used by the next Open, VD_IO_STREAM by default. */
+    void SetIoBackend(VDIoBackend backend);
+
+    /* Prefetch sector bitmap blocks through a VDAsyncReader with
+    * queueDepth reads in flight, 0 (the default) reads them on demand. */
+    void SetAsyncIo(unsigned queueDepth);
+
+    /* Decode large BATs on threads threads, 0 uses every core. The default
+    * of 1 decodes on the calling thread. */
+    void SetDecodeThreads(unsigned threads);
+
+    /* Verify the CRC-32C of the headers, the region table and the log
+    * entries on open. Off by default, a header or region table copy with a
+    * bad checksum is then treated like a missing one; Open fails when
+    * neither header is left. */
+    void SetStrictChecks(bool strict);
+
+    /* For a fixed image, one that keeps every block allocated and has no
+    * parent, report only the payload the host file system has allocated,
+    * queried once at Open, so the holes of a thin provisioned image are
+    * skipped. On by default. */
+    void SetHostAllocation(bool hostAllocation);
+
+    /* Read the data of every extent and leave out the all zero stretches of
+    * granularity bytes, see VDPruneZeroExtents, from GetDataExtentList and
+    * GetDataAreaList. Costs a read of all the data; 0, the default, skips
+    * the scan. */
+    void SetZeroScan(uint32_t granularity);
+
+    /* Snapshot the payload BAT of the open image. */
+    void SaveBatSnapshot(VHDXBatSnapshot & snapshot);
+
+    /* Append the MiB areas of every block whose BAT entry changed state or
+    * file offset since snapshot was taken. While the header sequence and the
+    * log are unchanged no BAT update can have happened, and the BAT is not
+    * read at all. Data rewritten inside an allocated block changes no entry
+    * and is not reported. Returns false if the snapshot is of an image with
+    * another geometry, the caller must then rescan in full. */
+    bool GetChangedAreaList(const VHDXBatSnapshot & snapshot, DataAreaMap & areamap);
+
+    /* What the calling thread recorded in this parser since the last Open,
+    * the open itself included. All zero without VD_ENABLE_STATS. */
+    void GetStats(VDStats & stats) const;
+
 private:
     void vhdxInit(VDVHDXState *s);
+    void vhdxReadSection(VDVHDXState *s);
+    void vhdxReleaseOpenBuffers(VDVHDXState *s);
     bool vhdxSignatureCheck(VDVHDXState *s);
-    int  vhdxRegionCheck(VDVHDXState *s, uint64_t start, uint64_t length);
+    int  vhdxRegionCheck(uint64_t start, uint64_t length);
     void vhdxCalcBatEntries(VDVHDXState *s);
+    void vhdxReadMetadata(VDVHDXState *s);
+    void vhdxReadMetadataItem(VDVHDXState *s, const VHDXMetadataTableEntry & entry, void *buffer, uint32_t size);
     int  vhdxParseMetadata(VDVHDXState *s);
+    int  vhdxParseParentLocator(VDVHDXState *s);
+    int  vhdxRegisterHeaderRegions(VDVHDXState *s);
     int  vhdxOpenRegionTables(VDVHDXState *s);
-    void vhdxRegionRegister(VDVHDXState *s, uint64_t start, uint64_t length);
+    int  vhdxRegionRegister(uint64_t start, uint64_t length);
     void vhdxParseHeader(VDVHDXState *s);
-    void vhdxRegionUnregisterAll(VDVHDXState *s);
+    void vhdxReplayLog(VDVHDXState *s);
+    void vhdxReleaseLog();
+    void vhdxLoadBat(VDVHDXState *s);
+    bool vhdxBlockRuns(VDVHDXState *s, uint64_t pbindex, std::vector<BitmapRun> & runs);
+    bool vhdxChunkHasPartial(VDVHDXState *s, uint64_t chunk);
+    void vhdxDecodeChunks(VDVHDXState *s, uint64_t first, uint64_t last, std::vector<VHDXBlockRun> & runs);
+    void vhdxDecodeBat(VDVHDXState *s, std::vector<VHDXBlockRun> & runs);
+    uint64_t vhdxMapRange(VDVHDXState *s, uint64_t offset, uint64_t size, uint64_t *fileOffset);
+    const uint8_t *vhdxPrefetchSectorBitmaps(VDVHDXState *s, uint64_t chunk);
+    void vhdxStatBat(VDVHDXState *s);
+    void vhdxQueryHostRanges(VDVHDXState *s);
+    void vhdxGetAllocatedExtents(VDVHDXState *s, const std::vector<VHDXBlockRun> & blockRuns, std::vector<DataExtent> & extents);
+    void vhdxGetDataExtents(VDVHDXState *s, std::vector<DataExtent> & extents);
+    bool vhdxGetPrunedAreas(DataAreaMap & areamap);
 private:
-    std::ifstream fileHandle;
+    VDIo *io;
+    VDOverlayIo *_logOverlay;
+    std::list<std::string> _parentPaths;
+    VDIoBackend _ioBackend;
+    VDAsyncReader *_aio;
+    unsigned _queueDepth;
+    unsigned _decodeThreads;
+    bool _strict;
+    bool _hostAllocation;
+    uint32_t _zeroGranularity;
+    VDStats _stats;
+    /* state of the open image, reset by Close */
+    VDArena _arena;
+    /* file ranges of the header section, log and regions */
+    VDIntervalSet _regions;
+    std::vector<uint8_t> _sbWindow;
+    std::vector<uint64_t> _sbWindowChunks;
+    /* fixed image with holes: the allocated ranges of the file */
+    std::vector<VDFileRange> _hostRanges;
+    bool _hostSparse;
     VDVHDXState *s;
 };
 
@@ -0,0 +1,530 @@
+#include <abprec.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fstream>
+#include <list>
+#include <string>
+#include <utility>
+#include <vector>
+#include "ncIVDParserEx.h"
+#include "areamap.h"
+#include "bitmap.h"
+#include "vdchain.h"
+#include "vdcache.h"
+#include "vdwriter.h"
+#include "vhdx.h"
+
+using namespace std;
+
+#define KiB              (1 * 1024)
+#define MiB            (KiB * 1024)
+
+/* Checks of parser results against synthetic images from VDImageWrite.
+*  Usage: vdcheck DIR, where DIR takes the images for the duration of the
+*  run. Exits non-zero on the first failed check. */
+
+static int g_failed = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "vdcheck: FAILED %s\n", what);
+        ++g_failed;
+    }
+}
+
+static bool sameMap(const DataAreaMap & a, const DataAreaMap & b)
+{
+    if (a.Size() != b.Size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.Size(); ++i) {
+        if (a.Offset(i) != b.Offset(i) || a.Length(i) != b.Length(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* MiB areas the present sectors of spec's allocated blocks touch, rounded
+*  outward. */
+static void expectedAreas(const VDImageSpec & spec, DataAreaMap & areamap)
+{
+    VDImageLayout layout(spec);
+    VDImageBlock block;
+    while (layout.Next(block)) {
+        uint64_t start = block.index * layout.BlockSize() + (uint64_t)block.sectorStart * layout.SectorSize();
+        uint64_t end = start + (uint64_t)block.sectorCount * layout.SectorSize();
+        areamap.Append((uint32_t)(start / MiB), (uint32_t)((end + MiB - 1) / MiB - start / MiB));
+    }
+}
+
+/* The area map, list and bitmap of an open parser all match expected. */
+static void checkAreaViews(ncIVDParserEx *parser, const DataAreaMap & expected, const std::string & what)
+{
+    DataAreaMap areamap;
+    parser->GetDataAreaList(areamap);
+    check(sameMap(areamap, expected), (what + ": area map").c_str());
+
+    std::list<DataArea> arealist;
+    parser->GetDataAreaList(arealist);
+    DataAreaMap listed;
+    for (std::list<DataArea>::const_iterator it = arealist.begin(); it != arealist.end(); ++it) {
+        check(it->length != 0, (what + ": area list entry not empty").c_str());
+        listed.Append(it->offset, it->length);
+    }
+    check(sameMap(listed, expected), (what + ": area list").c_str());
+
+    AllocationBitmap bitmap;
+    parser->GetDataAreaList(bitmap);
+    DataAreaMap mapped;
+    bitmap.ToMap(mapped);
+    check(sameMap(mapped, expected), (what + ": allocation bitmap").c_str());
+    check(bitmap.Count() == expected.TotalLength(), (what + ": allocation bitmap count").c_str());
+}
+
+typedef std::vector<std::pair<uint64_t, uint64_t> > ByteRanges;
+
+static void appendRange(ByteRanges & ranges, uint64_t offset, uint64_t length)
+{
+    if (!ranges.empty() && ranges.back().first + ranges.back().second == offset) {
+        ranges.back().second += length;
+    }
+    else {
+        ranges.push_back(std::make_pair(offset, length));
+    }
+}
+
+/* Virtual byte ranges of the present sectors of spec's allocated blocks. */
+static void expectedRanges(const VDImageSpec & spec, ByteRanges & ranges)
+{
+    VDImageLayout layout(spec);
+    VDImageBlock block;
+    while (layout.Next(block)) {
+        appendRange(ranges, block.index * layout.BlockSize() + (uint64_t)block.sectorStart * layout.SectorSize(),
+            (uint64_t)block.sectorCount * layout.SectorSize());
+    }
+}
+
+/* Virtual byte ranges of the extents stored in the image file, or with
+*  stored false of those without a file offset. */
+static void extentRanges(const std::vector<DataExtent> & extents, bool stored, ByteRanges & ranges)
+{
+    for (size_t i = 0; i < extents.size(); ++i) {
+        if ((extents[i].fileOffset != VD_NO_FILE_OFFSET) == stored) {
+            appendRange(ranges, extents[i].offset, extents[i].length);
+        }
+    }
+}
+
+/* Dynamic VHD with blocks smaller than the MiB unit of the area lists. */
+static void checkSmallBlocks(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHD_DYNAMIC;
+    spec.virtualSize = 64 * MiB;
+    spec.blockSize = 512 * KiB;
+    spec.fillRatio = 0.5;
+    spec.fragmentation = 1;
+    spec.seed = 1;
+    std::string path = dir + "/small-blocks.vhd";
+    VDImageWrite(path, spec);
+
+    DataAreaMap expected;
+    expectedAreas(spec, expected);
+    check(!expected.Empty(), "512 KiB blocks: image has allocated blocks");
+
+    ncIVDParserEx *parser = CreateVDParser(path);
+    parser->Open(path);
+    checkAreaViews(parser, expected, "512 KiB blocks");
+    parser->Close();
+    delete parser;
+    remove(path.c_str());
+}
+
+/* Differencing VHDX whose blocks are all partially present. The blocks are
+*  32 MiB, so a block reported whole would show up beyond the MiB rounding
+*  of its sector range. */
+static void checkPartialBlocks(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHDX_DYNAMIC;
+    spec.virtualSize = 1024 * MiB;
+    spec.blockSize = 32 * MiB;
+    spec.fillRatio = 0.25;
+    spec.seed = 1;
+    std::string base = dir + "/partial-base.vhdx";
+    std::string child = dir + "/partial-child.vhdx";
+    VDImageWrite(base, spec);
+    VDImageSpec delta = spec;
+    delta.type = VD_IMAGE_VHDX_DIFFERENCING;
+    delta.partialRatio = 1;
+    delta.seed = 2;
+    delta.parentPath = "partial-base.vhdx";
+    VDImageWrite(child, delta);
+
+    DataAreaMap expected;
+    expectedAreas(delta, expected);
+    check(!expected.Empty(), "partial blocks: image has allocated blocks");
+
+    ncIVDParserEx *parser = CreateVDParser(child);
+    parser->Open(child);
+    checkAreaViews(parser, expected, "partial blocks");
+    parser->Close();
+    delete parser;
+    remove(child.c_str());
+    remove(base.c_str());
+}
+
+static bool chainOpens(const std::string & path)
+{
+    VDChain chain;
+    try {
+        chain.Open(path);
+    }
+    catch (...) {
+        return false;
+    }
+    bool complete = chain.GetDepth() == 2;
+    chain.Close();
+    return complete;
+}
+
+/* A differencing disk only follows a parent with the identity it links to. */
+static void checkParentLinkage(const std::string & dir, bool vhdx)
+{
+    VDImageSpec spec;
+    spec.type = vhdx ? VD_IMAGE_VHDX_DYNAMIC : VD_IMAGE_VHD_DYNAMIC;
+    spec.virtualSize = 64 * MiB;
+    spec.blockSize = vhdx ? 1 * MiB : 0;
+    spec.seed = 1;
+    std::string ext = vhdx ? ".vhdx" : ".vhd";
+    std::string base = dir + "/linkage-base" + ext;
+    std::string child = dir + "/linkage-child" + ext;
+    VDImageWrite(base, spec);
+
+    VDImageSpec delta = spec;
+    delta.type = vhdx ? VD_IMAGE_VHDX_DIFFERENCING : VD_IMAGE_VHD_DIFFERENCING;
+    delta.fillRatio = 0.1;
+    delta.seed = 2;
+    delta.parentPath = "linkage-base" + ext;
+    VDImageWrite(child, delta);
+    check(chainOpens(child), vhdx ? "VHDX linkage: chain opens" : "VHD linkage: chain opens");
+
+    /* a new base under the same name carries another identity */
+    spec.seed = 3;
+    VDImageWrite(base, spec);
+    check(!chainOpens(child), vhdx ? "VHDX linkage: replaced parent refused" : "VHD linkage: replaced parent refused");
+
+    remove(child.c_str());
+    remove(base.c_str());
+}
+
+/* VHDX whose BAT pages are only current in the log, so every extent found
+*  depends on the replay. */
+static void checkLogReplay(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHDX_DYNAMIC;
+    spec.virtualSize = 64ULL * 1024 * MiB;
+    spec.fillRatio = 0.25;
+    spec.logEntries = 4;
+    spec.seed = 1;
+    std::string path = dir + "/log-replay.vhdx";
+    VDImageWrite(path, spec);
+
+    ByteRanges expected;
+    expectedRanges(spec, expected);
+    static const VDIoBackend backends[] = { VD_IO_STREAM, VD_IO_MMAP };
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+        VHDXParser parser;
+        parser.SetIoBackend(backends[b]);
+        parser.Open(path);
+        std::vector<DataExtent> extents;
+        parser.GetDataExtentList(extents);
+        ByteRanges found;
+        extentRanges(extents, true, found);
+        check(found == expected, backends[b] == VD_IO_MMAP ? "log replay: mmap extents" : "log replay: stream extents");
+        parser.Close();
+    }
+    remove(path.c_str());
+}
+
+/* Zero scan of images whose data is zero but for the stamped first sector
+*  of each block: without a parent only the stamped granules are left, with
+*  one the zeros stay as extents without a file offset. */
+static void checkZeroScan(const std::string & dir)
+{
+    const uint32_t granularity = 4 * KiB;
+    VDImageSpec base;
+    base.type = VD_IMAGE_VHDX_DYNAMIC;
+    base.virtualSize = 256 * MiB;
+    base.blockSize = 1 * MiB;
+    base.fillRatio = 0.5;
+    base.stampData = true;
+    std::string basePath = dir + "/zero-base.vhdx";
+    VDImageWrite(basePath, base);
+    VDImageSpec delta = base;
+    delta.type = VD_IMAGE_VHDX_DIFFERENCING;
+    delta.stampData = false;
+    delta.seed = 2;
+    delta.parentPath = "zero-base.vhdx";
+    std::string deltaPath = dir + "/zero-delta.vhdx";
+    VDImageWrite(deltaPath, delta);
+
+    {
+        ByteRanges expected;
+        VDImageLayout layout(base);
+        VDImageBlock block;
+        while (layout.Next(block)) {
+            appendRange(expected, block.index * layout.BlockSize(), granularity);
+        }
+        VHDXParser parser;
+        parser.SetZeroScan(granularity);
+        parser.Open(basePath);
+        std::vector<DataExtent> extents;
+        parser.GetDataExtentList(extents);
+        ByteRanges found, unstored;
+        extentRanges(extents, true, found);
+        extentRanges(extents, false, unstored);
+        check(found == expected && unstored.empty(), "zero scan: stamped granules kept");
+        DataAreaMap areas;
+        expectedAreas(base, areas);
+        checkAreaViews(&parser, areas, "zero scan");
+        parser.Close();
+    }
+    {
+        ByteRanges expected;
+        expectedRanges(delta, expected);
+        VHDXParser parser;
+        parser.SetZeroScan(granularity);
+        parser.Open(deltaPath);
+        std::vector<DataExtent> extents;
+        parser.GetDataExtentList(extents);
+        ByteRanges found, unstored;
+        extentRanges(extents, true, found);
+        extentRanges(extents, false, unstored);
+        check(found.empty() && unstored == expected, "zero scan: zeros over a parent kept");
+        parser.Close();
+    }
+    remove(deltaPath.c_str());
+    remove(basePath.c_str());
+}
+
+/* File offset of every block with data in the open parser, VD_NO_FILE_OFFSET
+*  for the others. An extent may run over several blocks. */
+static void blockOffsets(ncIVDParserEx *parser, std::vector<uint64_t> & offsets)
+{
+    uint64_t blockSize = parser->GetBlockSize();
+    offsets.assign((size_t)((parser->GetVirtualSize() + blockSize - 1) / blockSize), VD_NO_FILE_OFFSET);
+    std::vector<DataExtent> extents;
+    parser->GetDataExtentList(extents);
+    for (size_t i = 0; i < extents.size(); ++i) {
+        if (extents[i].fileOffset == VD_NO_FILE_OFFSET) {
+            continue;
+        }
+        uint64_t fileBase = extents[i].fileOffset - extents[i].offset;
+        for (uint64_t block = extents[i].offset / blockSize;
+            block * blockSize < extents[i].offset + extents[i].length; ++block) {
+            offsets[(size_t)block] = fileBase + block * blockSize;
+        }
+    }
+}
+
+/* A BAT snapshot diffed against the same image, after a store and load, and
+*  against the image rewritten with other blocks allocated. */
+static void checkSnapshotDiff(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHDX_DYNAMIC;
+    spec.virtualSize = 256 * MiB;
+    spec.blockSize = 1 * MiB;
+    spec.fillRatio = 0.5;
+    spec.fragmentation = 0.5;
+    spec.seed = 1;
+    std::string path = dir + "/snapshot.vhdx";
+    std::string snapshotPath = dir + "/snapshot.bat";
+    VDImageWrite(path, spec);
+
+    VHDXBatSnapshot snapshot;
+    std::vector<uint64_t> before;
+    {
+        VHDXParser parser;
+        parser.Open(path);
+        parser.SaveBatSnapshot(snapshot);
+        blockOffsets(&parser, before);
+        parser.Close();
+    }
+    check(snapshot.Store(snapshotPath), "snapshot: store");
+    VHDXBatSnapshot loaded;
+    check(loaded.Load(snapshotPath), "snapshot: load");
+
+    {
+        VHDXParser parser;
+        parser.Open(path);
+        DataAreaMap changed;
+        check(parser.GetChangedAreaList(loaded, changed) && changed.Size() == 0, "snapshot: unchanged image");
+        parser.Close();
+    }
+
+    spec.seed = 2;
+    VDImageWrite(path, spec);
+    {
+        VHDXParser parser;
+        parser.Open(path);
+        std::vector<uint64_t> after;
+        blockOffsets(&parser, after);
+        DataAreaMap expected;
+        for (size_t i = 0; i < after.size() && i < before.size(); ++i) {
+            if (after[i] != before[i]) {
+                expected.Append((uint32_t)i, 1);
+            }
+        }
+        DataAreaMap changed;
+        check(parser.GetChangedAreaList(loaded, changed), "snapshot: same geometry");
+        check(expected.Size() != 0 && sameMap(changed, expected), "snapshot: changed blocks");
+        parser.Close();
+    }
+
+    spec.blockSize = 2 * MiB;
+    VDImageWrite(path, spec);
+    {
+        VHDXParser parser;
+        parser.Open(path);
+        DataAreaMap changed;
+        check(!parser.GetChangedAreaList(loaded, changed), "snapshot: other geometry refused");
+        parser.Close();
+    }
+    remove(path.c_str());
+    remove(snapshotPath.c_str());
+}
+
+/* Overwrite one byte of the file at path. */
+static void patchByte(const std::string & path, uint64_t offset, char value)
+{
+    std::fstream file(path.c_str(), ios::in | ios::out | ios::binary);
+    file.seekp(offset);
+    file.write(&value, 1);
+}
+
+static bool vhdxOpens(const std::string & path, bool strict)
+{
+    VHDXParser parser;
+    parser.SetStrictChecks(strict);
+    try {
+        parser.Open(path);
+    }
+    catch (...) {
+        return false;
+    }
+    parser.Close();
+    return true;
+}
+
+/* Both VHDX headers intact but for a reserved byte: only the CRC tells. */
+static void checkHeaderChecksums(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHDX_DYNAMIC;
+    spec.virtualSize = 64 * MiB;
+    spec.blockSize = 1 * MiB;
+    spec.seed = 1;
+    std::string path = dir + "/bad-header-crc.vhdx";
+    VDImageWrite(path, spec);
+    check(vhdxOpens(path, true), "header CRC: intact image opens strictly");
+
+    /* past the fields, in the reserved part of each 4 KiB header */
+    patchByte(path, 64 * KiB + 1024, 1);
+    patchByte(path, 128 * KiB + 1024, 1);
+    check(vhdxOpens(path, false), "header CRC: lenient open ignores the CRC");
+    check(!vhdxOpens(path, true), "header CRC: strict open refuses both bad headers");
+
+    remove(path.c_str());
+}
+
+/* Neither header signature left: no open, so nothing reaches the current
+*  header that the stamp, identity and snapshot accessors read. */
+static void checkHeaderSignatures(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHDX_DYNAMIC;
+    spec.virtualSize = 64 * MiB;
+    spec.blockSize = 1 * MiB;
+    spec.seed = 1;
+    std::string path = dir + "/bad-header-signature.vhdx";
+    VDImageWrite(path, spec);
+    patchByte(path, 64 * KiB, 'x');
+    patchByte(path, 128 * KiB, 'x');
+    check(!vhdxOpens(path, false), "header signature: open refuses both bad headers");
+    check(!vhdxOpens(path, true), "header signature: strict open refuses both bad headers");
+
+    remove(path.c_str());
+}
+
+/* A chain is served from the cache until any of its layers changes. */
+static void checkChainCache(const std::string & dir)
+{
+    VDImageSpec spec;
+    spec.type = VD_IMAGE_VHD_DYNAMIC;
+    spec.virtualSize = 64 * MiB;
+    spec.seed = 1;
+    std::string base = dir + "/cache-base.vhd";
+    std::string child = dir + "/cache-child.vhd";
+    VDImageWrite(base, spec);
+    VDImageSpec delta = spec;
+    delta.type = VD_IMAGE_VHD_DIFFERENCING;
+    delta.fillRatio = 0.1;
+    delta.seed = 2;
+    delta.parentPath = "cache-base.vhd";
+    VDImageWrite(child, delta);
+
+    VDAllocationCache cache(dir);
+    DataAreaMap scanned;
+    DataAreaMap cached;
+    {
+        VDChain chain;
+        chain.Open(child);
+        cache.GetDataAreaList(&chain, scanned);
+        cache.GetDataAreaList(&chain, cached);
+    }
+    check(cache.Hits() == 1 && cache.Misses() == 1, "chain cache: second lookup hits");
+    check(sameMap(scanned, cached), "chain cache: cached areas");
+
+    /* the same base written again, only its file time changes */
+    VDImageWrite(base, spec);
+    {
+        VDChain chain;
+        chain.Open(child);
+        DataAreaMap rescanned;
+        cache.GetDataAreaList(&chain, rescanned);
+    }
+    check(cache.Hits() == 1 && cache.Misses() == 2, "chain cache: changed parent misses");
+
+    remove(child.c_str());
+    remove(base.c_str());
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: vdcheck DIR\n");
+        return 2;
+    }
+    try {
+        checkSmallBlocks(argv[1]);
+        checkPartialBlocks(argv[1]);
+        checkParentLinkage(argv[1], false);
+        checkParentLinkage(argv[1], true);
+        checkChainCache(argv[1]);
+        checkLogReplay(argv[1]);
+        checkSnapshotDiff(argv[1]);
+        checkZeroScan(argv[1]);
+        checkHeaderChecksums(argv[1]);
+        checkHeaderSignatures(argv[1]);
+    }
+    catch (...) {
+        fprintf(stderr, "vdcheck: exception\n");
+        return 1;
+    }
+    return g_failed ? 1 : 0;
+}